@@ -86,6 +86,419 @@ static inline void outb(uint16_t port, uint8_t val) { asm volatile ("outb %0, %1
 static inline void outl(uint16_t port, uint32_t val) { asm volatile ("outl %0, %1" : : "a"(val), "d"(port)); }
 static inline uint8_t inb(uint16_t port) { uint8_t ret; asm volatile ("inb %1, %0" : "=a"(ret) : "d"(port)); return ret; }
 static inline uint32_t inl(uint16_t port) { uint32_t ret; asm volatile ("inl %1, %0" : "=a"(ret) : "d"(port)); return ret; }
+
+// --- CPU primitives ---
+static inline void cpuid(uint32_t leaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    asm volatile ("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+static inline uint64_t rdtsc() { uint32_t lo, hi; asm volatile ("rdtsc" : "=a"(lo), "=d"(hi)); return ((uint64_t)hi << 32) | lo; }
+// 64/32 division without libgcc's __udivdi3: two chained divl steps.
+static inline uint64_t u64_div32(uint64_t n, uint32_t d) {
+    uint32_t hi = (uint32_t)(n >> 32), lo = (uint32_t)n, q_hi, q_lo, r;
+    asm ("divl %4" : "=a"(q_hi), "=d"(r) : "a"(hi), "d"(0), "rm"(d));
+    asm ("divl %4" : "=a"(q_lo), "=d"(r) : "a"(lo), "d"(r), "rm"(d));
+    return ((uint64_t)q_hi << 32) | q_lo;
+}
+static inline uint64_t u64_divmod32(uint64_t n, uint32_t d, uint32_t* rem) {
+    uint32_t hi = (uint32_t)(n >> 32), lo = (uint32_t)n, q_hi, q_lo, r;
+    asm ("divl %4" : "=a"(q_hi), "=d"(r) : "a"(hi), "d"(0), "rm"(d));
+    asm ("divl %4" : "=a"(q_lo), "=d"(r) : "a"(lo), "d"(r), "rm"(d));
+    *rem = r;
+    return ((uint64_t)q_hi << 32) | q_lo;
+}
+
+// TSC frequency in kHz, measured once against a 10 ms one-shot on PIT channel 2
+// (the speaker channel, so the IRQ0 tick on channel 0 is left alone).
+static uint32_t g_tsc_khz = 0;
+static uint32_t tsc_calibrate_khz() {
+    if (g_tsc_khz) return g_tsc_khz;
+    const uint16_t PIT_10MS = 11932;           // 1193182 Hz / 100
+    uint8_t p61 = inb(0x61);
+    outb(0x61, p61 & ~0x03);                   // gate low, speaker off
+    outb(0x43, 0xB0);                          // ch2, lo/hi, mode 0
+    outb(0x42, PIT_10MS & 0xFF);
+    outb(0x42, PIT_10MS >> 8);
+    outb(0x61, (p61 & ~0x02) | 0x01);          // gate high: start counting
+    uint64_t t0 = rdtsc();
+    while (!(inb(0x61) & 0x20)) {}             // OUT2 goes high at terminal count
+    uint64_t t1 = rdtsc();
+    outb(0x61, p61);
+    g_tsc_khz = (uint32_t)u64_div32(t1 - t0, 10);
+    if (g_tsc_khz == 0) g_tsc_khz = 1;
+    return g_tsc_khz;
+}
+
+// =============================================================================
+// MONOTONIC CLOCK
+// =============================================================================
+// All kernel timing derives from the TSC, calibrated once against the PIT by
+// clock_init() (the first thing kernel_main does; nothing below is valid
+// before it). Conversions split at milliseconds so the 64-bit products cannot
+// overflow however long the machine stays up. Without an invariant TSC the
+// rate may follow P-states; g_tsc_invariant records which case applies.
+static uint64_t g_tsc_boot = 0;
+static bool g_tsc_invariant = false;
+
+static void clock_init() {
+    tsc_calibrate_khz();
+    uint32_t a, b, c, d;
+    cpuid(0x80000000, &a, &b, &c, &d);
+    if (a >= 0x80000007) {
+        cpuid(0x80000007, &a, &b, &c, &d);
+        g_tsc_invariant = (d >> 8) & 1;
+    }
+    g_tsc_boot = rdtsc();
+}
+
+static inline uint64_t cycles_to_ns(uint64_t cycles) {
+    uint32_t rem;
+    uint64_t ms = u64_divmod32(cycles, g_tsc_khz, &rem);
+    return ms * 1000000 + u64_div32((uint64_t)rem * 1000000, g_tsc_khz);
+}
+static inline uint64_t ns_to_cycles(uint64_t ns) {
+    uint32_t rem;
+    uint64_t ms = u64_divmod32(ns, 1000000, &rem);
+    return ms * g_tsc_khz + u64_div32((uint64_t)rem * g_tsc_khz, 1000000);
+}
+
+static inline uint64_t now_ns() { return cycles_to_ns(rdtsc() - g_tsc_boot); }
+static inline uint64_t now_us() { return u64_div32(now_ns(), 1000); }
+static inline uint64_t now_ms() { return u64_div32(rdtsc() - g_tsc_boot, g_tsc_khz); }
+
+// A point on the TSC timeline. A zero deadline has always expired.
+struct Deadline {
+    uint64_t tsc;
+
+    static Deadline after_ns(uint64_t ns) { return Deadline{ rdtsc() + ns_to_cycles(ns) }; }
+    static Deadline after_us(uint32_t us) { return after_ns((uint64_t)us * 1000); }
+    static Deadline after_ms(uint32_t ms) { return Deadline{ rdtsc() + (uint64_t)ms * g_tsc_khz }; }
+    bool expired() const { return rdtsc() >= tsc; }
+    uint64_t remaining_ns() const {
+        uint64_t t = rdtsc();
+        return t >= tsc ? 0 : cycles_to_ns(tsc - t);
+    }
+};
+
+static inline void udelay(uint32_t us) {
+    Deadline d = Deadline::after_us(us);
+    while (!d.expired()) asm volatile ("pause");
+}
+
+// Stopwatch for profiling, at TSC resolution.
+struct CycleTimer {
+    uint64_t start;
+
+    void reset() { start = rdtsc(); }
+    uint64_t cycles() const { return rdtsc() - start; }
+    uint64_t ns() const { return cycles_to_ns(cycles()); }
+    uint32_t us() const { return (uint32_t)u64_div32(ns(), 1000); }
+};
+
+static const uint32_t DOUBLE_CLICK_MS = 500;
+
+// =============================================================================
+// TIMER WHEEL
+// =============================================================================
+// Kernel deadlines at millisecond resolution. Three levels of 64 slots cover
+// 64 ms, 4 s and 4.4 min ahead; anything later waits on an overflow list.
+// Timers are intrusive list nodes, so arming and cancelling are O(1) and
+// allocate nothing. Each elapsed millisecond advances through one level-0
+// slot. Once every 64 ms the next level-1 slot cascades down, and so on up
+// the levels. Callbacks run from timer_wheel_run() in the main loop, never
+// in IRQ context. They may touch any kernel state and may re-arm their own
+// timer.
+struct KTimer {
+    KTimer* next = nullptr;
+    KTimer* prev = nullptr;         // null while not armed
+    uint64_t expires = 0;           // now_ms() at which it fires
+    void (*fn)(void* arg) = nullptr;
+    void* arg = nullptr;
+};
+
+struct TimerWheel {
+    static const int LEVELS = 3;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const uint32_t SLOT_MASK = SLOTS - 1;
+
+    KTimer slots[LEVELS][SLOTS];    // circular lists with sentinel heads
+    KTimer overflow;
+    uint64_t now;                   // next millisecond to process
+    uint32_t pending, fired;
+
+    static void list_init(KTimer* head) { head->next = head->prev = head; }
+    static bool list_empty(const KTimer* head) { return head->next == head; }
+    static void list_add(KTimer* head, KTimer* t) {
+        t->prev = head->prev; t->next = head;
+        head->prev->next = t; head->prev = t;
+    }
+    static void list_del(KTimer* t) {
+        t->prev->next = t->next; t->next->prev = t->prev;
+        t->next = t->prev = nullptr;
+    }
+
+    void init(uint64_t start_ms) {
+        for (int l = 0; l < LEVELS; l++)
+            for (int i = 0; i < SLOTS; i++) list_init(&slots[l][i]);
+        list_init(&overflow);
+        now = start_ms;
+        pending = fired = 0;
+    }
+
+    // Files a timer in the level whose span covers its distance from `now`.
+    void place(KTimer* t) {
+        uint64_t when = t->expires < now ? now : t->expires;
+        uint64_t delta = when - now;
+        KTimer* head = &overflow;
+        for (int l = 0; l < LEVELS; l++) {
+            if (delta < (1ull << (SLOT_BITS * (l + 1)))) {
+                head = &slots[l][(when >> (SLOT_BITS * l)) & SLOT_MASK];
+                break;
+            }
+        }
+        list_add(head, t);
+    }
+
+    // Re-files every timer on `head` through place(), which moves it down a
+    // level (overflow timers may land back on the overflow list, hence the
+    // detach first).
+    void cascade(KTimer* head) {
+        if (list_empty(head)) return;
+        KTimer* t = head->next;
+        head->prev->next = nullptr;
+        list_init(head);
+        while (t) {
+            KTimer* next = t->next;
+            place(t);
+            t = next;
+        }
+    }
+
+    void run(uint64_t now_ms) {
+        if (pending == 0) { now = now_ms + 1; return; }
+        while (now <= now_ms) {
+            if ((now & SLOT_MASK) == 0) {
+                uint32_t i1 = (now >> SLOT_BITS) & SLOT_MASK;
+                if (i1 == 0) {
+                    uint32_t i2 = (now >> (2 * SLOT_BITS)) & SLOT_MASK;
+                    if (i2 == 0) cascade(&overflow);
+                    cascade(&slots[2][i2]);
+                }
+                cascade(&slots[1][i1]);
+            }
+            KTimer* head = &slots[0][now & SLOT_MASK];
+            now++;
+            while (!list_empty(head)) {
+                KTimer* t = head->next;
+                list_del(t);
+                pending--;
+                fired++;
+                t->fn(t->arg);
+            }
+            if (pending == 0) { now = now_ms + 1; return; }
+        }
+    }
+
+    // Earliest millisecond at which run() may fire something: exact for
+    // level 0 and the next cascade point for the outer levels, which is
+    // never later than the timers waiting there. ~0 if idle.
+    uint64_t next_expiry() const {
+        if (pending == 0) return ~0ull;
+        uint64_t best = ~0ull;
+        for (uint32_t i = 0; i < SLOTS; i++) {
+            if (!list_empty(&slots[0][(now + i) & SLOT_MASK])) { best = now + i; break; }
+        }
+        for (int l = 1; l < LEVELS; l++) {
+            uint32_t shift = SLOT_BITS * l;
+            for (uint32_t j = 0; j <= SLOTS; j++) {
+                uint64_t block = (now >> shift) + j;
+                if ((block << shift) < now) continue;   // this block's cascade is done
+                if (list_empty(&slots[l][block & SLOT_MASK])) continue;
+                if ((block << shift) < best) best = block << shift;
+                break;
+            }
+        }
+        if (!list_empty(&overflow)) {
+            uint64_t lap = ((now >> (SLOT_BITS * LEVELS)) + 1) << (SLOT_BITS * LEVELS);
+            if (lap < best) best = lap;
+        }
+        return best;
+    }
+};
+
+static TimerWheel g_timers;
+
+static inline bool timer_pending(const KTimer* t) { return t->prev != nullptr; }
+
+static void timer_cancel(KTimer* t) {
+    if (!timer_pending(t)) return;
+    TimerWheel::list_del(t);
+    g_timers.pending--;
+}
+
+// (Re)arms `t` to call fn(arg) once, `delay_ms` from now.
+static void timer_arm(KTimer* t, uint32_t delay_ms, void (*fn)(void*), void* arg) {
+    timer_cancel(t);
+    t->expires = now_ms() + delay_ms;
+    t->fn = fn;
+    t->arg = arg;
+    g_timers.place(t);
+    g_timers.pending++;
+}
+
+// =============================================================================
+// INTERRUPTS
+// =============================================================================
+// A flat GDT (code 0x08, data 0x10) replaces whatever the loader left behind,
+// and a 64-entry IDT points at the stubs in boot.S: vectors 0-31 are CPU
+// exceptions, 32-47 are the two 8259 PICs, remapped out of the exception
+// range, 48 is the thread yield, 49 the inter-processor wakeup and 63 the
+// local APIC's spurious vector. Handlers run with interrupts off. They only
+// hand data to the main loop through SPSC rings and volatile flags, never
+// through window state.
+//
+// Every CPU loads its own copy of the GDT, so the base sgdt reports tells
+// the CPUs apart; the interrupt stubs reload every segment register, which
+// rules out a per-CPU segment.
+struct InterruptFrame {
+    uint32_t gs, fs, es, ds;
+    uint32_t edi, esi, ebp, esp0, ebx, edx, ecx, eax;   // pushal
+    uint32_t vector, error;
+    uint32_t eip, cs, eflags;
+};
+
+typedef void (*IrqHandler)(InterruptFrame* frame);
+
+struct __attribute__((packed)) IdtEntry { uint16_t offset_lo, selector; uint8_t zero, flags; uint16_t offset_hi; };
+struct __attribute__((packed)) DescriptorPtr { uint16_t limit; uint32_t base; };
+
+extern "C" uint32_t isr_stub_table[];
+static const int IDT_ENTRIES = 64;
+static const int IRQ_BASE = 0x20;
+static const uint32_t YIELD_VECTOR = 48;
+static const uint32_t IPI_VECTOR = 49;
+static const uint32_t LAPIC_SPURIOUS_VECTOR = 63;
+static const uint16_t KERNEL_CS = 0x08;
+
+static const int MAX_CPUS = 8;
+static uint64_t g_gdts[MAX_CPUS][4] = { { 0, 0x00CF9A000000FFFFull, 0x00CF92000000FFFFull } };  // padded to 32 bytes
+static int g_cpu_count = 1;     // CPUs running; the APs join in smp_init()
+static IdtEntry g_idt[IDT_ENTRIES];
+static const int IRQ_SHARED_MAX = 4;   // handlers per line; PCI INTx lines are shared
+static IrqHandler g_irq_handlers[16][IRQ_SHARED_MAX];
+static volatile uint32_t g_irq_counts[16];
+static volatile uint32_t g_spurious_irqs = 0;
+
+void interrupt_exception(InterruptFrame* frame);   // fatal; draws and halts
+static uint32_t thread_switch(InterruptFrame* frame);
+static uint32_t smp_ipi(InterruptFrame* frame);
+
+// 0 on the bootstrap processor.
+static inline int cpu_index() {
+    DescriptorPtr gdtr;
+    asm volatile ("sgdt %0" : "=m"(gdtr));
+    return (gdtr.base - (uint32_t)g_gdts) / sizeof(g_gdts[0]);
+}
+static inline bool smp_on_ap() { return g_cpu_count > 1 && cpu_index() != 0; }
+
+static inline void irq_disable() { asm volatile ("cli" ::: "memory"); }
+static inline void irq_enable() { asm volatile ("sti" ::: "memory"); }
+// Disables interrupts and returns the previous EFLAGS for irq_restore().
+static inline uint32_t irq_save() {
+    uint32_t flags;
+    asm volatile ("pushfl; popl %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+static inline void irq_restore(uint32_t flags) { if (flags & 0x200) irq_enable(); }
+
+static void pic_remap() {
+    outb(0x20, 0x11); outb(0xA0, 0x11);            // ICW1: edge triggered, cascade, ICW4 follows
+    outb(0x21, IRQ_BASE); outb(0xA1, IRQ_BASE + 8);
+    outb(0x21, 0x04); outb(0xA1, 0x02);            // slave on IRQ2
+    outb(0x21, 0x01); outb(0xA1, 0x01);            // 8086 mode
+    outb(0x21, 0xFB); outb(0xA1, 0xFF);            // everything masked but the cascade
+}
+
+static void irq_set_mask(int irq, bool masked) {
+    uint16_t port = irq < 8 ? 0x21 : 0xA1;
+    uint8_t bit = 1 << (irq & 7);
+    uint8_t m = inb(port);
+    outb(port, masked ? (m | bit) : (m & ~bit));
+}
+
+// Adds a handler to the line and unmasks it. Every handler on a shared line
+// runs for each interrupt, so each must check its own device's status.
+static bool irq_install(int irq, IrqHandler handler) {
+    for (int i = 0; i < IRQ_SHARED_MAX; i++) {
+        if (g_irq_handlers[irq][i] == handler) return true;
+        if (g_irq_handlers[irq][i]) continue;
+        g_irq_handlers[irq][i] = handler;
+        irq_set_mask(irq, false);
+        return true;
+    }
+    return false;
+}
+
+extern "C" uint32_t interrupt_dispatch(InterruptFrame* frame) {
+    if (frame->vector == YIELD_VECTOR) return thread_switch(frame);
+    if (frame->vector == IPI_VECTOR) return smp_ipi(frame);
+    if (frame->vector == LAPIC_SPURIOUS_VECTOR) return (uint32_t)frame;   // no EOI
+    if (frame->vector < 32) {
+        interrupt_exception(frame);
+        return (uint32_t)frame;
+    }
+    int irq = frame->vector - IRQ_BASE;
+    if (irq == 7 || irq == 15) {
+        // Spurious if the in-service bit is clear; a spurious slave IRQ still
+        // owes the master its EOI for the cascade line.
+        uint16_t pic = irq == 7 ? 0x20 : 0xA0;
+        outb(pic, 0x0B);
+        if (!(inb(pic) & 0x80)) {
+            if (irq == 15) outb(0x20, 0x20);
+            g_spurious_irqs = g_spurious_irqs + 1;
+            return (uint32_t)frame;
+        }
+    }
+    g_irq_counts[irq] = g_irq_counts[irq] + 1;
+    for (int i = 0; i < IRQ_SHARED_MAX && g_irq_handlers[irq][i]; i++) g_irq_handlers[irq][i](frame);
+    if (irq >= 8) outb(0xA0, 0x20);
+    outb(0x20, 0x20);
+    return thread_switch(frame);
+}
+
+// Loads CPU `cpu`'s copy of the GDT and reloads every segment register.
+static void gdt_load(int cpu) {
+    if (cpu) memcpy(g_gdts[cpu], g_gdts[0], sizeof(g_gdts[0]));
+    DescriptorPtr gdtr = { 3 * sizeof(uint64_t) - 1, (uint32_t)g_gdts[cpu] };
+    asm volatile ("lgdt %0\n\t"
+                  "ljmp $0x08, $1f\n"
+                  "1:\n\t"
+                  "movw $0x10, %%ax\n\t"
+                  "movw %%ax, %%ds\n\t"
+                  "movw %%ax, %%es\n\t"
+                  "movw %%ax, %%fs\n\t"
+                  "movw %%ax, %%gs\n\t"
+                  "movw %%ax, %%ss"
+                  : : "m"(gdtr) : "eax", "memory");
+}
+
+static void idt_load() {
+    DescriptorPtr idtr = { sizeof(g_idt) - 1, (uint32_t)g_idt };
+    asm volatile ("lidt %0" : : "m"(idtr) : "memory");
+}
+
+// Loads the GDT and IDT and remaps the PICs with every IRQ masked. Interrupts
+// stay disabled until the caller has installed its handlers and runs sti.
+static void interrupts_init() {
+    gdt_load(0);
+    for (int i = 0; i < IDT_ENTRIES; i++) {
+        uint32_t handler = isr_stub_table[i];
+        g_idt[i] = IdtEntry{ (uint16_t)handler, KERNEL_CS, 0, 0x8E, (uint16_t)(handler >> 16) };
+    }
+    idt_load();
+    pic_remap();
+}
+
 static inline uint32_t pci_read_config_dword(uint16_t bus, uint8_t device, uint8_t function, uint8_t offset) {
     uint32_t address = 0x80000000 | ((uint32_t)bus << 16) | ((uint32_t)device << 11) | ((uint32_t)function << 8) | (offset & 0xFC);
     outl(0xCF8, address);
@@ -115,6 +528,19 @@ extern "C" void kernel_main(uint32_t magic, uint32_t multiboot_addr);
 void launch_new_terminal();
 void launch_new_explorer();
 
+// Graphics
+bool gfx_set_render_mode(int bpp);
+void governor_print_stats();
+void irq_print_stats();
+void boot_print_profile();
+void latency_command(const char* args);
+void usb_print_devices();
+void thread_print_stats();
+void smp_print_stats();
+void present_invalidate_all();
+void present_get_stats(uint32_t* tiles_copied, uint32_t* tiles_total);
+extern "C" void mark_screen_dirty();
+
 // FAT32 Function Prototypes
 int fat32_write_file(const char* filename, const void* data, uint32_t size);
 int fat32_remove_file(const char* filename);
@@ -296,8 +722,13 @@ public:
 
 static FreeListAllocator g_allocator;
 
+// Threads preempt each other, so the free list is only touched with
+// interrupts off.
 void* operator new(size_t size) {
-    return g_allocator.allocate(size);
+    uint32_t flags = irq_save();
+    void* p = g_allocator.allocate(size);
+    irq_restore(flags);
+    return p;
 }
 
 void* operator new[](size_t size) {
@@ -305,7 +736,9 @@ void* operator new[](size_t size) {
 }
 
 void operator delete(void* ptr) noexcept {
+    uint32_t flags = irq_save();
     g_allocator.deallocate(ptr);
+    irq_restore(flags);
 }
 
 void operator delete[](void* ptr) noexcept {
@@ -322,6 +755,770 @@ void operator delete[](void* ptr, size_t size) noexcept {
     operator delete[](ptr);
 }
 
+// =============================================================================
+// KERNEL THREADS
+// =============================================================================
+// Preemptive threads on the one CPU. Every interrupt leaves through
+// thread_switch(), which can hand isr_common another thread's saved frame to
+// restore instead of the interrupted one; thread_yield() is a software
+// interrupt on YIELD_VECTOR for the same path. A new thread starts from a
+// hand-built frame on its own stack.
+//
+// Classes are strictly prioritized (UI, then interactive, then background),
+// with round robin and a THREAD_QUANTUM_MS slice inside a class. The boot
+// thread is the UI thread and runs the main loop. When the loop is idle it
+// sleeps until its next deadline or input, which is when lower classes run;
+// with nothing ready the idle thread halts. The PIT is armed one-shot for the
+// earliest sleeper and, if a class is contended, the end of the slice, so a
+// lone busy thread still takes no timer interrupts. x87/SSE state is saved
+// and restored with FXSAVE/FXRSTOR on every switch.
+enum ThreadState : uint8_t { THREAD_FREE, THREAD_READY, THREAD_SLEEPING, THREAD_BLOCKED, THREAD_DEAD };
+enum ThreadPriority : uint8_t { PRIO_UI, PRIO_INTERACTIVE, PRIO_BACKGROUND, PRIO_IDLE };
+
+struct Thread {
+    uint8_t fpu[512] __attribute__((aligned(16)));   // FXSAVE image
+    uint32_t esp;                 // saved InterruptFrame while switched out
+    uint8_t state, priority;
+    bool wake_on_input;           // sleeping: thread_notify_ui() also wakes it
+    uint64_t wake_tsc;            // sleeping: THREAD_NO_WAKE for never
+    uint64_t slice_end;
+    const void* blocked_on;
+    uint8_t* stack;               // kept when the thread dies, reused by the next one
+    void (*entry)(void*);
+    void* arg;
+    char name[16];
+    uint64_t cycles, ran_at;
+    uint32_t switches;
+};
+
+static const int MAX_THREADS = 16;
+static const uint32_t THREAD_STACK_SIZE = 64 * 1024;
+static const uint32_t THREAD_QUANTUM_MS = 10;
+static const uint64_t THREAD_NO_WAKE = ~0ull;
+
+static Thread g_threads[MAX_THREADS];
+static Thread* g_current = nullptr;           // null until threads_init()
+static Thread* const g_ui_thread = &g_threads[0];
+static uint8_t g_fpu_initial[512] __attribute__((aligned(16)));
+static uint64_t g_pit_due = THREAD_NO_WAKE;   // what the PIT is armed for
+
+static void pit_arm_oneshot(uint64_t ns);
+
+static inline void thread_yield() { asm volatile ("int %0" : : "i"(YIELD_VECTOR) : "memory"); }
+
+// Called on the way out of every interrupt with interrupts off. Returns the
+// frame to resume: the interrupted thread's, or the next thread's.
+static uint32_t thread_switch(InterruptFrame* frame) {
+    Thread* cur = g_current;
+    if (!cur) return (uint32_t)frame;
+    uint32_t vector = frame->vector;
+    uint64_t now = rdtsc();
+
+    uint64_t next_wake = THREAD_NO_WAKE;
+    for (int i = 0; i < MAX_THREADS; i++) {
+        Thread& t = g_threads[i];
+        if (t.state != THREAD_SLEEPING) continue;
+        if (now >= t.wake_tsc) t.state = THREAD_READY;
+        else if (t.wake_tsc < next_wake) next_wake = t.wake_tsc;
+    }
+
+    // Best ready thread, scanning from the one after `cur` so equals take turns.
+    // The idle thread is always ready, so there is one.
+    int start = cur - g_threads;
+    Thread* next = nullptr;
+    for (int n = 1; n <= MAX_THREADS; n++) {
+        Thread* t = &g_threads[(start + n) % MAX_THREADS];
+        if (t->state == THREAD_READY && (!next || t->priority < next->priority)) next = t;
+    }
+    if (cur->state == THREAD_READY &&
+        (next->priority > cur->priority || (next->priority == cur->priority && now < cur->slice_end)))
+        next = cur;
+
+    if (next != cur) {
+        cur->esp = (uint32_t)frame;
+        cur->cycles += now - cur->ran_at;
+        asm volatile ("fxsave (%0)" : : "r"(cur->fpu) : "memory");
+        asm volatile ("fxrstor (%0)" : : "r"(next->fpu) : "memory");
+        next->slice_end = now + (uint64_t)THREAD_QUANTUM_MS * g_tsc_khz;
+        next->ran_at = now;
+        next->switches++;
+        g_current = next;
+        frame = (InterruptFrame*)next->esp;
+    }
+
+    uint64_t due = next_wake;
+    for (int i = 0; i < MAX_THREADS; i++) {
+        Thread* t = &g_threads[i];
+        if (t != next && t->state == THREAD_READY && t->priority == next->priority) {
+            if (next->slice_end < due) due = next->slice_end;
+            break;
+        }
+    }
+    // A one-shot that fired (or was clamped short) must be re-armed even if
+    // the target has not moved.
+    if (due == THREAD_NO_WAKE) {
+        g_pit_due = due;
+    } else if (due != g_pit_due || vector == IRQ_BASE) {
+        g_pit_due = due;
+        pit_arm_oneshot(due > now ? cycles_to_ns(due - now) : 0);
+    }
+    return (uint32_t)frame;
+}
+
+static void thread_exit() {
+    irq_disable();
+    g_current->state = THREAD_DEAD;
+    thread_yield();
+    for (;;) {}   // a dead thread is never picked again
+}
+
+static void thread_start() {
+    g_current->entry(g_current->arg);
+    thread_exit();
+}
+
+static void thread_idle(void*) {
+    for (;;) asm volatile ("sti; hlt" ::: "memory");
+}
+
+static Thread* thread_create(const char* name, void (*entry)(void*), void* arg, uint8_t priority) {
+    uint32_t flags = irq_save();
+    Thread* t = nullptr;
+    for (int i = 1; i < MAX_THREADS && !t; i++) {
+        if (g_threads[i].state == THREAD_FREE || g_threads[i].state == THREAD_DEAD) t = &g_threads[i];
+    }
+    if (t) t->state = THREAD_BLOCKED;   // claimed, not yet runnable
+    irq_restore(flags);
+    if (!t) return nullptr;
+    if (!t->stack) t->stack = new uint8_t[THREAD_STACK_SIZE];
+    if (!t->stack) {
+        t->state = THREAD_FREE;
+        return nullptr;
+    }
+
+    // The frame isr_common pops to enter thread_start(), under a null return address.
+    uint32_t* top = (uint32_t*)(t->stack + THREAD_STACK_SIZE);
+    *--top = 0;
+    InterruptFrame* f = (InterruptFrame*)top - 1;
+    memset(f, 0, sizeof(*f));
+    f->gs = f->fs = f->es = f->ds = 0x10;
+    f->eip = (uint32_t)thread_start;
+    f->cs = KERNEL_CS;
+    f->eflags = 0x202;   // IF set
+    t->esp = (uint32_t)f;
+    memcpy(t->fpu, g_fpu_initial, sizeof(t->fpu));
+
+    strncpy(t->name, name, sizeof(t->name) - 1);
+    t->name[sizeof(t->name) - 1] = '\0';
+    t->entry = entry;
+    t->arg = arg;
+    t->priority = priority;
+    t->wake_on_input = false;
+    t->blocked_on = nullptr;
+    t->cycles = 0;
+    t->switches = 0;
+    t->state = THREAD_READY;
+    return t;
+}
+
+// Makes the boot thread the UI thread and starts the idle thread. Needs
+// simd_init() first so the initial FPU image carries the SSE setup.
+static void threads_init() {
+    asm volatile ("fninit; fxsave %0" : "=m"(g_fpu_initial));
+    Thread* ui = g_ui_thread;
+    strncpy(ui->name, "ui", sizeof(ui->name));
+    ui->priority = PRIO_UI;
+    ui->state = THREAD_READY;
+    ui->ran_at = rdtsc();
+    g_current = ui;
+    thread_create("idle", thread_idle, nullptr, PRIO_IDLE);
+}
+
+// Sleeps the calling thread until `tsc`, or also until thread_notify_ui()
+// when `wake_on_input` is set. Callable with interrupts disabled.
+static void thread_sleep_until(uint64_t tsc, bool wake_on_input) {
+    uint32_t flags = irq_save();
+    g_current->wake_tsc = tsc;
+    g_current->wake_on_input = wake_on_input;
+    g_current->state = THREAD_SLEEPING;
+    thread_yield();
+    irq_restore(flags);
+}
+
+static void thread_sleep_ms(uint32_t ms) {
+    thread_sleep_until(rdtsc() + (uint64_t)ms * g_tsc_khz, false);
+}
+
+// Wakes the UI thread if it is idling; the next interrupt exit switches to it.
+static void thread_notify_ui() {
+    if (g_ui_thread->state == THREAD_SLEEPING && g_ui_thread->wake_on_input) g_ui_thread->state = THREAD_READY;
+}
+
+// Yields if a higher class became ready (after waking the UI, or unlocking).
+static void thread_preempt_check() {
+    if (!g_current) return;
+    for (int i = 0; i < MAX_THREADS; i++) {
+        if (g_threads[i].state == THREAD_READY && g_threads[i].priority < g_current->priority) {
+            thread_yield();
+            return;
+        }
+    }
+}
+
+// Sleeps the calling thread until thread_wake(on) or `tsc`. Call it with
+// interrupts off, after checking the condition, so that a wakeup from an IRQ
+// cannot land between the check and the sleep.
+static void thread_wait(const void* on, uint64_t tsc) {
+    g_current->blocked_on = on;
+    thread_sleep_until(tsc, false);
+    g_current->blocked_on = nullptr;
+}
+
+// Makes every thread blocked or waiting on `on` ready.
+static void thread_wake(const void* on) {
+    for (int i = 0; i < MAX_THREADS; i++) {
+        Thread& t = g_threads[i];
+        if ((t.state == THREAD_BLOCKED || t.state == THREAD_SLEEPING) && t.blocked_on == on) {
+            t.blocked_on = nullptr;
+            t.state = THREAD_READY;
+        }
+    }
+}
+
+// Sleeping mutex; the owner may lock it again. Waiters block until unlock
+// makes them ready, then retry.
+struct KMutex {
+    Thread* owner = nullptr;
+    uint32_t depth = 0;
+
+    bool try_lock() {
+        uint32_t flags = irq_save();
+        bool ok = !owner || owner == g_current;
+        if (ok) { owner = g_current; depth++; }
+        irq_restore(flags);
+        return ok;
+    }
+    void lock() {
+        uint32_t flags = irq_save();
+        while (owner && owner != g_current) {
+            g_current->state = THREAD_BLOCKED;
+            g_current->blocked_on = this;
+            thread_yield();
+        }
+        owner = g_current;
+        depth++;
+        irq_restore(flags);
+    }
+    void unlock() {
+        uint32_t flags = irq_save();
+        if (--depth == 0) {
+            owner = nullptr;
+            thread_wake(this);
+        }
+        irq_restore(flags);
+        thread_preempt_check();
+    }
+    // Held by a thread other than the caller.
+    bool busy() const { return owner && owner != g_current; }
+};
+
+// Serializes the FAT code. Background jobs hold it for their whole run; the
+// UI thread takes it with fs_try_begin() and refuses or retries the action
+// when that fails, so the desktop never blocks behind a job.
+static KMutex g_fs_lock;
+// A program's file built-in holds g_fs_lock from a coroutine on the UI
+// thread. The lock would let the UI thread's own calls straight back in, so
+// fs_try_begin() refuses them until the coroutine is done.
+static bool g_vm_file_io = false;
+
+static bool fs_try_begin() { return !g_vm_file_io && g_fs_lock.try_lock(); }
+static void fs_end() { g_fs_lock.unlock(); }
+
+// =============================================================================
+// COROUTINES
+// =============================================================================
+// A freestanding C++20 coroutine runtime; the compiler only needs the two std
+// templates below. Task<T> is a lazily started coroutine that resumes its
+// awaiter when it finishes. Leaf awaitables (disk requests, timers, events)
+// park a CoWaiter and, on completion, post it to the CoQueue of the task tree
+// they belong to. Trees started with co_spawn() run on g_coro_queue, which the
+// main loop drains. sync_wait() gives a tree its own queue and drives it and
+// the disk on the calling thread, so blocking callers run the same code.
+namespace std {
+template<typename R, typename...> struct coroutine_traits { using promise_type = typename R::promise_type; };
+
+template<typename P = void> struct coroutine_handle;
+template<> struct coroutine_handle<void> {
+    void* ptr = nullptr;
+    static coroutine_handle from_address(void* a) noexcept { coroutine_handle h; h.ptr = a; return h; }
+    void* address() const noexcept { return ptr; }
+    explicit operator bool() const noexcept { return ptr != nullptr; }
+    bool done() const noexcept { return __builtin_coro_done(ptr); }
+    void resume() const { __builtin_coro_resume(ptr); }
+    void destroy() const { __builtin_coro_destroy(ptr); }
+};
+template<typename P> struct coroutine_handle : coroutine_handle<void> {
+    static coroutine_handle from_address(void* a) noexcept { coroutine_handle h; h.ptr = a; return h; }
+    static coroutine_handle from_promise(P& p) noexcept {
+        coroutine_handle h;
+        h.ptr = __builtin_coro_promise((char*)&p, __alignof(P), true);
+        return h;
+    }
+    P& promise() const { return *(P*)__builtin_coro_promise(ptr, __alignof(P), false); }
+};
+
+struct suspend_always {
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(coroutine_handle<>) const noexcept {}
+    void await_resume() const noexcept {}
+};
+struct suspend_never {
+    bool await_ready() const noexcept { return true; }
+    void await_suspend(coroutine_handle<>) const noexcept {}
+    void await_resume() const noexcept {}
+};
+}
+
+struct CoQueue;
+
+// A suspended coroutine waiting to be posted to its tree's queue.
+struct CoWaiter {
+    CoWaiter* next = nullptr;
+    std::coroutine_handle<> handle;
+    CoQueue* queue = nullptr;
+
+    template<typename P> void park(std::coroutine_handle<P> h) { handle = h; queue = h.promise().queue; }
+    void wake();
+};
+
+// Coroutines ready to resume. Any thread or IRQ may post (interrupts are off
+// while the list is touched); only the owning thread runs the queue.
+struct CoQueue {
+    CoWaiter* head = nullptr;
+    CoWaiter* tail = nullptr;
+    bool parked = false;            // a sync_wait() thread sleeps until a post
+
+    void post(CoWaiter* w) {
+        uint32_t flags = irq_save();
+        w->next = nullptr;
+        if (tail) tail->next = w; else head = w;
+        tail = w;
+        if (parked) thread_wake(this);
+        irq_restore(flags);
+    }
+    bool empty() const { return head == nullptr; }
+    // Resumes what was posted before the call; anything posted meanwhile
+    // waits for the next run. A resumed coroutine may free its waiter.
+    void run() {
+        uint32_t flags = irq_save();
+        CoWaiter* w = head;
+        head = tail = nullptr;
+        irq_restore(flags);
+        while (w) {
+            CoWaiter* next = w->next;
+            w->handle.resume();
+            w = next;
+        }
+    }
+};
+
+inline void CoWaiter::wake() { queue->post(this); }
+
+static CoQueue g_coro_queue;
+
+struct CoPromiseBase {
+    std::coroutine_handle<> continuation;
+    CoQueue* queue = &g_coro_queue;
+    void unhandled_exception() {}
+};
+
+// A coroutine that suspends as soon as it is resumed: the symmetric-transfer
+// target for a finished task nobody awaits.
+struct CoForever {
+    struct promise_type {
+        CoForever get_return_object() { return CoForever{ std::coroutine_handle<promise_type>::from_promise(*this) }; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() {}
+    };
+    std::coroutine_handle<promise_type> handle;
+};
+
+static CoForever co_noop_body() {
+    for (;;) co_await std::suspend_always{};
+}
+
+static void* g_co_noop = nullptr;
+
+static std::coroutine_handle<> co_noop() {
+    if (!g_co_noop) g_co_noop = co_noop_body().handle.address();
+    return std::coroutine_handle<>::from_address(g_co_noop);
+}
+
+template<typename T> struct TaskPromise : CoPromiseBase {
+    T value{};
+    void return_value(T v) { value = v; }
+    T result() { return value; }
+};
+template<> struct TaskPromise<void> : CoPromiseBase {
+    void return_void() {}
+    void result() {}
+};
+
+template<typename T = void>
+struct Task {
+    struct promise_type : TaskPromise<T> {
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                std::coroutine_handle<> c = h.promise().continuation;
+                return c ? c : co_noop();
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Task(std::coroutine_handle<promise_type> h) : handle(h) {}
+    Task(Task&& other) : handle(other.handle) { other.handle = {}; }
+    Task(const Task&) = delete;
+    ~Task() { if (handle) handle.destroy(); }
+
+    bool await_ready() const { return false; }
+    template<typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> parent) {
+        handle.promise().continuation = parent;
+        handle.promise().queue = parent.promise().queue;
+        return handle;
+    }
+    T await_resume() { return handle.promise().result(); }
+};
+
+struct CoDetached {
+    struct promise_type : CoPromiseBase {
+        CoWaiter start;
+        CoDetached get_return_object() { return CoDetached{ std::coroutine_handle<promise_type>::from_promise(*this) }; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+    };
+    std::coroutine_handle<promise_type> handle;
+};
+
+static uint32_t g_coro_spawned = 0, g_coro_finished = 0;
+
+static CoDetached co_detach(Task<void> task) {
+    co_await task;
+    g_coro_finished++;
+}
+
+// Runs `task` on g_coro_queue from its next run; the frames free themselves.
+static void co_spawn(Task<void>&& task) {
+    CoDetached d = co_detach(static_cast<Task<void>&&>(task));
+    d.handle.promise().start.park(d.handle);
+    d.handle.promise().start.wake();
+    g_coro_spawned++;
+}
+
+void disk_pump();
+static bool disk_sleep(const void* on);
+
+// Runs `task` to completion on the calling thread. Only for trees that wait
+// on the disk: timers and events are driven by the main loop.
+template<typename T>
+T sync_wait(Task<T> task) {
+    CoQueue queue;
+    task.handle.promise().queue = &queue;
+    task.handle.resume();
+    while (!task.handle.done()) {
+        disk_pump();
+        uint32_t flags = irq_save();
+        if (queue.empty()) {
+            queue.parked = true;
+            disk_sleep(&queue);
+            queue.parked = false;
+        }
+        irq_restore(flags);
+        queue.run();
+    }
+    return task.handle.promise().result();
+}
+
+// co_await co_sleep_ms(n): resumes after n ms, from the main loop's timers.
+struct CoSleep {
+    uint32_t ms = 0;
+    KTimer timer = {};
+    CoWaiter waiter = {};
+
+    bool await_ready() const { return ms == 0; }
+    template<typename P> void await_suspend(std::coroutine_handle<P> h) {
+        waiter.park(h);
+        timer_arm(&timer, ms, fired, this);
+    }
+    void await_resume() {}
+    static void fired(void* arg) { ((CoSleep*)arg)->waiter.wake(); }
+};
+
+static inline CoSleep co_sleep_ms(uint32_t ms) { return CoSleep{ ms }; }
+
+// co_await event: resumes at the next signal(). Waiters are a LIFO list
+// threaded through their CoWaiters, which the signal hands to their queues.
+struct CoEvent {
+    CoWaiter* waiters = nullptr;
+
+    struct Awaiter {
+        CoEvent* event = nullptr;
+        CoWaiter waiter = {};
+        bool await_ready() const { return false; }
+        template<typename P> void await_suspend(std::coroutine_handle<P> h) {
+            waiter.park(h);
+            uint32_t flags = irq_save();
+            waiter.next = event->waiters;
+            event->waiters = &waiter;
+            irq_restore(flags);
+        }
+        void await_resume() {}
+    };
+    Awaiter operator co_await() { return Awaiter{ this }; }
+
+    void signal() {
+        uint32_t flags = irq_save();
+        CoWaiter* w = waiters;
+        waiters = nullptr;
+        irq_restore(flags);
+        while (w) {
+            CoWaiter* next = w->next;
+            w->wake();
+            w = next;
+        }
+    }
+};
+
+// Signalled by the main loop after each batch of input reaches the WM/VMs.
+static CoEvent g_input_event;
+
+// =============================================================================
+// SMP
+// =============================================================================
+// The bootstrap processor (BSP) owns the desktop, the kernel threads and every
+// device. The application processors (APs) are found through the ACPI MADT
+// and started with INIT-SIPI-SIPI. Each gets its own GDT, stack and run
+// queue, and it only runs TinyVM programs handed to it (see SMP VM
+// SCHEDULING). APs keep interrupts off except while halted for work, and the
+// wakeup IPI is the only interrupt they take. The same IPI sent to the BSP
+// makes the UI thread runnable.
+struct TinyVM;
+
+struct Spinlock {
+    volatile uint32_t locked = 0;
+
+    // Interrupts stay off on this CPU while it is held.
+    uint32_t lock() {
+        uint32_t flags = irq_save();
+        for (;;) {
+            uint32_t was = 1;
+            asm volatile ("xchgl %0, %1" : "+r"(was), "+m"(locked) :: "memory");
+            if (!was) return flags;
+            while (locked) asm volatile ("pause");
+        }
+    }
+    void unlock(uint32_t flags) {
+        asm volatile ("" ::: "memory");
+        locked = 0;
+        irq_restore(flags);
+    }
+};
+
+static const int VM_RUNQ_MAX = 8;   // room for every RUN and EXEC slot
+
+struct Cpu {
+    uint32_t apic_id;
+    volatile bool online;
+    volatile bool idle;             // halted until the wakeup IPI; under lock
+    uint8_t* stack;
+    Spinlock lock;                  // guards the run queue
+    TinyVM* runq[VM_RUNQ_MAX];      // circular, oldest first
+    int head;
+    volatile int count;             // written under lock, read unlocked for placement
+    uint64_t busy_cycles;
+    uint32_t slices, steals;
+};
+
+static Cpu g_cpus[MAX_CPUS];
+static uint32_t g_lapic_base = 0;
+
+// --- Local APIC ---
+static const uint32_t LAPIC_ID = 0x20;
+static const uint32_t LAPIC_EOI = 0xB0;
+static const uint32_t LAPIC_SVR = 0xF0;
+static const uint32_t LAPIC_ICR_LO = 0x300;
+static const uint32_t LAPIC_ICR_HI = 0x310;
+static const uint32_t LAPIC_LINT0 = 0x350;
+static const uint32_t LAPIC_LINT1 = 0x360;
+static const uint32_t ICR_INIT = 0x4500;        // INIT, level assert
+static const uint32_t ICR_STARTUP = 0x4600;     // SIPI; the low byte is the start page
+static const uint32_t ICR_PENDING = 1u << 12;
+
+static inline uint32_t lapic_read(uint32_t reg) { return *(volatile uint32_t*)(g_lapic_base + reg); }
+static inline void lapic_write(uint32_t reg, uint32_t v) { *(volatile uint32_t*)(g_lapic_base + reg) = v; }
+
+static void lapic_enable() { lapic_write(LAPIC_SVR, 0x100 | LAPIC_SPURIOUS_VECTOR); }
+
+static void lapic_send_ipi(uint32_t apic_id, uint32_t icr) {
+    uint32_t flags = irq_save();
+    while (lapic_read(LAPIC_ICR_LO) & ICR_PENDING) asm volatile ("pause");
+    lapic_write(LAPIC_ICR_HI, apic_id << 24);
+    lapic_write(LAPIC_ICR_LO, icr);
+    irq_restore(flags);
+}
+
+static void smp_wake(int cpu) { lapic_send_ipi(g_cpus[cpu].apic_id, IPI_VECTOR); }
+
+static uint32_t smp_ipi(InterruptFrame* frame) {
+    lapic_write(LAPIC_EOI, 0);
+    if (cpu_index() != 0) return (uint32_t)frame;
+    thread_notify_ui();
+    return thread_switch(frame);
+}
+
+// --- ACPI ---
+struct __attribute__((packed)) AcpiSdtHeader {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision, checksum;
+    char oem_id[6], oem_table_id[8];
+    uint32_t oem_revision, creator_id, creator_revision;
+};
+
+static bool acpi_checksum_ok(const void* p, uint32_t len) {
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; i++) sum += ((const uint8_t*)p)[i];
+    return sum == 0;
+}
+
+// The RSDP sits on a 16-byte boundary in the first KiB of the EBDA or in the
+// BIOS area at 0xE0000-0xFFFFF.
+static const uint8_t* acpi_find_rsdp() {
+    uint32_t ebda = (uint32_t)(*(volatile uint16_t*)0x40E) << 4;
+    const uint32_t ranges[2][2] = { { ebda, ebda + 1024 }, { 0xE0000, 0x100000 } };
+    for (int r = 0; r < 2; r++) {
+        if (!ranges[r][0]) continue;
+        for (uint32_t a = ranges[r][0]; a + 20 <= ranges[r][1]; a += 16) {
+            if (memcmp((const void*)a, "RSD PTR ", 8) == 0 && acpi_checksum_ok((const void*)a, 20))
+                return (const uint8_t*)a;
+        }
+    }
+    return nullptr;
+}
+
+// Looks `sig` up in the XSDT (ACPI 2+) or the RSDT. Tables above 4 GiB are
+// out of reach without paging and are skipped.
+static const AcpiSdtHeader* acpi_find_table(const char* sig) {
+    const uint8_t* rsdp = acpi_find_rsdp();
+    if (!rsdp) return nullptr;
+    uint64_t xsdt = rsdp[15] >= 2 ? *(const uint64_t*)(rsdp + 24) : 0;
+    bool wide = xsdt && !(xsdt >> 32);
+    const AcpiSdtHeader* root = (const AcpiSdtHeader*)(wide ? (uint32_t)xsdt : *(const uint32_t*)(rsdp + 16));
+    if (!root || !acpi_checksum_ok(root, root->length)) return nullptr;
+
+    const uint8_t* entries = (const uint8_t*)root + sizeof(AcpiSdtHeader);
+    uint32_t n = (root->length - sizeof(AcpiSdtHeader)) / (wide ? 8 : 4);
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t addr = wide ? *(const uint64_t*)(entries + i * 8) : *(const uint32_t*)(entries + i * 4);
+        if (!addr || (addr >> 32)) continue;
+        const AcpiSdtHeader* t = (const AcpiSdtHeader*)(uint32_t)addr;
+        if (memcmp(t->signature, sig, 4) == 0 && acpi_checksum_ok(t, t->length)) return t;
+    }
+    return nullptr;
+}
+
+// Fills g_cpus[] from the MADT, the BSP first. Returns the number of enabled
+// CPUs, or 1 without a MADT.
+static int smp_enumerate() {
+    const AcpiSdtHeader* madt = acpi_find_table("APIC");
+    if (!madt) return 1;
+    const uint8_t* p = (const uint8_t*)madt;
+    g_lapic_base = *(const uint32_t*)(p + 36);
+    for (uint32_t off = 44; off + 2 <= madt->length && p[off + 1] >= 2; off += p[off + 1]) {
+        uint64_t addr = *(const uint64_t*)(p + off + 4);
+        if (p[off] == 5 && p[off + 1] >= 12 && !(addr >> 32)) g_lapic_base = (uint32_t)addr;   // address override
+    }
+    if (!g_lapic_base) return 1;
+
+    g_cpus[0].apic_id = lapic_read(LAPIC_ID) >> 24;
+    int n = 1;
+    for (uint32_t off = 44; off + 2 <= madt->length && p[off + 1] >= 2; off += p[off + 1]) {
+        if (p[off] != 0 || p[off + 1] < 8) continue;           // processor local APIC
+        uint32_t apic_id = p[off + 3], flags = *(const uint32_t*)(p + off + 4);
+        if (!(flags & 1) || apic_id == g_cpus[0].apic_id || n == MAX_CPUS) continue;
+        g_cpus[n++].apic_id = apic_id;
+    }
+    return n;
+}
+
+// --- AP start-up ---
+extern "C" uint8_t ap_trampoline[], ap_trampoline_stack[], ap_trampoline_entry[], ap_trampoline_arg[], ap_trampoline_end[];
+static const uint32_t AP_TRAMPOLINE = 0x8000;   // as in boot.S
+static const uint32_t AP_STACK_SIZE = 16 * 1024;
+static const uint32_t AP_START_TIMEOUT_MS = 100;
+
+void simd_init();
+static void smp_ap_main(Cpu* cpu);
+
+extern "C" void ap_entry(int index) {
+    gdt_load(index);
+    idt_load();
+    simd_init();
+    asm volatile ("fninit");
+    lapic_enable();
+    g_cpus[index].online = true;
+    smp_ap_main(&g_cpus[index]);
+}
+
+static bool smp_start_ap(int index) {
+    Cpu* cpu = &g_cpus[index];
+    cpu->stack = new uint8_t[AP_STACK_SIZE];
+    uint8_t* page = (uint8_t*)AP_TRAMPOLINE;
+    memcpy(page, ap_trampoline, ap_trampoline_end - ap_trampoline);
+    *(uint32_t*)(page + (ap_trampoline_stack - ap_trampoline)) = (uint32_t)(cpu->stack + AP_STACK_SIZE);
+    *(uint32_t*)(page + (ap_trampoline_entry - ap_trampoline)) = (uint32_t)ap_entry;
+    *(uint32_t*)(page + (ap_trampoline_arg - ap_trampoline)) = (uint32_t)index;
+
+    lapic_send_ipi(cpu->apic_id, ICR_INIT);
+    udelay(10000);
+    for (int i = 0; i < 2 && !cpu->online; i++) {
+        lapic_send_ipi(cpu->apic_id, ICR_STARTUP | (AP_TRAMPOLINE >> 12));
+        udelay(200);
+    }
+    Deadline deadline = Deadline::after_ms(AP_START_TIMEOUT_MS);
+    while (!cpu->online && !deadline.expired()) asm volatile ("pause");
+    return cpu->online;
+}
+
+// Starts the APs one at a time (they share the trampoline). Stops at the
+// first that does not come up, so g_cpus[0..g_cpu_count) are all running.
+static int smp_init() {
+    int found = smp_enumerate();
+    if (found < 2) return 1;
+    // The BSP needs its local APIC for the wakeup IPI; LINT0 stays in
+    // virtual-wire mode so the 8259 interrupts keep coming.
+    lapic_write(LAPIC_LINT0, 0x700);    // ExtINT
+    lapic_write(LAPIC_LINT1, 0x400);    // NMI
+    lapic_enable();
+    g_cpus[0].online = true;
+    for (int i = 1; i < found; i++) {
+        if (!smp_start_ap(i)) break;
+        g_cpu_count = i + 1;
+    }
+    return g_cpu_count;
+}
+
+
 
 // =============================================================================
 // SECTION 2: BOOTLOADER INFO, FONT, RTC
@@ -365,47 +1562,74 @@ RTC_Time read_rtc() {
 static uint32_t* backbuffer = nullptr;
 struct FramebufferInfo { uint32_t* ptr; uint32_t width, height, pitch; } fb_info;
 
+// Bytes per pixel of the backbuffer and every other render surface: 4, or 2 in
+// the RGB565 render mode (see GraphicsDriver::set_render_bpp). Surfaces stay
+// typed as uint32_t* and are sized in whole words.
+static uint32_t g_render_bytes = 4;
+static inline uint32_t surface_words(uint32_t w, uint32_t h) { return (w * h * g_render_bytes + 3) / 4; }
+static inline uint8_t* surface_at(const void* surf, int stride, int x, int y) {
+    return (uint8_t*)surf + (y * stride + x) * g_render_bytes;
+}
+
+// Points the raster primitives at another screen-sized surface (used to
+// pre-render cached layers). Returns the previous target for restoring.
+static inline uint32_t* set_render_target(uint32_t* target) {
+    uint32_t* prev = backbuffer;
+    backbuffer = target;
+    return prev;
+}
+
 // =============================================================================
 // UNIFIED COLOR PALETTE - PREVENTS COLOR INCONSISTENCIES
 // =============================================================================
+// Every palette entry is listed once here as 0xRRGGBB. ColorPalette::RGB keeps
+// the source values; the plain ColorPalette names hold the same colours already
+// packed into the framebuffer's native pixel layout (baked once at boot by
+// bake_native_palette()), so raster code can store them without conversion.
+#define COLOR_PALETTE_ENTRIES(X) \
+    /* Desktop colors */ \
+    X(DESKTOP_TEAL,        0x008080) \
+    X(DESKTOP_BLUE,        0x00004B) \
+    X(DESKTOP_GRAY,        0x404040) \
+    /* Taskbar colors */ \
+    X(TASKBAR_GRAY,        0x808080) \
+    X(TASKBAR_DARK,        0x606060) \
+    X(TASKBAR_LIGHT,       0xC0C0C0) \
+    /* Window colors */ \
+    X(WINDOW_BG,           0x000000) \
+    X(WINDOW_BORDER,       0xC0C0C0) \
+    X(TITLEBAR_ACTIVE,     0x000080) \
+    X(TITLEBAR_INACTIVE,   0x808080) \
+    X(FILE_EXPLORER_BG,    0xFFFFFF) \
+    /* Button colors */ \
+    X(BUTTON_FACE,         0xC0C0C0) \
+    X(BUTTON_HIGHLIGHT,    0xFFFFFF) \
+    X(BUTTON_SHADOW,       0x808080) \
+    X(BUTTON_CLOSE,        0xFF0000) \
+    /* Text colors */ \
+    X(TEXT_BLACK,          0x000000) \
+    X(TEXT_WHITE,          0xFFFFFF) \
+    X(TEXT_GREEN,          0x00FF00) \
+    X(TEXT_GRAY,           0x808080) \
+    /* Cursor color */ \
+    X(CURSOR_WHITE,        0xFFFFFF) \
+    /* Icon colors */ \
+    X(ICON_FILE_FILL,      0xFFF1B5) /* Light yellow */ \
+    X(ICON_FILE_OUTLINE,   0x808080) \
+    X(ICON_FOLDER_FILL,    0xFFD3A1) /* Light orange */ \
+    X(ICON_SHORTCUT_ARROW, 0x0000FF) /* Blue */
+
 namespace ColorPalette {
-    // Desktop colors
-    constexpr uint32_t DESKTOP_TEAL      = 0x008080;
-    constexpr uint32_t DESKTOP_BLUE      = 0x00004B; 
-    constexpr uint32_t DESKTOP_GRAY      = 0x404040;
-    
-    // Taskbar colors
-    constexpr uint32_t TASKBAR_GRAY      = 0x808080;
-    constexpr uint32_t TASKBAR_DARK      = 0x606060;
-    constexpr uint32_t TASKBAR_LIGHT     = 0xC0C0C0;
-    
-    // Window colors
-    constexpr uint32_t WINDOW_BG         = 0x000000;
-    constexpr uint32_t WINDOW_BORDER     = 0xC0C0C0;
-    constexpr uint32_t TITLEBAR_ACTIVE   = 0x000080;
-    constexpr uint32_t TITLEBAR_INACTIVE = 0x808080;
-    constexpr uint32_t FILE_EXPLORER_BG  = 0xFFFFFF; // New
-    
-    // Button colors
-    constexpr uint32_t BUTTON_FACE       = 0xC0C0C0;
-    constexpr uint32_t BUTTON_HIGHLIGHT  = 0xFFFFFF;
-    constexpr uint32_t BUTTON_SHADOW     = 0x808080;
-    constexpr uint32_t BUTTON_CLOSE      = 0xFF0000;
-    
-    // Text colors
-    constexpr uint32_t TEXT_BLACK        = 0x000000;
-    constexpr uint32_t TEXT_WHITE        = 0xFFFFFF;
-    constexpr uint32_t TEXT_GREEN        = 0x00FF00;
-    constexpr uint32_t TEXT_GRAY         = 0x808080;
-    
-    // Cursor color
-    constexpr uint32_t CURSOR_WHITE      = 0xFFFFFF;
-
-    // Icon Colors
-    constexpr uint32_t ICON_FILE_FILL    = 0xFFF1B5; // Light yellow
-    constexpr uint32_t ICON_FILE_OUTLINE = 0x808080;
-    constexpr uint32_t ICON_FOLDER_FILL  = 0xFFD3A1; // Light orange
-    constexpr uint32_t ICON_SHORTCUT_ARROW = 0x0000FF; // Blue
+    namespace RGB {
+        #define X(name, rgb) constexpr uint32_t name = rgb;
+        COLOR_PALETTE_ENTRIES(X)
+        #undef X
+    }
+
+    // Native pixels; identical to RGB until bake_native_palette() runs.
+    #define X(name, rgb) uint32_t name = rgb;
+    COLOR_PALETTE_ENTRIES(X)
+    #undef X
 }
 
 // =============================================================================
@@ -458,10 +1682,6 @@ struct Color {
     uint32_t to_rgb() const {
         return (a << 24) | (r << 16) | (g << 8) | b;
     }
-
-    uint32_t to_bgr() const {
-        return (a << 24) | (b << 16) | (g << 8) | r;
-    }
 };
 
 namespace Colors {
@@ -472,71 +1692,108 @@ namespace Colors {
     constexpr Color Blue = {0, 0, 255, 255};
 }
 
-class GraphicsDriver;
-
-class GraphicsDriver {
-private:
-    bool is_bgr_format;
+// Channel layout of the linear framebuffer, as reported by multiboot color_info.
+struct PixelFormat {
+    uint8_t bpp;
+    uint8_t red_pos, red_size;
+    uint8_t green_pos, green_size;
+    uint8_t blue_pos, blue_size;
+};
 
-    inline uint32_t convert_color(const Color& color) const {
-        return is_bgr_format ? color.to_bgr() : color.to_rgb();
-    }
+void draw_rect_filled(int x, int y, int w, int h, uint32_t color);
+void put_pixel_back(int x, int y, uint32_t color);
 
-    // This function converts a standard 0xRRGGBB color into 0xBBGGRR for BGR framebuffers
-    inline uint32_t rgb_to_bgr(uint32_t color) const {
-        if (!is_bgr_format) return color;
+static const PixelFormat PIXEL_FORMAT_XRGB8888 = {32, 16, 8, 8, 8, 0, 8};
+static const PixelFormat PIXEL_FORMAT_RGB565   = {16, 11, 5, 5, 6, 0, 5};
 
-        uint8_t a = (color >> 24) & 0xFF;
-        uint8_t r = (color >> 16) & 0xFF;
-        uint8_t g = (color >> 8)  & 0xFF;
-        uint8_t b = (color >> 0)  & 0xFF;
+class GraphicsDriver {
+private:
+    PixelFormat format;   // scanout (what fb_info.ptr expects)
+    PixelFormat render;   // backbuffer and palette
 
-        return (a << 24) | (b << 16) | (g << 8) | r;
+    static inline uint32_t pack_channel(uint32_t value8, uint8_t pos, uint8_t size) {
+        if (size == 0) return 0;
+        if (size < 8) value8 >>= (8 - size);
+        return value8 << pos;
     }
 
 public:
-    GraphicsDriver() : is_bgr_format(true) {}
+    // Default is the x8r8g8b8 layout GRUB hands out for a 32bpp request.
+    GraphicsDriver() : format(PIXEL_FORMAT_XRGB8888), render(PIXEL_FORMAT_XRGB8888) {}
+
+    // Renders at the framebuffer depth unless the kernel command line asks for
+    // "gfx16"; a 16bpp framebuffer (depth 16 in the multiboot header) renders
+    // 565 natively.
+    void init(const multiboot_info* mbi) {
+        format = PIXEL_FORMAT_XRGB8888;
+        set_render_bpp(32);
+        if (!mbi || !(mbi->flags & (1 << 12))) return;
+
+        format.bpp = mbi->framebuffer_bpp;
+        if (mbi->framebuffer_type == 1) { // direct RGB: positions and sizes follow
+            format.red_pos    = mbi->color_info[0];
+            format.red_size   = mbi->color_info[1];
+            format.green_pos  = mbi->color_info[2];
+            format.green_size = mbi->color_info[3];
+            format.blue_pos   = mbi->color_info[4];
+            format.blue_size  = mbi->color_info[5];
+        }
+
+        bool want16 = format.bpp == 16;
+        if ((mbi->flags & (1 << 2)) && mbi->cmdline && strstr((const char*)mbi->cmdline, "gfx16"))
+            want16 = true;
+        set_render_bpp(want16 ? 16 : 32);
+    }
+
+    // Selects the backbuffer depth (16 or 32). Callers must reallocate render
+    // surfaces and re-bake the palette afterwards.
+    bool set_render_bpp(int bpp) {
+        if (bpp != 16 && bpp != 32) return false;
+        if (format.bpp == bpp) render = format;
+        else render = (bpp == 16) ? PIXEL_FORMAT_RGB565 : PIXEL_FORMAT_XRGB8888;
+        g_render_bytes = bpp / 8;
+        return true;
+    }
 
-    void init(bool bgr_format = true) {
-        is_bgr_format = bgr_format;
+    const PixelFormat& pixel_format() const { return format; }
+    const PixelFormat& render_format() const { return render; }
+    bool render_is_scanout() const {
+        return render.bpp == format.bpp && render.red_pos == format.red_pos &&
+               render.green_pos == format.green_pos && render.blue_pos == format.blue_pos &&
+               render.red_size == format.red_size && render.green_size == format.green_size &&
+               render.blue_size == format.blue_size;
     }
+    bool is_bgr() const { return format.blue_pos > format.red_pos; }
 
-    void clear_screen(uint32_t rgb_color) {
-        if (!backbuffer || !fb_info.ptr) return;
+    // 0xRRGGBB -> render pixel. Only for baking tables and one-off
+    // conversions; raster paths take native values.
+    uint32_t native(uint32_t rgb) const {
+        return pack_channel((rgb >> 16) & 0xFF, render.red_pos, render.red_size) |
+               pack_channel((rgb >> 8) & 0xFF, render.green_pos, render.green_size) |
+               pack_channel(rgb & 0xFF, render.blue_pos, render.blue_size);
+    }
 
-        uint32_t color = rgb_to_bgr(rgb_color);
-        uint32_t pixel_count = fb_info.width * fb_info.height;
+    uint32_t native(const Color& color) const { return native(color.to_rgb()); }
 
-        #ifdef __i386__
-        uint32_t* target = backbuffer;
-        asm volatile(
-            "rep stosl"
-            : "=D"(target), "=c"(pixel_count)
-            : "D"(target), "c"(pixel_count), "a"(color)
-            : "memory"
-        );
-        #else
-        for (uint32_t i = 0; i < pixel_count; i++) {
-            backbuffer[i] = color;
-        }
-        #endif
+    void clear_screen(uint32_t native_color) {
+        if (!backbuffer || !fb_info.ptr) return;
+        draw_rect_filled(0, 0, fb_info.width, fb_info.height, native_color);
     }
 
     void clear_screen(const Color& color) {
-        clear_screen(convert_color(color));
+        clear_screen(native(color));
     }
 
-    void put_pixel(int x, int y, uint32_t rgb_color) {
-        if (backbuffer && x >= 0 && x < (int)fb_info.width && y >= 0 && y < (int)fb_info.height) {
-            backbuffer[y * fb_info.width + x] = rgb_to_bgr(rgb_color);
-        }
+    void put_pixel(int x, int y, uint32_t native_color) {
+        put_pixel_back(x, y, native_color);
     }
 
     void put_pixel(int x, int y, const Color& color) {
-        put_pixel(x, y, convert_color(color));
+        put_pixel(x, y, native(color));
     }
 
     void draw_line(int x0, int y0, int x1, int y1, const Color& color) {
+        uint32_t col = native(color);
         int dx = gfx_abs(x1 - x0);
         int dy = gfx_abs(y1 - y0);
         int sx = x0 < x1 ? 1 : -1;
@@ -544,7 +1801,7 @@ public:
         int err = dx - dy;
 
         while (true) {
-            put_pixel(x0, y0, color);
+            put_pixel(x0, y0, col);
 
             if (x0 == x1 && y0 == y1) break;
 
@@ -561,36 +1818,248 @@ public:
     }
 
     void draw_rect(int x, int y, int w, int h, const Color& color) {
-        for (int i = 0; i < w; i++) {
-            put_pixel(x + i, y, color);
-            put_pixel(x + i, y + h - 1, color);
+        uint32_t col = native(color);
+        draw_rect_filled(x, y, w, 1, col);
+        draw_rect_filled(x, y + h - 1, w, 1, col);
+        draw_rect_filled(x, y, 1, h, col);
+        draw_rect_filled(x + w - 1, y, 1, h, col);
+    }
+
+    void fill_rect(int x, int y, int w, int h, const Color& color) {
+        draw_rect_filled(x, y, w, h, native(color));
+    }
+};
+
+static GraphicsDriver g_gfx;
+
+// Repack every ColorPalette entry into the render pixel layout.
+void bake_native_palette() {
+    #define X(name, rgb) ColorPalette::name = g_gfx.native(ColorPalette::RGB::name);
+    COLOR_PALETTE_ENTRIES(X)
+    #undef X
+}
+
+// =============================================================================
+// CLIP, DAMAGE AND DISPLAY LISTS
+// =============================================================================
+// Windows do not rasterise directly: while g_dl_record is set, the raster
+// primitives (fills, blends, text, blits, single pixels) append a command to
+// that DisplayList instead. The WindowManager keeps the previous list of every
+// window, diffs it against the new one and turns changes into damage rects;
+// only damaged regions are recomposed, by replaying lists under g_clip.
+
+struct ClipRect { int x0, y0, x1, y1; };  // half-open: [x0, x1) x [y0, y1)
+
+// Active clip for all raster primitives; clamped to the screen when used.
+static ClipRect g_clip = { 0, 0, 0x7FFFFFFF, 0x7FFFFFFF };
+
+static inline void clip_reset() { g_clip = ClipRect{ 0, 0, 0x7FFFFFFF, 0x7FFFFFFF }; }
+
+static inline bool clip_to_target(int& x, int& y, int& w, int& h) {
+    int x0 = g_clip.x0 > 0 ? g_clip.x0 : 0;
+    int y0 = g_clip.y0 > 0 ? g_clip.y0 : 0;
+    int x1 = g_clip.x1 < (int)fb_info.width ? g_clip.x1 : (int)fb_info.width;
+    int y1 = g_clip.y1 < (int)fb_info.height ? g_clip.y1 : (int)fb_info.height;
+    if (x < x0) { w -= x0 - x; x = x0; }
+    if (y < y0) { h -= y0 - y; y = y0; }
+    if (x + w > x1) w = x1 - x;
+    if (y + h > y1) h = y1 - y;
+    return w > 0 && h > 0;
+}
+
+static inline bool rects_intersect(const ClipRect& a, const ClipRect& b) {
+    return a.x0 < b.x1 && b.x0 < a.x1 && a.y0 < b.y1 && b.y0 < a.y1;
+}
+
+// Screen regions to recompose this frame. Overlapping rects are merged; when
+// the list is full everything collapses into one bounding box.
+struct DamageList {
+    static const int MAX_RECTS = 16;
+    ClipRect rects[MAX_RECTS];
+    int count;
+    bool full;
+
+    void clear() { count = 0; full = false; }
+    void add_all() { full = true; }
+
+    void add(int x, int y, int w, int h) {
+        if (full || w <= 0 || h <= 0) return;
+        ClipRect r = { x, y, x + w, y + h };
+        if (r.x0 < 0) r.x0 = 0;
+        if (r.y0 < 0) r.y0 = 0;
+        if (r.x1 > (int)fb_info.width) r.x1 = fb_info.width;
+        if (r.y1 > (int)fb_info.height) r.y1 = fb_info.height;
+        if (r.x0 >= r.x1 || r.y0 >= r.y1) return;
+        add(r);
+    }
+
+    void add(ClipRect r) {
+        for (int i = 0; i < count; i++) {
+            if (rects_intersect(rects[i], r)) {
+                // Merge and re-add so chains of overlaps collapse.
+                ClipRect m = rects[i];
+                if (r.x0 < m.x0) m.x0 = r.x0;
+                if (r.y0 < m.y0) m.y0 = r.y0;
+                if (r.x1 > m.x1) m.x1 = r.x1;
+                if (r.y1 > m.y1) m.y1 = r.y1;
+                rects[i] = rects[--count];
+                add(m);
+                return;
+            }
         }
-        for (int i = 0; i < h; i++) {
-            put_pixel(x, y + i, color);
-            put_pixel(x + w - 1, y + i, color);
+        if (count == MAX_RECTS) {
+            for (int i = 1; i < count; i++) {
+                if (rects[i].x0 < r.x0) r.x0 = rects[i].x0;
+                if (rects[i].y0 < r.y0) r.y0 = rects[i].y0;
+                if (rects[i].x1 > r.x1) r.x1 = rects[i].x1;
+                if (rects[i].y1 > r.y1) r.y1 = rects[i].y1;
+            }
+            count = 1;
+            rects[0] = r;
+            return;
         }
+        rects[count++] = r;
     }
+};
 
-    void fill_rect(int x, int y, int w, int h, const Color& color) {
-        uint32_t col = convert_color(color);
-        for (int dy = 0; dy < h; dy++) {
-            for (int dx = 0; dx < w; dx++) {
-                put_pixel(x + dx, y + dy, col);
+enum DisplayOp : uint32_t { DL_FILL, DL_BLEND, DL_TEXT, DL_BLIT };
+
+struct DisplayCommand {
+    uint32_t op;
+    int x, y, w, h;
+    uint32_t color;     // fill/text colour, or the blit colour key
+    uint32_t aux;       // blend alpha, text offset, or blit source stride
+    const void* data;   // blit source
+};
+
+// A window's recorded frame. Commands keep their unclipped arguments; text is
+// copied into a private arena so the list stays valid after the source string
+// changes. Consecutive fills of one colour that extend each other are merged
+// at record time (this is what turns per-pixel borders into four rects).
+// No destructor on purpose: owners call release().
+class DisplayList {
+public:
+    DisplayCommand* cmds;
+    int count, cap;
+    char* text;
+    int text_len, text_cap;
+    ClipRect bounds;
+    bool empty_bounds;
+
+    DisplayList() : cmds(nullptr), count(0), cap(0), text(nullptr), text_len(0), text_cap(0),
+                    bounds{0, 0, 0, 0}, empty_bounds(true) {}
+
+    void release() {
+        delete[] cmds; cmds = nullptr; cap = count = 0;
+        delete[] text; text = nullptr; text_cap = text_len = 0;
+        empty_bounds = true;
+    }
+
+    void reset() { count = 0; text_len = 0; empty_bounds = true; bounds = ClipRect{0, 0, 0, 0}; }
+
+    // True if this list is `o` with every command shifted by one (dx, dy).
+    bool translated_from(const DisplayList& o, int& dx, int& dy) const {
+        if (count == 0 || count != o.count || text_len != o.text_len) return false;
+        if (text_len && memcmp(text, o.text, text_len) != 0) return false;
+        dx = cmds[0].x - o.cmds[0].x;
+        dy = cmds[0].y - o.cmds[0].y;
+        for (int i = 0; i < count; i++) {
+            const DisplayCommand& a = cmds[i];
+            const DisplayCommand& b = o.cmds[i];
+            if (a.op != b.op || a.w != b.w || a.h != b.h || a.color != b.color || a.aux != b.aux ||
+                a.data != b.data || a.x - b.x != dx || a.y - b.y != dy) return false;
+        }
+        return true;
+    }
+
+    bool same_as(const DisplayList& o) const {
+        return count == o.count && text_len == o.text_len &&
+               (count == 0 || memcmp(cmds, o.cmds, count * sizeof(DisplayCommand)) == 0) &&
+               (text_len == 0 || memcmp(text, o.text, text_len) == 0);
+    }
+
+    void fill(int x, int y, int w, int h, uint32_t color) {
+        if (w <= 0 || h <= 0) return;
+        if (count > 0) {
+            DisplayCommand& last = cmds[count - 1];
+            if (last.op == DL_FILL && last.color == color) {
+                if (last.y == y && last.h == h && last.x + last.w == x) { last.w += w; grow_bounds(x, y, w, h); return; }
+                if (last.x == x && last.w == w && last.y + last.h == y) { last.h += h; grow_bounds(x, y, w, h); return; }
             }
         }
+        push(DisplayCommand{ DL_FILL, x, y, w, h, color, 0, nullptr });
+    }
+
+    void blend(int x, int y, int w, int h, uint32_t color, uint32_t alpha) {
+        if (w <= 0 || h <= 0) return;
+        push(DisplayCommand{ DL_BLEND, x, y, w, h, color, alpha, nullptr });
+    }
+
+    void string(const char* s, int x, int y, uint32_t color) {
+        int len = (int)strlen(s);
+        if (len == 0) return;
+        if (!reserve_text(len + 1)) return;
+        memcpy(text + text_len, s, len + 1);
+        push(DisplayCommand{ DL_TEXT, x, y, len * 8, 8, color, (uint32_t)text_len, nullptr });
+        text_len += len + 1;
+    }
+
+    void blit(int x, int y, int w, int h, const uint32_t* src, int stride, uint32_t key) {
+        if (w <= 0 || h <= 0) return;
+        push(DisplayCommand{ DL_BLIT, x, y, w, h, key, (uint32_t)stride, src });
+    }
+
+    void replay() const;
+
+private:
+    void grow_bounds(int x, int y, int w, int h) {
+        if (empty_bounds) { bounds = ClipRect{ x, y, x + w, y + h }; empty_bounds = false; return; }
+        if (x < bounds.x0) bounds.x0 = x;
+        if (y < bounds.y0) bounds.y0 = y;
+        if (x + w > bounds.x1) bounds.x1 = x + w;
+        if (y + h > bounds.y1) bounds.y1 = y + h;
+    }
+
+    void push(const DisplayCommand& c) {
+        if (count == cap) {
+            int ncap = cap ? cap * 2 : 64;
+            DisplayCommand* n = new DisplayCommand[ncap];
+            if (!n) return;
+            if (cmds) { memcpy(n, cmds, count * sizeof(DisplayCommand)); delete[] cmds; }
+            cmds = n;
+            cap = ncap;
+        }
+        cmds[count++] = c;
+        grow_bounds(c.x, c.y, c.w, c.h);
+    }
+
+    bool reserve_text(int n) {
+        if (text_len + n <= text_cap) return true;
+        int ncap = text_cap ? text_cap * 2 : 1024;
+        while (ncap < text_len + n) ncap *= 2;
+        char* t = new char[ncap];
+        if (!t) return false;
+        if (text) { memcpy(t, text, text_len); delete[] text; }
+        text = t;
+        text_cap = ncap;
+        return true;
     }
 };
 
-static GraphicsDriver g_gfx;
+// Non-null while a window is recording instead of rasterising.
+static DisplayList* g_dl_record = nullptr;
 
 void put_pixel_back(int x, int y, uint32_t color) {
-    if (backbuffer && x >= 0 && x < (int)fb_info.width && y >= 0 && y < (int)fb_info.height) {
-        backbuffer[y * fb_info.width + x] = color;
-    }
+    if (g_dl_record) { g_dl_record->fill(x, y, 1, 1, color); return; }
+    int w = 1, h = 1;
+    if (!backbuffer || !clip_to_target(x, y, w, h)) return;
+    if (g_render_bytes == 2) ((uint16_t*)backbuffer)[y * fb_info.width + x] = (uint16_t)color;
+    else backbuffer[y * fb_info.width + x] = color;
 }
 
 void draw_char(char c, int x, int y, uint32_t color) {
     if ((unsigned char)c > 127) return;
+    if (g_dl_record) { char s[2] = { c, 0 }; g_dl_record->string(s, x, y, color); return; }
     const uint8_t* glyph = font + (int)c * 8;
     for (int i = 0; i < 8; i++) {
         for (int j = 0; j < 8; j++) {
@@ -602,43 +2071,350 @@ void draw_char(char c, int x, int y, uint32_t color) {
 }
 
 void draw_string(const char* str, int x, int y, uint32_t color) {
+    if (g_dl_record) { g_dl_record->string(str, x, y, color); return; }
     for (int i = 0; str[i]; i++) {
         draw_char(str[i], x + i * 8, y, color);
     }
 }
 
+// =============================================================================
+// SIMD PIXEL KERNELS
+// =============================================================================
+// Span kernels for 32bpp native pixels. Each has a scalar and an SSE2 version
+// (4 pixels per step); simd_init() picks the SSE2 table when CPUID reports it
+// and enables SSE in CR0/CR4. The SSE2 code is written with GCC vector
+// extensions and target("sse2"), so the rest of the kernel still builds for
+// plain i386 and never touches XMM state.
+//
+// Blends use a 0..256 weight per channel, computed identically in both
+// versions so the results are bit-exact:
+//   out = (src * a + dst * (256 - a)) >> 8, a = alpha + (alpha >> 7)
+// Per-pixel alpha is read from the top byte of the source pixel.
+//
+// The kernel is built without -O, so the span kernels (both versions, to keep
+// the benchmark honest) ask for O2 locally.
+
+#define PIX_KERNEL __attribute__((optimize("O2")))
+#define SIMD_SSE2 __attribute__((target("sse2"), optimize("O2")))
+#define PIX_INLINE __attribute__((always_inline, optimize("O2"))) static inline
+
+typedef uint32_t v4u __attribute__((vector_size(16)));
+typedef uint32_t v4u_ua __attribute__((vector_size(16), aligned(4), may_alias));
+typedef uint16_t v8u16 __attribute__((vector_size(16)));
+
+struct PixelKernels {
+    const char* name;
+    void (*fill)(uint32_t* dst, uint32_t color, int n);
+    void (*copy)(uint32_t* dst, const uint32_t* src, int n);
+    void (*copy_key)(uint32_t* dst, const uint32_t* src, int n, uint32_t key);
+    void (*blend_const)(uint32_t* dst, const uint32_t* src, int n, uint32_t alpha);
+    void (*blend_alpha)(uint32_t* dst, const uint32_t* src, int n);
+    void (*fill_blend)(uint32_t* dst, uint32_t color, int n, uint32_t alpha);
+    // Change-detection hash over n words, chained through `seed`. Values are
+    // only comparable within one table.
+    uint32_t (*hash)(const uint32_t* src, int n, uint32_t seed);
+};
+
+static const uint32_t PIX_RB_MASK = 0x00FF00FF;
+
+PIX_INLINE uint32_t pix_weight(uint32_t alpha) { return alpha + (alpha >> 7); }
+
+PIX_INLINE uint32_t pix_lerp(uint32_t s, uint32_t d, uint32_t a) {
+    uint32_t rb = ((s & PIX_RB_MASK) * a + (d & PIX_RB_MASK) * (256 - a)) >> 8;
+    uint32_t ag = ((s >> 8) & PIX_RB_MASK) * a + ((d >> 8) & PIX_RB_MASK) * (256 - a);
+    return (rb & PIX_RB_MASK) | (ag & ~PIX_RB_MASK);
+}
+
+// --- Scalar ---
+PIX_KERNEL static void pix_fill_scalar(uint32_t* dst, uint32_t color, int n) {
+    if (n <= 0) return;
+    asm volatile("rep stosl" : "+D"(dst), "+c"(n) : "a"(color) : "memory");
+}
+
+PIX_KERNEL static void pix_copy_scalar(uint32_t* dst, const uint32_t* src, int n) {
+    if (n <= 0) return;
+    asm volatile("rep movsl" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+}
+
+PIX_KERNEL static void pix_copy_key_scalar(uint32_t* dst, const uint32_t* src, int n, uint32_t key) {
+    for (int i = 0; i < n; i++) if (src[i] != key) dst[i] = src[i];
+}
+
+PIX_KERNEL static void pix_blend_const_scalar(uint32_t* dst, const uint32_t* src, int n, uint32_t alpha) {
+    uint32_t a = pix_weight(alpha);
+    for (int i = 0; i < n; i++) dst[i] = pix_lerp(src[i], dst[i], a);
+}
+
+PIX_KERNEL static void pix_blend_alpha_scalar(uint32_t* dst, const uint32_t* src, int n) {
+    for (int i = 0; i < n; i++) dst[i] = pix_lerp(src[i], dst[i], pix_weight(src[i] >> 24));
+}
+
+PIX_KERNEL static void pix_fill_blend_scalar(uint32_t* dst, uint32_t color, int n, uint32_t alpha) {
+    uint32_t a = pix_weight(alpha);
+    for (int i = 0; i < n; i++) dst[i] = pix_lerp(color, dst[i], a);
+}
+
+// Fletcher-style running sums plus a rotate-xor lane; cheap, order sensitive.
+PIX_KERNEL static uint32_t pix_hash_scalar(const uint32_t* src, int n, uint32_t seed) {
+    uint32_t a = seed, b = 0, c = 0x9E3779B9;
+    for (int i = 0; i < n; i++) {
+        a += src[i];
+        b += a;
+        c = ((c << 5) | (c >> 27)) ^ src[i];
+    }
+    return a ^ ((b << 11) | (b >> 21)) ^ ((c << 21) | (c >> 11));
+}
+
+// --- SSE2 ---
+SIMD_SSE2 PIX_INLINE v4u pix_lerp4(v4u s, v4u d, v8u16 a) {
+    const v4u rb_mask = {PIX_RB_MASK, PIX_RB_MASK, PIX_RB_MASK, PIX_RB_MASK};
+    v8u16 ia = (v8u16){256, 256, 256, 256, 256, 256, 256, 256} - a;
+    v8u16 rb = (v8u16)(s & rb_mask) * a + (v8u16)(d & rb_mask) * ia;
+    v8u16 ag = (v8u16)((s >> 8) & rb_mask) * a + (v8u16)((d >> 8) & rb_mask) * ia;
+    return (((v4u)rb >> 8) & rb_mask) | ((v4u)ag & ~rb_mask);
+}
+
+SIMD_SSE2 static void pix_fill_sse2(uint32_t* dst, uint32_t color, int n) {
+    while (n > 0 && ((uintptr_t)dst & 15)) { *dst++ = color; n--; }
+    v4u c = {color, color, color, color};
+    for (; n >= 16; n -= 16, dst += 16) {
+        ((v4u*)dst)[0] = c; ((v4u*)dst)[1] = c;
+        ((v4u*)dst)[2] = c; ((v4u*)dst)[3] = c;
+    }
+    for (; n >= 4; n -= 4, dst += 4) *(v4u*)dst = c;
+    while (n-- > 0) *dst++ = color;
+}
+
+SIMD_SSE2 static void pix_copy_sse2(uint32_t* dst, const uint32_t* src, int n) {
+    while (n > 0 && ((uintptr_t)dst & 15)) { *dst++ = *src++; n--; }
+    for (; n >= 16; n -= 16, dst += 16, src += 16) {
+        v4u a = *(const v4u_ua*)(src), b = *(const v4u_ua*)(src + 4);
+        v4u c = *(const v4u_ua*)(src + 8), d = *(const v4u_ua*)(src + 12);
+        ((v4u*)dst)[0] = a; ((v4u*)dst)[1] = b;
+        ((v4u*)dst)[2] = c; ((v4u*)dst)[3] = d;
+    }
+    for (; n >= 4; n -= 4, dst += 4, src += 4) *(v4u*)dst = *(const v4u_ua*)src;
+    while (n-- > 0) *dst++ = *src++;
+}
+
+SIMD_SSE2 static void pix_copy_key_sse2(uint32_t* dst, const uint32_t* src, int n, uint32_t key) {
+    v4u k = {key, key, key, key};
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        v4u s = *(const v4u_ua*)(src + i);
+        v4u d = *(v4u_ua*)(dst + i);
+        v4u m = (v4u)(s == k);
+        *(v4u_ua*)(dst + i) = (d & m) | (s & ~m);
+    }
+    for (; i < n; i++) if (src[i] != key) dst[i] = src[i];
+}
+
+SIMD_SSE2 static void pix_blend_const_sse2(uint32_t* dst, const uint32_t* src, int n, uint32_t alpha) {
+    uint16_t w = (uint16_t)pix_weight(alpha);
+    v8u16 a = {w, w, w, w, w, w, w, w};
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+        *(v4u_ua*)(dst + i) = pix_lerp4(*(const v4u_ua*)(src + i), *(v4u_ua*)(dst + i), a);
+    for (; i < n; i++) dst[i] = pix_lerp(src[i], dst[i], w);
+}
+
+SIMD_SSE2 static void pix_blend_alpha_sse2(uint32_t* dst, const uint32_t* src, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        v4u s = *(const v4u_ua*)(src + i);
+        v4u a = s >> 24;
+        a += a >> 7;
+        *(v4u_ua*)(dst + i) = pix_lerp4(s, *(v4u_ua*)(dst + i), (v8u16)(a | (a << 16)));
+    }
+    for (; i < n; i++) dst[i] = pix_lerp(src[i], dst[i], pix_weight(src[i] >> 24));
+}
+
+SIMD_SSE2 static void pix_fill_blend_sse2(uint32_t* dst, uint32_t color, int n, uint32_t alpha) {
+    uint16_t w = (uint16_t)pix_weight(alpha);
+    v8u16 a = {w, w, w, w, w, w, w, w};
+    v4u c = {color, color, color, color};
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+        *(v4u_ua*)(dst + i) = pix_lerp4(c, *(v4u_ua*)(dst + i), a);
+    for (; i < n; i++) dst[i] = pix_lerp(color, dst[i], w);
+}
+
+SIMD_SSE2 static uint32_t pix_hash_sse2(const uint32_t* src, int n, uint32_t seed) {
+    v4u a = {seed, 0, 0, 0}, b = {0, 0, 0, 0}, c = {0x9E3779B9, 0x9E3779B9, 0x9E3779B9, 0x9E3779B9};
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        v4u v = *(const v4u_ua*)(src + i);
+        a += v;
+        b += a;
+        c = ((c << 5) | (c >> 27)) ^ v;
+    }
+    v4u h = a ^ ((b << 11) | (b >> 21)) ^ ((c << 21) | (c >> 11));
+    uint32_t r = h[0] ^ ((h[1] << 8) | (h[1] >> 24)) ^ ((h[2] << 16) | (h[2] >> 16)) ^ ((h[3] << 24) | (h[3] >> 8));
+    for (; i < n; i++) r = ((r << 5) | (r >> 27)) + src[i];
+    return r;
+}
+
+static const PixelKernels g_pix_scalar = {
+    "scalar", pix_fill_scalar, pix_copy_scalar, pix_copy_key_scalar,
+    pix_blend_const_scalar, pix_blend_alpha_scalar, pix_fill_blend_scalar, pix_hash_scalar
+};
+static const PixelKernels g_pix_sse2 = {
+    "sse2", pix_fill_sse2, pix_copy_sse2, pix_copy_key_sse2,
+    pix_blend_const_sse2, pix_blend_alpha_sse2, pix_fill_blend_sse2, pix_hash_sse2
+};
+static const PixelKernels* g_pix = &g_pix_scalar;
+static bool g_cpu_has_sse2 = false;
+
+void simd_init() {
+    uint32_t a, b, c, d;
+    cpuid(0, &a, &b, &c, &d);
+    if (a < 1) return;
+    cpuid(1, &a, &b, &c, &d);
+    if (!(d & (1u << 26)) || !(d & (1u << 24))) return; // SSE2 + FXSR
+
+    uint32_t cr0, cr4;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 &= ~(1u << 2);              // EM: no x87 emulation
+    cr0 |= (1u << 1);               // MP
+    asm volatile("mov %0, %%cr0" : : "r"(cr0));
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= (1u << 9) | (1u << 10);  // OSFXSR | OSXMMEXCPT
+    asm volatile("mov %0, %%cr4" : : "r"(cr4));
+
+    g_cpu_has_sse2 = true;
+    g_pix = &g_pix_sse2;
+}
+
+// --- RGB565 spans ---
+// The 16bpp render mode runs fill and copy through the 32-bit kernels on pixel
+// pairs; keying and blending go a pixel at a time. Blends use the usual
+// 0x07E0F81F spread so all three channels scale in one multiply (5-bit weight).
+static const uint32_t PIX565_SPREAD = 0x07E0F81F;
+
+static void pix16_fill(uint16_t* dst, uint16_t color, int n) {
+    if (n > 0 && ((uintptr_t)dst & 2)) { *dst++ = color; n--; }
+    if (n <= 0) return;
+    g_pix->fill((uint32_t*)dst, color | ((uint32_t)color << 16), n >> 1);
+    if (n & 1) dst[n - 1] = color;
+}
+
+static void pix16_copy(uint16_t* dst, const uint16_t* src, int n) {
+    if (n > 0 && ((uintptr_t)dst & 2)) { *dst++ = *src++; n--; }
+    if (n <= 0) return;
+    if (!((uintptr_t)src & 2)) {
+        g_pix->copy((uint32_t*)dst, (const uint32_t*)src, n >> 1);
+        if (n & 1) dst[n - 1] = src[n - 1];
+    } else {
+        for (int i = 0; i < n; i++) dst[i] = src[i];
+    }
+}
+
+PIX_KERNEL static void pix16_copy_key(uint16_t* dst, const uint16_t* src, int n, uint16_t key) {
+    for (int i = 0; i < n; i++) if (src[i] != key) dst[i] = src[i];
+}
+
+PIX_KERNEL static void pix16_fill_blend(uint16_t* dst, uint16_t color, int n, uint32_t alpha) {
+    uint32_t a = pix_weight(alpha) >> 3;
+    uint32_t c = (color | ((uint32_t)color << 16)) & PIX565_SPREAD;
+    for (int i = 0; i < n; i++) {
+        uint32_t d = (dst[i] | ((uint32_t)dst[i] << 16)) & PIX565_SPREAD;
+        uint32_t r = ((c * a + d * (32 - a)) >> 5) & PIX565_SPREAD;
+        dst[i] = (uint16_t)(r | (r >> 16));
+    }
+}
+
+// Spans at the current render depth; `color` and `key` are native pixels.
+static inline void span_fill(void* row, uint32_t color, int n) {
+    if (g_render_bytes == 2) pix16_fill((uint16_t*)row, (uint16_t)color, n);
+    else g_pix->fill((uint32_t*)row, color, n);
+}
+static inline void span_copy(void* dst, const void* src, int n) {
+    if (g_render_bytes == 2) pix16_copy((uint16_t*)dst, (const uint16_t*)src, n);
+    else g_pix->copy((uint32_t*)dst, (const uint32_t*)src, n);
+}
+static inline void span_copy_key(void* dst, const void* src, int n, uint32_t key) {
+    if (g_render_bytes == 2) pix16_copy_key((uint16_t*)dst, (const uint16_t*)src, n, (uint16_t)key);
+    else g_pix->copy_key((uint32_t*)dst, (const uint32_t*)src, n, key);
+}
+static inline void span_fill_blend(void* row, uint32_t color, int n, uint32_t alpha) {
+    if (g_render_bytes == 2) pix16_fill_blend((uint16_t*)row, (uint16_t)color, n, alpha);
+    else g_pix->fill_blend((uint32_t*)row, color, n, alpha);
+}
+
+// Blit a w*h block of native pixels (row stride src_stride pixels, at the
+// render depth) into the backbuffer.
+// `key` selects the colour-keyed kernel; pass PIX_NO_KEY for an opaque copy.
+static const uint32_t PIX_NO_KEY = 0xFFFFFFFF;
+void blit_to_back(int x, int y, int w, int h, const uint32_t* src, int src_stride, uint32_t key = PIX_NO_KEY) {
+    if (g_dl_record) { g_dl_record->blit(x, y, w, h, src, src_stride, key); return; }
+    if (!backbuffer || !src) return;
+    int ox = x, oy = y;
+    if (!clip_to_target(x, y, w, h)) return;
+    int sx = x - ox, sy = y - oy;
+
+    for (int row = 0; row < h; row++) {
+        uint8_t* d = surface_at(backbuffer, fb_info.width, x, y + row);
+        const uint8_t* s = surface_at(src, src_stride, sx, sy + row);
+        if (key == PIX_NO_KEY) span_copy(d, s, w);
+        else span_copy_key(d, s, w, key);
+    }
+}
+
+// Moves a w*h block of the backbuffer by (dx, dy). Both the source and the
+// destination must lie on screen. Rows are walked away from the overlap; a
+// purely horizontal move goes through a row buffer.
+static uint32_t g_move_row[4096];
+void move_rect_in_back(int x, int y, int w, int h, int dx, int dy) {
+    if (!backbuffer || w <= 0 || h <= 0 || (dx == 0 && dy == 0)) return;
+    bool bounce = (dy == 0) && (uint32_t)w * g_render_bytes <= sizeof(g_move_row);
+    if (dy == 0 && !bounce) return;
+    for (int i = 0; i < h; i++) {
+        int row = (dy > 0) ? (h - 1 - i) : i;
+        const uint8_t* src = surface_at(backbuffer, fb_info.width, x, y + row);
+        uint8_t* dst = surface_at(backbuffer, fb_info.width, x + dx, y + dy + row);
+        if (bounce) {
+            span_copy(g_move_row, src, w);
+            span_copy(dst, g_move_row, w);
+        } else {
+            span_copy(dst, src, w);
+        }
+    }
+}
+
+// Translucent solid fill; alpha 0 (invisible) .. 255 (opaque).
+void draw_rect_blend(int x, int y, int w, int h, uint32_t color, uint32_t alpha) {
+    if (g_dl_record) { g_dl_record->blend(x, y, w, h, color, alpha); return; }
+    if (!backbuffer || !clip_to_target(x, y, w, h)) return;
+
+    for (int row = 0; row < h; row++)
+        span_fill_blend(surface_at(backbuffer, fb_info.width, x, y + row), color, w, alpha);
+}
+
 // =============================================================================
 // OPTIMIZED FILL RECT - ATOMIC SCANLINE RENDERING
 // =============================================================================
+// `color` is a native pixel (a ColorPalette entry or GraphicsDriver::native()).
 void draw_rect_filled(int x, int y, int w, int h, uint32_t color) {
-    // Clip to screen bounds
-    if (x < 0) { w += x; x = 0; }
-    if (y < 0) { h += y; y = 0; }
-    if (x >= (int)fb_info.width || y >= (int)fb_info.height) return;
-    if (x + w > (int)fb_info.width) w = fb_info.width - x;
-    if (y + h > (int)fb_info.height) h = fb_info.height - y;
-    if (w <= 0 || h <= 0) return;
+    if (g_dl_record) { g_dl_record->fill(x, y, w, h, color); return; }
+    // Clip to screen bounds and the active clip rect
+    if (!backbuffer || !clip_to_target(x, y, w, h)) return;
 
     // Render entire rect atomically (no state machine - prevents tearing)
     for (int dy = 0; dy < h; dy++) {
-        int screenY = y + dy;
-        if (screenY >= 0 && screenY < (int)fb_info.height) {
-            uint32_t* row = &backbuffer[screenY * fb_info.width + x];
-            
-            // Fast fill with rep stosl on x86
-            #ifdef __i386__
-            uint32_t count = w;
-            asm volatile(
-                "rep stosl"
-                : "=D"(row), "=c"(count)
-                : "D"(row), "c"(count), "a"(color)
-                : "memory"
-            );
-            #else
-            for (int i = 0; i < w; i++) {
-                row[i] = color;
-            }
-            #endif
+        span_fill(surface_at(backbuffer, fb_info.width, x, y + dy), color, w);
+    }
+}
+
+void DisplayList::replay() const {
+    for (int i = 0; i < count; i++) {
+        const DisplayCommand& c = cmds[i];
+        ClipRect r = { c.x, c.y, c.x + c.w, c.y + c.h };
+        if (!rects_intersect(r, g_clip)) continue;
+        switch (c.op) {
+            case DL_FILL:  draw_rect_filled(c.x, c.y, c.w, c.h, c.color); break;
+            case DL_BLEND: draw_rect_blend(c.x, c.y, c.w, c.h, c.color, c.aux); break;
+            case DL_TEXT:  draw_string(text + c.aux, c.x, c.y, c.color); break;
+            case DL_BLIT:  blit_to_back(c.x, c.y, c.w, c.h, (const uint32_t*)c.data, (int)c.aux, c.color); break;
         }
     }
 }
@@ -702,6 +2478,126 @@ bool mouse_right_down = false;       // New
 bool mouse_right_last_frame = false; // New
 char last_key_press = 0;
 
+// =============================================================================
+// INPUT EVENT QUEUE
+// =============================================================================
+// The PS/2 IRQ handler decodes bytes into timestamped events and pushes them
+// here; poll_input_universal in the main loop drains them. There is exactly
+// one producer (IRQ context) and one consumer, so the ring is lock-free: each
+// side writes only its own index, and a compiler barrier orders the slot
+// write before the index update.
+template <typename T, uint32_t N>
+struct SpscRing {
+    T slots[N];
+    volatile uint32_t head, tail;
+
+    bool push(const T& v) {
+        uint32_t h = head;
+        if (h - tail == N) return false;
+        slots[h % N] = v;
+        asm volatile ("" ::: "memory");
+        head = h + 1;
+        return true;
+    }
+    bool peek(T* v) const {
+        uint32_t t = tail;
+        if (t == head) return false;
+        asm volatile ("" ::: "memory");
+        *v = slots[t % N];
+        return true;
+    }
+    void drop() {
+        asm volatile ("" ::: "memory");
+        tail = tail + 1;
+    }
+    bool pop(T* v) {
+        if (!peek(v)) return false;
+        drop();
+        return true;
+    }
+    bool empty() const { return head == tail; }
+};
+
+enum InputEventType : uint8_t { INPUT_KEY, INPUT_MOTION, INPUT_BUTTONS };
+enum : uint8_t { MOD_SHIFT = 1, MOD_CTRL = 2 };
+enum : uint8_t { BUTTON_LEFT = 1, BUTTON_RIGHT = 2, BUTTON_MIDDLE = 4 };
+
+struct InputEvent {
+    uint64_t tsc;           // when the IRQ decoded it
+    uint8_t type;
+    uint8_t down;           // INPUT_KEY: press (1) or release (0)
+    uint8_t scancode;       // INPUT_KEY: set 1, release bit stripped
+    uint8_t state;          // INPUT_KEY: MOD_* held; INPUT_BUTTONS: BUTTON_* held
+    int16_t dx, dy;         // INPUT_MOTION: raw counts, y grows downwards
+};
+
+static SpscRing<InputEvent, 256> g_input_queue;
+
+struct InputStats {
+    uint32_t events, coalesced;
+    volatile uint32_t dropped;      // written by the producer
+    uint32_t max_wait_cycles;       // longest IRQ-to-consumer delay seen
+    uint64_t last_event_tsc;        // timestamp of the newest consumed event
+    uint64_t pass_first_tsc;        // oldest event of the last poll pass; 0 if none
+};
+static InputStats g_input_stats;
+
+// =============================================================================
+// INPUT LATENCY
+// =============================================================================
+// Every input pass is followed from the IRQ that decoded its oldest event to
+// three points: the main loop dequeuing it ("queue"), the WM or a VM having
+// handled it ("handled"), and the first swap_buffers() afterwards, which is
+// the frame that shows its effect ("photon"). Samples go into log2
+// histograms in microseconds; `latency` prints them and `latency reset`
+// clears them.
+struct LatencyHistogram {
+    static const int BUCKETS = 20;      // bucket i counts samples < 2^(i+1) us
+    uint32_t counts[BUCKETS];
+    uint32_t samples, max_us;
+
+    void add(uint64_t cycles) {
+        uint32_t us = (uint32_t)u64_div32(cycles_to_ns(cycles), 1000);
+        int b = 0;
+        while (b < BUCKETS - 1 && us >= (2u << b)) b++;
+        counts[b]++;
+        samples++;
+        if (us > max_us) max_us = us;
+    }
+    // Upper bound (us) of the bucket holding the pct-th percentile.
+    uint32_t percentile(uint32_t pct) const {
+        uint32_t want = (samples * pct + 99) / 100, seen = 0;
+        for (int b = 0; b < BUCKETS; b++) {
+            seen += counts[b];
+            if (seen >= want) return 2u << b;
+        }
+        return max_us;
+    }
+};
+
+struct LatencyTracker {
+    LatencyHistogram queue, handled, photon;
+    uint32_t via_wm, via_vm;
+    uint64_t unpresented;   // IRQ stamp of the oldest handled input not yet on screen
+
+    void on_handled(uint64_t irq_tsc, bool vm) {
+        handled.add(rdtsc() - irq_tsc);
+        if (vm) via_vm++; else via_wm++;
+        if (!unpresented || irq_tsc < unpresented) unpresented = irq_tsc;
+    }
+    void on_present(uint64_t now) {
+        if (!unpresented) return;
+        photon.add(now - unpresented);
+        unpresented = 0;
+    }
+};
+static LatencyTracker g_latency;
+
+static void input_push(uint8_t type, uint8_t down, uint8_t scancode, uint8_t state, int dx, int dy) {
+    InputEvent ev = { rdtsc(), type, down, scancode, state, (int16_t)dx, (int16_t)dy };
+    if (!g_input_queue.push(ev)) g_input_stats.dropped = g_input_stats.dropped + 1;
+}
+
 struct UniversalMouseState {
     int x;
     int y;
@@ -712,9 +2608,10 @@ struct UniversalMouseState {
     uint8_t packet_buffer[3];
     bool synchronized;
     bool initialized;
+    uint8_t irq_buttons;    // producer's view of the buttons, for change detection
 };
 
-static UniversalMouseState universal_mouse_state = {400, 300, false, false, false, 0, {0}, false, false};
+static UniversalMouseState universal_mouse_state = {400, 300, false, false, false, 0, {0}, false, false, 0};
 
 static void process_universal_mouse_packet(uint8_t data) {
     if (!universal_mouse_state.synchronized) {
@@ -741,10 +2638,6 @@ static void process_universal_mouse_packet(uint8_t data) {
             return;
         }
         
-        universal_mouse_state.left_button = flags & 0x01;
-        universal_mouse_state.right_button = flags & 0x02;
-        universal_mouse_state.middle_button = flags & 0x04;
-        
         int8_t dx = (int8_t)universal_mouse_state.packet_buffer[1];
         int8_t dy = (int8_t)universal_mouse_state.packet_buffer[2];
         
@@ -755,19 +2648,13 @@ static void process_universal_mouse_packet(uint8_t data) {
             dy = (dy > 0) ? 127 : -128;
         }
         
-        const int SENSITIVITY = 2;
-        int move_x = dx * SENSITIVITY;
-        int move_y = dy * SENSITIVITY;
-        
-        universal_mouse_state.x += move_x;
-        universal_mouse_state.y -= move_y;
-        
-        if (universal_mouse_state.x < 0) universal_mouse_state.x = 0;
-        if (universal_mouse_state.y < 0) universal_mouse_state.y = 0;
-        if (universal_mouse_state.x >= (int)fb_info.width) 
-            universal_mouse_state.x = fb_info.width - 1;
-        if (universal_mouse_state.y >= (int)fb_info.height) 
-            universal_mouse_state.y = fb_info.height - 1;
+        // Motion before buttons, so a click lands where the pointer ended up.
+        if (dx || dy) input_push(INPUT_MOTION, 0, 0, 0, dx, -dy);
+        uint8_t buttons = flags & 0x07;
+        if (buttons != universal_mouse_state.irq_buttons) {
+            universal_mouse_state.irq_buttons = buttons;
+            input_push(INPUT_BUTTONS, 0, 0, buttons, 0, 0);
+        }
         
         universal_mouse_state.synchronized = true;
     }
@@ -778,23 +2665,50 @@ static void process_universal_mouse_packet(uint8_t data) {
 // =============================================================================
 
 // New: Icon drawing functions
+// Icons are rasterised once into 32x32 sprites (after the palette is baked) and
+// drawn with the colour-keyed blit. Sprites are stored at the render depth;
+// g_icon_key marks transparent pixels and is a value no palette entry bakes to
+// (an alpha-only pixel at 32bpp, magenta at 16bpp).
+static const int ICON_SIZE = 32;
+static uint32_t g_icon_key = 0xFF000000;
+enum { SPRITE_FILE, SPRITE_SHORTCUT, SPRITE_FOLDER, SPRITE_COUNT };
+static uint32_t g_icon_sprites[SPRITE_COUNT][ICON_SIZE * ICON_SIZE];
+
+static void sprite_fill(uint32_t* sprite, int x, int y, int w, int h, uint32_t color) {
+    for (int dy = 0; dy < h; dy++)
+        span_fill(surface_at(sprite, ICON_SIZE, x, y + dy), color, w);
+}
+
+void bake_icon_sprites() {
+    g_icon_key = (g_render_bytes == 2) ? 0xF81F : 0xFF000000;
+    for (int i = 0; i < SPRITE_COUNT; i++)
+        sprite_fill(g_icon_sprites[i], 0, 0, ICON_SIZE, ICON_SIZE, g_icon_key);
+
+    for (int i = SPRITE_FILE; i <= SPRITE_SHORTCUT; i++) {
+        uint32_t* s = g_icon_sprites[i];
+        sprite_fill(s, 0, 0, 32, 32, ColorPalette::ICON_FILE_FILL);
+        sprite_fill(s, 0, 0, 32, 1, ColorPalette::ICON_FILE_OUTLINE);
+        sprite_fill(s, 31, 0, 1, 32, ColorPalette::ICON_FILE_OUTLINE);
+        sprite_fill(s, 0, 31, 32, 1, ColorPalette::ICON_FILE_OUTLINE);
+        sprite_fill(s, 0, 0, 1, 32, ColorPalette::ICON_FILE_OUTLINE);
+    }
+    uint32_t* sc = g_icon_sprites[SPRITE_SHORTCUT];
+    sprite_fill(sc, 4, 22, 10, 6, ColorPalette::ICON_SHORTCUT_ARROW);
+    sprite_fill(sc, 8, 20, 1, 1, ColorPalette::ICON_SHORTCUT_ARROW);
+    sprite_fill(sc, 9, 21, 1, 1, ColorPalette::ICON_SHORTCUT_ARROW);
+
+    uint32_t* f = g_icon_sprites[SPRITE_FOLDER];
+    sprite_fill(f, 0, 5, 32, 27, ColorPalette::ICON_FOLDER_FILL);
+    sprite_fill(f, 0, 0, 14, 8, ColorPalette::ICON_FOLDER_FILL);
+    sprite_fill(f, 0, 31, 32, 1, ColorPalette::ICON_FILE_OUTLINE);
+}
+
 void draw_icon_file(int x, int y, bool is_shortcut) {
-    draw_rect_filled(x, y, 32, 32, ColorPalette::ICON_FILE_FILL);
-    draw_rect_filled(x, y, 32, 1, ColorPalette::ICON_FILE_OUTLINE);
-    draw_rect_filled(x + 31, y, 1, 32, ColorPalette::ICON_FILE_OUTLINE);
-    draw_rect_filled(x, y + 31, 32, 1, ColorPalette::ICON_FILE_OUTLINE);
-    draw_rect_filled(x, y, 1, 32, ColorPalette::ICON_FILE_OUTLINE);
-    if(is_shortcut) {
-        draw_rect_filled(x + 4, y + 22, 10, 6, ColorPalette::ICON_SHORTCUT_ARROW);
-        put_pixel_back(x+8, y+20, ColorPalette::ICON_SHORTCUT_ARROW);
-        put_pixel_back(x+9, y+21, ColorPalette::ICON_SHORTCUT_ARROW);
-    }
+    blit_to_back(x, y, ICON_SIZE, ICON_SIZE, g_icon_sprites[is_shortcut ? SPRITE_SHORTCUT : SPRITE_FILE], ICON_SIZE, g_icon_key);
 }
 
 void draw_icon_folder(int x, int y) {
-    draw_rect_filled(x, y + 5, 32, 27, ColorPalette::ICON_FOLDER_FILL);
-    draw_rect_filled(x, y, 14, 8, ColorPalette::ICON_FOLDER_FILL);
-    draw_rect_filled(x, y + 31, 32, 1, ColorPalette::ICON_FILE_OUTLINE);
+    blit_to_back(x, y, ICON_SIZE, ICON_SIZE, g_icon_sprites[SPRITE_FOLDER], ICON_SIZE, g_icon_key);
 }
 
 // New: Desktop items structure
@@ -813,9 +2727,28 @@ public:
     bool has_focus;
     bool is_closed;
 
+    // Last composed frame and the one being recorded; see WindowManager::record_list.
+    DisplayList dl[2];
+    int dl_front;
+
+    // --- Scheduling ---
+    // The WM re-records draw() only after invalidate() (or when the window
+    // moved or changed focus) and calls update() only while an event is
+    // pending: a subscribed timer expiring or an explicit request_update().
+    // Idle windows cost nothing per frame.
+    enum : uint32_t { EVT_UPDATE = 1u << 0, EVT_TIMER = 1u << 1 };
+    bool needs_redraw;
+    uint32_t event_mask, pending_events;
+    uint32_t timer_period;              // ms; 0 = off
+    KTimer timer;
+    int drawn_x, drawn_y;
+    bool drawn_focus;
+
     Window(int x, int y, int w, int h, const char* title)
-        : x(x), y(y), w(w), h(h), title(title), has_focus(false), is_closed(false) {}
-    virtual ~Window() {}
+        : x(x), y(y), w(w), h(h), title(title), has_focus(false), is_closed(false), dl_front(0),
+          needs_redraw(true), event_mask(EVT_UPDATE), pending_events(0), timer_period(0),
+          drawn_x(x), drawn_y(y), drawn_focus(false) {}
+    virtual ~Window() { timer_cancel(&timer); dl[0].release(); dl[1].release(); }
     virtual void put_char(char c) {} // ADD THIS
 
     virtual void draw() = 0;
@@ -826,6 +2759,30 @@ public:
     virtual void update() = 0;
     virtual void console_print(const char* s) {}
 
+    void invalidate() { needs_redraw = true; mark_screen_dirty(); }
+    void request_update() { pending_events |= EVT_UPDATE; mark_screen_dirty(); }
+    void subscribe(uint32_t events) { event_mask |= events; }
+    void unsubscribe(uint32_t events) { event_mask &= ~events; pending_events &= ~events; }
+    // Periodic EVT_TIMER every `period_ms` (0 stops it).
+    void set_timer(uint32_t period_ms) {
+        timer_period = period_ms;
+        if (period_ms) {
+            subscribe(EVT_TIMER);
+            timer_arm(&timer, period_ms, timer_fired, this);
+        } else {
+            unsubscribe(EVT_TIMER);
+            timer_cancel(&timer);
+        }
+    }
+    void post_event(uint32_t events) { pending_events |= events & event_mask; }
+
+    static void timer_fired(void* arg) {
+        Window* win = (Window*)arg;
+        if (win->timer_period) timer_arm(&win->timer, win->timer_period, timer_fired, win);
+        win->post_event(EVT_TIMER);
+        if (win->pending_events) mark_screen_dirty();   // run_scheduled on the next frame
+    }
+
     bool is_in_titlebar(int mx, int my) { return mx > x && mx < x + w && my > y && my < y + 25; }
     bool is_in_close_button(int mx, int my) { int btn_x = x + w - 22, btn_y = y + 4; return mx >= btn_x && mx < btn_x + 18 && my >= btn_y && my < btn_y + 18; }
     void close() { is_closed = true; }
@@ -844,6 +2801,21 @@ private:
     int num_desktop_items;
     int dragging_icon_idx;
 
+    // Cached desktop layer: background, taskbar and icons pre-rendered at
+    // screen size. Rebuilt only when invalidate_desktop() has been called
+    // (item reload, icon move, render mode switch) or the resolution or
+    // render depth differs from the cache.
+    uint32_t* desktop_layer;
+    uint32_t desktop_layer_w, desktop_layer_h, desktop_layer_bytes;
+    bool desktop_layer_dirty;
+    bool desktop_items_stale;       // root listing deferred, filesystem was busy
+
+    // Damage-driven composition (see CLIP, DAMAGE AND DISPLAY LISTS).
+    DamageList damage;
+    DisplayList menu_dl[2];
+    int menu_front;
+    int cursor_x, cursor_y;
+
     bool context_menu_active;
     int context_menu_x, context_menu_y;
 	const char* context_menu_items[8];
@@ -857,7 +2829,9 @@ private:
 public:
     WindowManager() : num_windows(0), focused_idx(-1), dragging_idx(-1), 
                       num_desktop_items(0), dragging_icon_idx(-1), 
-                      context_menu_active(false) {}
+                      desktop_layer(nullptr), desktop_layer_w(0), desktop_layer_h(0), desktop_layer_bytes(0),
+                      desktop_layer_dirty(true), desktop_items_stale(false), menu_front(0), cursor_x(-1), cursor_y(-1),
+                      context_menu_active(false) { damage.clear(); damage.add_all(); }
     void show_file_context_menu(int mx, int my, const char* filename) {
 		context_menu_active = true;
 		context_menu_x = mx;
@@ -886,12 +2860,17 @@ public:
             windows[focused_idx]->put_char(c);
         }
     }
+// Keeps the current icons and retries from run_scheduled() while a job
+// holds the filesystem.
 void load_desktop_items() {
+    if (!fs_try_begin()) { desktop_items_stale = true; return; }
+    desktop_items_stale = false;
     num_desktop_items = 0;
 
     // Load items from the root directory
     static fat_dir_entry_t file_list[64]; // Max 64 files on desktop
     int num_files = fat32_list_directory("/", file_list, 64);
+    fs_end();
 
     for (int i = 0; i < num_files && num_desktop_items < 64; ++i) {
         fat32_get_fne_from_entry(&file_list[i], desktop_items[num_desktop_items].name);
@@ -907,8 +2886,47 @@ void load_desktop_items() {
         }
         num_desktop_items++;
     }
+    invalidate_desktop();
 }
 
+    void invalidate_desktop() { desktop_layer_dirty = true; damage.add_all(); }
+
+    void add_damage(int x, int y, int w, int h) { damage.add(x, y, w, h); }
+    void damage_all() { damage.add_all(); }
+
+    // Display lists hold colours in the render format, so after a format
+    // switch every window and the menu record afresh.
+    void rerecord_all() {
+        for (int i = 0; i < num_windows; i++) if (windows[i]) windows[i]->needs_redraw = true;
+        menu_dl[0].reset();
+        menu_dl[1].reset();
+        damage.add_all();
+    }
+
+    // Damages the old and new cursor footprint when the pointer moves; the
+    // cursor itself is drawn on top after composition.
+    void track_cursor(int mx, int my) {
+        if (mx == cursor_x && my == cursor_y) return;
+        add_damage(cursor_x, cursor_y, CURSOR_W, CURSOR_H);
+        add_damage(mx, my, CURSOR_W, CURSOR_H);
+        cursor_x = mx;
+        cursor_y = my;
+    }
+    static const int CURSOR_W = 12, CURSOR_H = 12;
+
+    // Delivers due timers and pending events; called once per frame period.
+    void run_scheduled() {
+        if (desktop_items_stale && !g_vm_file_io && !g_fs_lock.busy()) load_desktop_items();
+        for (int i = 0; i < num_windows; i++) {
+            Window* win = windows[i];
+            if (!win || win->is_closed) continue;
+            if (win->pending_events) {
+                win->pending_events = 0;
+                win->update();
+            }
+        }
+    }
+
     void add_window(Window* win) {
         if (num_windows < 16) {
             if (focused_idx != -1 && focused_idx < num_windows) windows[focused_idx]->has_focus = false;
@@ -923,6 +2941,7 @@ void load_desktop_items() {
         if (idx < 0 || idx >= num_windows || idx == focused_idx) return;
         if (focused_idx != -1 && focused_idx < num_windows) windows[focused_idx]->has_focus = false;
         Window* focused = windows[idx];
+        damage_window(focused);  // stacking order changes
         for (int i = idx; i < num_windows - 1; i++) windows[i] = windows[i+1];
         windows[num_windows - 1] = focused;
         focused_idx = num_windows - 1;
@@ -936,31 +2955,168 @@ void load_desktop_items() {
         return nullptr;
     }
 
-    void cleanup_closed_windows() {
-        if (num_windows == 0) return;
-        int current_idx = 0;
-        while (current_idx < num_windows) {
-            if (windows[current_idx]->is_closed) {
-                delete windows[current_idx];
-                for (int j = current_idx; j < num_windows - 1; j++) {
-                    windows[j] = windows[j + 1];
-                }
-                num_windows--;
-            } else {
-                current_idx++;
-            }
+    void cleanup_closed_windows() {
+        if (num_windows == 0) return;
+        int current_idx = 0;
+        while (current_idx < num_windows) {
+            if (windows[current_idx]->is_closed) {
+                damage_window(windows[current_idx]);
+                delete windows[current_idx];
+                for (int j = current_idx; j < num_windows - 1; j++) {
+                    windows[j] = windows[j + 1];
+                }
+                num_windows--;
+            } else {
+                current_idx++;
+            }
+        }
+        
+        if (num_windows > 0) {
+            focused_idx = num_windows - 1;
+            for(int i = 0; i < num_windows; i++) windows[i]->has_focus = false;
+            windows[focused_idx]->has_focus = true;
+        } else {
+            focused_idx = -1;
+        }
+    }
+
+    void damage_window(Window* win) {
+        const DisplayList& front = win->dl[win->dl_front];
+        if (!front.empty_bounds)
+            add_damage(front.bounds.x0, front.bounds.y0, front.bounds.x1 - front.bounds.x0, front.bounds.y1 - front.bounds.y0);
+    }
+
+    // Damages `old` minus `cur` (up to four strips).
+    void damage_exposed(const ClipRect& old, const ClipRect& cur) {
+        if (!rects_intersect(old, cur)) { add_damage(old.x0, old.y0, old.x1 - old.x0, old.y1 - old.y0); return; }
+        if (old.y0 < cur.y0) add_damage(old.x0, old.y0, old.x1 - old.x0, cur.y0 - old.y0);
+        if (old.y1 > cur.y1) add_damage(old.x0, cur.y1, old.x1 - old.x0, old.y1 - cur.y1);
+        int band_y0 = old.y0 > cur.y0 ? old.y0 : cur.y0;
+        int band_y1 = old.y1 < cur.y1 ? old.y1 : cur.y1;
+        if (old.x0 < cur.x0) add_damage(old.x0, band_y0, cur.x0 - old.x0, band_y1 - band_y0);
+        if (old.x1 > cur.x1) add_damage(cur.x1, band_y0, old.x1 - cur.x1, band_y1 - band_y0);
+    }
+
+    static bool rect_on_screen(const ClipRect& r) {
+        return r.x0 >= 0 && r.y0 >= 0 && r.x1 <= (int)fb_info.width && r.y1 <= (int)fb_info.height;
+    }
+
+    // Move-by-copy: when the topmost window's new list is its previous list
+    // shifted by (dx, dy), slide the already composed pixels in the backbuffer
+    // and only damage the strips it uncovered. Falls back to normal damage if
+    // either position is partly off screen or the context menu overlaps it.
+    bool try_move_by_copy(const DisplayList& prev, const DisplayList& next) {
+        int dx, dy;
+        if (damage.full || prev.empty_bounds || !next.translated_from(prev, dx, dy)) return false;
+        if (!rect_on_screen(prev.bounds) || !rect_on_screen(next.bounds)) return false;
+        // Both menu lists: a menu closed this frame is still in the backbuffer.
+        for (int m = 0; m < 2; m++) {
+            const DisplayList& menu = menu_dl[m];
+            if (!menu.empty_bounds && (rects_intersect(menu.bounds, prev.bounds) || rects_intersect(menu.bounds, next.bounds)))
+                return false;
+        }
+        if (dy == 0 && (uint32_t)(prev.bounds.x1 - prev.bounds.x0) * g_render_bytes > sizeof(g_move_row)) return false;
+
+        move_rect_in_back(prev.bounds.x0, prev.bounds.y0, prev.bounds.x1 - prev.bounds.x0,
+                          prev.bounds.y1 - prev.bounds.y0, dx, dy);
+        damage_exposed(prev.bounds, next.bounds);
+        return true;
+    }
+
+    // Records `draw` into the back list of a pair and, if it differs from the
+    // front list, damages both footprints and makes it the new front.
+    template <typename DrawFn>
+    void record_list(DisplayList* pair, int& front, DrawFn draw, bool topmost = false) {
+        DisplayList& next = pair[front ^ 1];
+        next.reset();
+        g_dl_record = &next;
+        draw();
+        g_dl_record = nullptr;
+
+        DisplayList& prev = pair[front];
+        if (next.same_as(prev)) return;
+        if (topmost && try_move_by_copy(prev, next)) { front ^= 1; return; }
+        if (!prev.empty_bounds)
+            add_damage(prev.bounds.x0, prev.bounds.y0, prev.bounds.x1 - prev.bounds.x0, prev.bounds.y1 - prev.bounds.y0);
+        if (!next.empty_bounds)
+            add_damage(next.bounds.x0, next.bounds.y0, next.bounds.x1 - next.bounds.x0, next.bounds.y1 - next.bounds.y0);
+        front ^= 1;
+    }
+
+    // Re-renders the cached desktop layer if it was invalidated or the screen
+    // geometry changed (which damages the whole screen).
+    void prepare_desktop_layer() {
+        if (!desktop_layer || desktop_layer_w != fb_info.width || desktop_layer_h != fb_info.height ||
+            desktop_layer_bytes != g_render_bytes) {
+            delete[] desktop_layer;
+            desktop_layer = new uint32_t[surface_words(fb_info.width, fb_info.height)];
+            desktop_layer_w = fb_info.width;
+            desktop_layer_h = fb_info.height;
+            desktop_layer_bytes = g_render_bytes;
+            desktop_layer_dirty = true;
+        }
+        if (desktop_layer && desktop_layer_dirty) {
+            uint32_t* frame = set_render_target(desktop_layer);
+            draw_rect_filled(0, 0, fb_info.width, fb_info.height, ColorPalette::DESKTOP_BLUE);
+            render_desktop();
+            set_render_target(frame);
+            desktop_layer_dirty = false;
+            damage.add_all();
+        }
+    }
+
+    // Copies the cached desktop layer into the backbuffer within g_clip. This
+    // replaces the per-frame clear as well.
+    void draw_desktop() {
+        if (!backbuffer) return;
+        if (!desktop_layer) {
+            // Out of memory: fall back to drawing straight into the frame.
+            draw_rect_filled(0, 0, fb_info.width, fb_info.height, ColorPalette::DESKTOP_BLUE);
+            render_desktop();
+            return;
+        }
+        blit_to_back(0, 0, fb_info.width, fb_info.height, desktop_layer, fb_info.width);
+    }
+
+    void draw_context_menu() {
+        if (!context_menu_active) return;
+        int menu_width = 150;
+        int item_height = 20;
+        int menu_height = num_context_menu_items * item_height;
+        draw_rect_filled(context_menu_x, context_menu_y, menu_width, menu_height, ColorPalette::BUTTON_FACE);
+        draw_rect_filled(context_menu_x, context_menu_y, menu_width, 1, ColorPalette::BUTTON_HIGHLIGHT);
+        draw_rect_filled(context_menu_x, context_menu_y, 1, menu_height, ColorPalette::BUTTON_HIGHLIGHT);
+        draw_rect_filled(context_menu_x+menu_width-1, context_menu_y, 1, menu_height, ColorPalette::BUTTON_SHADOW);
+        draw_rect_filled(context_menu_x, context_menu_y+menu_height-1, menu_width, 1, ColorPalette::BUTTON_SHADOW);
+
+        for (int i = 0; i < num_context_menu_items; ++i) {
+            draw_string(context_menu_items[i], context_menu_x + 5, context_menu_y + 5 + i * item_height, ColorPalette::TEXT_BLACK);
+        }
+    }
+
+    // Rebuilds every damaged region: desktop layer, then each window's list in
+    // stacking order, then the context menu, all clipped to the region.
+    void compose_damage() {
+        if (damage.full) {
+            damage.clear();
+            damage.add(0, 0, fb_info.width, fb_info.height);
         }
-        
-        if (num_windows > 0) {
-            focused_idx = num_windows - 1;
-            for(int i = 0; i < num_windows; i++) windows[i]->has_focus = false;
-            windows[focused_idx]->has_focus = true;
-        } else {
-            focused_idx = -1;
+        for (int d = 0; d < damage.count; d++) {
+            g_clip = damage.rects[d];
+            draw_desktop();
+            for (int i = 0; i < num_windows; i++) {
+                if (!windows[i] || windows[i]->is_closed) continue;
+                const DisplayList& list = windows[i]->dl[windows[i]->dl_front];
+                if (!list.empty_bounds && rects_intersect(list.bounds, g_clip)) list.replay();
+            }
+            const DisplayList& menu = menu_dl[menu_front];
+            if (!menu.empty_bounds && rects_intersect(menu.bounds, g_clip)) menu.replay();
         }
+        clip_reset();
+        damage.clear();
     }
 
-    void draw_desktop() {
+    void render_desktop() {
         using namespace ColorPalette;
         
         // Taskbar base
@@ -1003,51 +3159,41 @@ void load_desktop_items() {
             g_render_state.renderPhase = 1;
         }
         
-        // Phase 1: Clear background (done once per frame in main loop)
+        // Phase 1: Clear background (damaged regions start from the desktop layer in phase 3)
         if (g_render_state.renderPhase == 1) {
             g_render_state.backgroundCleared = true;
             g_render_state.renderPhase = 2;
         }
         
-        // Phase 2: Draw desktop and icons
+        // Phase 2: Record display lists and collect damage
         if (g_render_state.renderPhase == 2) {
-            draw_desktop();
+            prepare_desktop_layer();
+            // The menu is recorded first so a window move can tell whether
+            // the menu covers it (both lists are only compared, not drawn, here).
+            record_list(menu_dl, menu_front, [this]() { draw_context_menu(); });
+            for (int i = 0; i < num_windows; i++) {
+                Window* win = windows[i];
+                if (!win || win->is_closed) continue;
+                if (win->x != win->drawn_x || win->y != win->drawn_y || win->has_focus != win->drawn_focus)
+                    win->needs_redraw = true;
+                if (!win->needs_redraw) continue;
+                win->needs_redraw = false;
+                win->drawn_x = win->x;
+                win->drawn_y = win->y;
+                win->drawn_focus = win->has_focus;
+                record_list(win->dl, win->dl_front, [win]() { win->draw(); }, i == num_windows - 1);
+            }
             g_render_state.renderPhase = 3;
         }
         
-        // Phase 3: Draw windows (all at once to prevent tearing)
+        // Phase 3: Replay lists into damaged regions only (all at once to prevent tearing)
         if (g_render_state.renderPhase == 3) {
-            for (int i = 0; i < num_windows; i++) {
-                if (windows[i] && !windows[i]->is_closed) {
-                    windows[i]->draw();
-                }
-            }
+            compose_damage();
             g_render_state.renderPhase = 4;
         }
 
-        // New Phase 3.5: Draw context menu on top of everything
-        if (context_menu_active) {
-            int menu_width = 150;
-            int item_height = 20;
-            int menu_height = num_context_menu_items * item_height;
-            draw_rect_filled(context_menu_x, context_menu_y, menu_width, menu_height, ColorPalette::BUTTON_FACE);
-            draw_rect_filled(context_menu_x, context_menu_y, menu_width, 1, ColorPalette::BUTTON_HIGHLIGHT);
-            draw_rect_filled(context_menu_x, context_menu_y, 1, menu_height, ColorPalette::BUTTON_HIGHLIGHT);
-            draw_rect_filled(context_menu_x+menu_width-1, context_menu_y, 1, menu_height, ColorPalette::BUTTON_SHADOW);
-            draw_rect_filled(context_menu_x, context_menu_y+menu_height-1, menu_width, 1, ColorPalette::BUTTON_SHADOW);
-
-            for (int i = 0; i < num_context_menu_items; ++i) {
-                draw_string(context_menu_items[i], context_menu_x + 5, context_menu_y + 5 + i * item_height, ColorPalette::TEXT_BLACK);
-            }
-        }
-        
-        // Phase 4: Update logic
+        // Phase 4: Update logic (scheduled per window by run_scheduled())
         if (g_render_state.renderPhase == 4) {
-            for (int i = 0; i < num_windows; i++) {
-                if (windows[i] && !windows[i]->is_closed) {
-                    windows[i]->update();
-                }
-            }
             g_render_state.renderPhase = 5;
         }
         
@@ -1075,40 +3221,32 @@ static inline void io_wait_short() {
 }
 
 static inline void io_delay_short() {
-    for (volatile int i = 0; i < 1; i++) {
-        io_wait_short();
-    }
+    io_wait_short();
 }
 
-static inline void io_delay_medium() {
-    for (volatile int i = 0; i < 5; i++) {
-        io_wait_short();
-    }
-}
+static inline void io_delay_medium() { udelay(5); }
 
-static inline void io_delay_long() {
-    for (volatile int i = 0; i < 100; i++) {
-        io_wait_short();
-    }
-}
+static inline void io_delay_long() { udelay(100); }
 
-static bool ps2_wait_input_ready(uint32_t timeout = 100000) {
-    while (timeout--) {
+static const uint32_t PS2_TIMEOUT_MS = 100;
+
+static bool ps2_wait_input_ready(uint32_t timeout_ms = PS2_TIMEOUT_MS) {
+    Deadline deadline = Deadline::after_ms(timeout_ms);
+    do {
         if (!(inb(PS2_STATUS_PORT) & PS2_STATUS_INPUT_FULL)) {
             return true;
         }
-        if (timeout % 100000 == 0) io_delay_medium();
-    }
+    } while (!deadline.expired());
     return false;
 }
 
-static bool ps2_wait_output_ready(uint32_t timeout = 100000) {
-    while (timeout--) {
+static bool ps2_wait_output_ready(uint32_t timeout_ms = PS2_TIMEOUT_MS) {
+    Deadline deadline = Deadline::after_ms(timeout_ms);
+    do {
         if (inb(PS2_STATUS_PORT) & PS2_STATUS_OUTPUT_FULL) {
             return true;
         }
-        if (timeout % 100000 == 0) io_delay_medium();
-    }
+    } while (!deadline.expired());
     return false;
 }
 
@@ -1456,53 +3594,104 @@ bool initialize_universal_mouse() {
     wm.print_to_focused("ERROR: Mouse initialization failed.\n");
     return false;
 }
-void poll_input_universal() {
+extern "C" void idle_signal_input();
+
+// Producer-side modifier state; each key event carries a snapshot of it.
+static uint8_t g_kbd_mods = 0;
+
+static void input_key_scancode(uint8_t data) {
+    bool down = !(data & 0x80);
+    uint8_t scancode = data & 0x7F;
+    uint8_t bit = (scancode == 0x2A || scancode == 0x36) ? MOD_SHIFT : (scancode == 0x1D ? MOD_CTRL : 0);
+    if (bit) g_kbd_mods = down ? (g_kbd_mods | bit) : (g_kbd_mods & ~bit);
+    input_push(INPUT_KEY, down, scancode, g_kbd_mods, 0, 0);
+}
+
+// Shared by IRQ1 and IRQ12: the status register says which device the byte
+// came from, which also keeps the decoding right if the lines are swapped.
+static void ps2_irq(InterruptFrame*) {
+    uint8_t status = inb(PS2_STATUS_PORT);
+    if (!(status & PS2_STATUS_OUTPUT_FULL)) return;
+    uint8_t data = inb(PS2_DATA_PORT);
+    if (status & PS2_STATUS_AUX_DATA) process_universal_mouse_packet(data);
+    else input_key_scancode(data);
+    idle_signal_input();
+}
+
+static char translate_key(uint8_t scancode, uint8_t mods) {
+    switch (scancode) {
+        case 0x48: return KEY_UP;
+        case 0x50: return KEY_DOWN;
+        case 0x4B: return KEY_LEFT;
+        case 0x4D: return KEY_RIGHT;
+        case 0x53: return KEY_DELETE;
+        case 0x47: return KEY_HOME;
+        case 0x4F: return KEY_END;
+    }
+    if (mods & MOD_CTRL)
+        return scancode < sizeof(sc_ascii_ctrl_map) ? sc_ascii_ctrl_map[scancode] : 0;
+    if (mods & MOD_SHIFT)
+        return scancode < sizeof(sc_ascii_shift_map) ? sc_ascii_shift_map[scancode] : 0;
+    return scancode < sizeof(sc_ascii_nomod_map) ? sc_ascii_nomod_map[scancode] : 0;
+}
+
+// Consumes queued input up to the next event the window manager has to see
+// on its own: a key press or a change of buttons. Consecutive motion is
+// summed into one cursor move. Returns true if events are still queued, so
+// the caller can run another pass before rendering.
+bool poll_input_universal() {
     last_key_press = 0;
     // Last frame state is now handled in kernel_main loop
 
-    for (int iterations = 0; iterations < 16; iterations++) {
-        uint8_t status = inb(PS2_STATUS_PORT);
-        if (!(status & PS2_STATUS_OUTPUT_FULL)) break;
-
-        uint8_t data = inb(PS2_DATA_PORT);
-
-        if (status & PS2_STATUS_AUX_DATA) {
-            process_universal_mouse_packet(data);
+    const int SENSITIVITY = 2;
+    int motion_events = 0;
+    uint64_t now = rdtsc();
+    g_input_stats.pass_first_tsc = 0;
+    InputEvent ev;
+    while (g_input_queue.peek(&ev)) {
+        bool edge = false;
+        if (ev.type == INPUT_MOTION) {
+            universal_mouse_state.x += ev.dx * SENSITIVITY;
+            universal_mouse_state.y += ev.dy * SENSITIVITY;
+            motion_events++;
+        } else if (ev.type == INPUT_BUTTONS) {
+            universal_mouse_state.left_button = ev.state & BUTTON_LEFT;
+            universal_mouse_state.right_button = ev.state & BUTTON_RIGHT;
+            universal_mouse_state.middle_button = ev.state & BUTTON_MIDDLE;
+            edge = true;
         } else {
-            bool is_press = !(data & 0x80);
-            uint8_t scancode = data & 0x7F;
-
-            if (scancode == 0 || scancode > 0x58) continue;
-
-            if (scancode == 0x2A || scancode == 0x36) {
-                is_shift_pressed = is_press;
-            } else if (scancode == 0x1D) {
-                is_ctrl_pressed = is_press;
-            } else if (is_press) {
-                switch(scancode) {
-                    case 0x48: last_key_press = KEY_UP; break;
-                    case 0x50: last_key_press = KEY_DOWN; break;
-                    case 0x4B: last_key_press = KEY_LEFT; break;
-                    case 0x4D: last_key_press = KEY_RIGHT; break;
-                    case 0x53: last_key_press = KEY_DELETE; break;
-                    case 0x47: last_key_press = KEY_HOME; break;
-                    case 0x4F: last_key_press = KEY_END; break;
-                    default: {
-                        const char* map = is_ctrl_pressed ? sc_ascii_ctrl_map :
-                                          (is_shift_pressed ? sc_ascii_shift_map : sc_ascii_nomod_map);
-                        if (scancode < 128 && map[scancode] != 0) {
-                            last_key_press = map[scancode];
-                        }
-                    }
-                }
+            is_shift_pressed = ev.state & MOD_SHIFT;
+            is_ctrl_pressed = ev.state & MOD_CTRL;
+            if (ev.down && ev.scancode != 0 && ev.scancode <= 0x58) {
+                last_key_press = translate_key(ev.scancode, ev.state);
+                edge = last_key_press != 0;
             }
         }
+        g_input_queue.drop();
+        g_input_stats.events++;
+        g_input_stats.last_event_tsc = ev.tsc;
+        if (!g_input_stats.pass_first_tsc) {
+            g_input_stats.pass_first_tsc = ev.tsc;
+            g_latency.queue.add(now - ev.tsc);
+        }
+        if (now > ev.tsc && now - ev.tsc > g_input_stats.max_wait_cycles)
+            g_input_stats.max_wait_cycles = (uint32_t)(now - ev.tsc);
+        if (edge) break;
     }
+    if (motion_events > 1) g_input_stats.coalesced += motion_events - 1;
+
+    if (universal_mouse_state.x < 0) universal_mouse_state.x = 0;
+    if (universal_mouse_state.y < 0) universal_mouse_state.y = 0;
+    if (universal_mouse_state.x >= (int)fb_info.width)
+        universal_mouse_state.x = fb_info.width - 1;
+    if (universal_mouse_state.y >= (int)fb_info.height)
+        universal_mouse_state.y = fb_info.height - 1;
 
     mouse_x = universal_mouse_state.x;
     mouse_y = universal_mouse_state.y;
     mouse_left_down = universal_mouse_state.left_button;
     mouse_right_down = universal_mouse_state.right_button; // New
+    return !g_input_queue.empty();
 }
 void draw_cursor(int x, int y, uint32_t color) { 
     for(int i=0;i<12;i++) put_pixel_back(x,y+i,color); 
@@ -1513,6 +3702,512 @@ void draw_cursor(int x, int y, uint32_t color) {
 
 
 
+// =============================================================================
+// xHCI USB HOST CONTROLLER AND HID BOOT DEVICES
+// =============================================================================
+// Drives the first xHCI controller natively instead of relying on the BIOS's
+// PS/2 emulation. Devices on root ports (no hubs) are enumerated, and HID
+// boot-protocol keyboards and mice get an interrupt IN endpoint that the
+// controller polls every 1 ms. Reports are turned into the same input events
+// as the PS/2 path. Completions come in on the controller's INTx line, or
+// from a 1 ms timer if the line cannot be routed through the PIC. Every
+// structure is page aligned so none crosses a 64 KiB boundary, and physical
+// addresses must fit in 32 bits, as they do in the identity-mapped heap.
+void* alloc_aligned(size_t size, size_t alignment);
+void free_aligned(void* ptr);
+
+struct XhciTrb { uint32_t d0, d1, d2, d3; };
+
+enum : uint32_t {
+    TRB_NORMAL = 1, TRB_SETUP = 2, TRB_DATA = 3, TRB_STATUS = 4, TRB_LINK = 6,
+    TRB_ENABLE_SLOT = 9, TRB_ADDRESS_DEVICE = 11, TRB_CONFIGURE_EP = 12, TRB_EVALUATE_CONTEXT = 13,
+    TRB_TRANSFER_EVENT = 32, TRB_COMMAND_COMPLETION = 33
+};
+static const uint32_t TRB_CYCLE = 1u << 0, TRB_TC = 1u << 1, TRB_ISP = 1u << 2, TRB_IOC = 1u << 5, TRB_IDT = 1u << 6;
+static const uint32_t TRB_DIR_IN = 1u << 16;
+static const uint32_t XHCI_CC_SUCCESS = 1, XHCI_CC_SHORT_PACKET = 13;
+static inline uint32_t trb_type(uint32_t type) { return type << 10; }
+
+// Operational registers (dword offsets) and their bits.
+static const int XHCI_USBCMD = 0, XHCI_USBSTS = 1, XHCI_PAGESIZE = 2, XHCI_CRCR = 6, XHCI_DCBAAP = 12, XHCI_CONFIG = 14;
+static const uint32_t USBCMD_RS = 1u << 0, USBCMD_HCRST = 1u << 1, USBCMD_INTE = 1u << 2;
+static const uint32_t USBSTS_HCH = 1u << 0, USBSTS_EINT = 1u << 3, USBSTS_CNR = 1u << 11;
+static const uint32_t PORTSC_CCS = 1u << 0, PORTSC_PED = 1u << 1, PORTSC_PR = 1u << 4, PORTSC_PRC = 1u << 21;
+static const uint32_t PORTSC_PRESERVE = 0x0E00C3E0;   // RW bits; writing back the RW1C/RW1S bits as read would change state
+static const uint32_t IMAN_IP = 1u << 0, IMAN_IE = 1u << 1;
+static const uint32_t ERDP_EHB = 1u << 3;
+
+static const int XHCI_RING_TRBS = 256;
+static const int XHCI_MAX_SLOTS = 16;
+static const int XHCI_MAX_HID = 8;
+static const uint32_t XHCI_TIMEOUT_MS = 1000;
+static const uint32_t XHCI_POLL_MS = 1;
+
+enum : uint8_t { USB_SPEED_FULL = 1, USB_SPEED_LOW = 2, USB_SPEED_HIGH = 3, USB_SPEED_SUPER = 4 };
+enum : uint8_t { HID_PROTOCOL_KEYBOARD = 1, HID_PROTOCOL_MOUSE = 2 };
+
+// Producer ring (command or transfer). The last TRB links back to the start
+// and toggles the cycle bit, which is how the consumer tells new TRBs from old.
+struct XhciRing {
+    XhciTrb* trbs;
+    uint32_t enqueue;
+    uint32_t cycle;
+
+    bool init() {
+        trbs = (XhciTrb*)alloc_aligned(XHCI_RING_TRBS * sizeof(XhciTrb), 4096);
+        if (!trbs) return false;
+        memset(trbs, 0, XHCI_RING_TRBS * sizeof(XhciTrb));
+        trbs[XHCI_RING_TRBS - 1].d0 = (uint32_t)trbs;
+        trbs[XHCI_RING_TRBS - 1].d3 = trb_type(TRB_LINK) | TRB_TC;
+        enqueue = 0;
+        cycle = 1;
+        return true;
+    }
+    // The cycle bit is written last; it is what hands the TRB to the controller.
+    void push(uint32_t d0, uint32_t d1, uint32_t d2, uint32_t d3) {
+        XhciTrb* t = &trbs[enqueue];
+        t->d0 = d0; t->d1 = d1; t->d2 = d2;
+        asm volatile ("" ::: "memory");
+        t->d3 = d3 | cycle;
+        if (++enqueue == XHCI_RING_TRBS - 1) {
+            XhciTrb* link = &trbs[XHCI_RING_TRBS - 1];
+            link->d3 = (link->d3 & ~TRB_CYCLE) | cycle;
+            enqueue = 0;
+            cycle ^= 1;
+        }
+    }
+};
+
+struct XhciHid {
+    uint8_t slot, dci, protocol, port;
+    uint16_t mps;
+    XhciRing ring;
+    uint8_t* report;
+    uint8_t prev[8];   // last keyboard report, or the mouse buttons in prev[0]
+};
+
+struct XhciController {
+    bool present;
+    uint32_t mmio;
+    int irq;                      // PCI interrupt line, or -1 when polled
+    volatile uint32_t* op;
+    volatile uint32_t* ir0;       // interrupter 0 register set
+    volatile uint32_t* db;
+    uint32_t max_slots, max_ports, ctx_size;
+    uint64_t* dcbaa;
+    XhciRing cmd;
+    XhciTrb* events;
+    uint32_t ev_dequeue, ev_cycle;
+    // Mailboxes filled by the event handler for the synchronous setup paths.
+    volatile bool cmd_done, xfer_done;
+    uint32_t cmd_code, cmd_slot, xfer_code;
+    XhciHid hid[XHCI_MAX_HID];
+    int hid_count;
+    uint32_t reports;
+    KTimer poll_timer;
+};
+static XhciController g_xhci;
+
+// HID usage IDs 0x04..0x52 to set-1 scancodes, so translate_key() handles
+// both keyboards. Keypad and the keys past the arrows are not mapped.
+static const uint8_t hid_usage_scancodes[] = {
+    0x1E, 0x30, 0x2E, 0x20, 0x12, 0x21, 0x22, 0x23, 0x17, 0x24, 0x25, 0x26, 0x32,   // a-m
+    0x31, 0x18, 0x19, 0x10, 0x13, 0x1F, 0x14, 0x16, 0x2F, 0x11, 0x2D, 0x15, 0x2C,   // n-z
+    0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B,                     // 1-0
+    0x1C, 0x01, 0x0E, 0x0F, 0x39, 0x0C, 0x0D, 0x1A, 0x1B, 0x2B, 0x2B, 0x27, 0x28,   // enter .. '
+    0x29, 0x33, 0x34, 0x35, 0x3A,                                                   // ` , . / caps
+    0x3B, 0x3C, 0x3D, 0x3E, 0x3F, 0x40, 0x41, 0x42, 0x43, 0x44, 0x57, 0x58,         // F1-F12
+    0x00, 0x46, 0x00, 0x52, 0x47, 0x49, 0x53, 0x4F, 0x51,                           // prtsc .. pgdn
+    0x4D, 0x4B, 0x50, 0x48                                                          // right left down up
+};
+
+static uint8_t hid_usage_to_scancode(uint8_t usage) {
+    if (usage < 0x04 || usage - 0x04 >= (int)sizeof(hid_usage_scancodes)) return 0;
+    return hid_usage_scancodes[usage - 0x04];
+}
+
+static bool hid_report_has(const uint8_t* report, uint8_t usage) {
+    for (int i = 2; i < 8; i++) if (report[i] == usage) return true;
+    return false;
+}
+
+static void hid_keyboard_report(XhciHid& h, const uint8_t* r) {
+    if (r[2] == 0x01) return;   // ErrorRollOver: too many keys, the report is meaningless
+    uint8_t mods = ((r[0] & 0x11) ? MOD_CTRL : 0) | ((r[0] & 0x22) ? MOD_SHIFT : 0);
+    uint8_t old_mods = ((h.prev[0] & 0x11) ? MOD_CTRL : 0) | ((h.prev[0] & 0x22) ? MOD_SHIFT : 0);
+    if ((mods ^ old_mods) & MOD_SHIFT) input_push(INPUT_KEY, (mods & MOD_SHIFT) != 0, 0x2A, mods, 0, 0);
+    if ((mods ^ old_mods) & MOD_CTRL) input_push(INPUT_KEY, (mods & MOD_CTRL) != 0, 0x1D, mods, 0, 0);
+    for (int i = 2; i < 8; i++) {
+        uint8_t sc = hid_usage_to_scancode(h.prev[i]);
+        if (sc && !hid_report_has(r, h.prev[i])) input_push(INPUT_KEY, 0, sc, mods, 0, 0);
+    }
+    for (int i = 2; i < 8; i++) {
+        uint8_t sc = hid_usage_to_scancode(r[i]);
+        if (sc && !hid_report_has(h.prev, r[i])) input_push(INPUT_KEY, 1, sc, mods, 0, 0);
+    }
+    memcpy(h.prev, r, 8);
+}
+
+// Boot mouse report: buttons, dx, dy, with y already growing downward.
+static void hid_mouse_report(XhciHid& h, const uint8_t* r) {
+    int dx = (int8_t)r[1], dy = (int8_t)r[2];
+    if (dx || dy) input_push(INPUT_MOTION, 0, 0, 0, dx, dy);
+    uint8_t buttons = r[0] & (BUTTON_LEFT | BUTTON_RIGHT | BUTTON_MIDDLE);
+    if (buttons != h.prev[0]) {
+        h.prev[0] = buttons;
+        input_push(INPUT_BUTTONS, 0, 0, buttons, 0, 0);
+    }
+}
+
+static void xhci_queue_report(XhciHid& h) {
+    h.ring.push((uint32_t)h.report, 0, h.mps, trb_type(TRB_NORMAL) | TRB_ISP | TRB_IOC);
+    g_xhci.db[h.slot] = h.dci;
+}
+
+static void xhci_handle_event(const XhciTrb& ev) {
+    uint32_t type = (ev.d3 >> 10) & 0x3F;
+    uint32_t code = ev.d2 >> 24;
+    uint32_t slot = ev.d3 >> 24;
+    if (type == TRB_COMMAND_COMPLETION) {
+        g_xhci.cmd_code = code;
+        g_xhci.cmd_slot = slot;
+        g_xhci.cmd_done = true;
+    } else if (type == TRB_TRANSFER_EVENT) {
+        uint32_t dci = (ev.d3 >> 16) & 0x1F;
+        if (dci == 1) {
+            g_xhci.xfer_code = code;
+            g_xhci.xfer_done = true;
+            return;
+        }
+        for (int i = 0; i < g_xhci.hid_count; i++) {
+            XhciHid& h = g_xhci.hid[i];
+            if (h.slot != slot || h.dci != dci) continue;
+            // Anything else halted the endpoint; leave it stopped.
+            if (code != XHCI_CC_SUCCESS && code != XHCI_CC_SHORT_PACKET) return;
+            if (h.protocol == HID_PROTOCOL_KEYBOARD) hid_keyboard_report(h, h.report);
+            else hid_mouse_report(h, h.report);
+            g_xhci.reports++;
+            idle_signal_input();
+            xhci_queue_report(h);
+            return;
+        }
+    }
+    // Port status changes are ignored: hotplug is not supported.
+}
+
+// Drains the event ring. Interrupts stay off while it runs so the input
+// queue keeps a single producer at a time, wherever this is called from.
+static void xhci_poll_events() {
+    uint32_t flags = irq_save();
+    bool any = false;
+    for (;;) {
+        XhciTrb* ev = &g_xhci.events[g_xhci.ev_dequeue];
+        if ((ev->d3 & TRB_CYCLE) != g_xhci.ev_cycle) break;
+        xhci_handle_event(*ev);
+        if (++g_xhci.ev_dequeue == XHCI_RING_TRBS) {
+            g_xhci.ev_dequeue = 0;
+            g_xhci.ev_cycle ^= 1;
+        }
+        any = true;
+    }
+    if (any) {
+        g_xhci.ir0[6] = (uint32_t)&g_xhci.events[g_xhci.ev_dequeue] | ERDP_EHB;
+        g_xhci.ir0[7] = 0;
+    }
+    irq_restore(flags);
+}
+
+static void xhci_irq(InterruptFrame*) {
+    if (!(g_xhci.ir0[0] & IMAN_IP) && !(g_xhci.op[XHCI_USBSTS] & USBSTS_EINT)) return;   // another device on the line
+    g_xhci.op[XHCI_USBSTS] = USBSTS_EINT;
+    g_xhci.ir0[0] = IMAN_IE | IMAN_IP;
+    xhci_poll_events();
+}
+
+static void xhci_poll_timer(void*) {
+    xhci_poll_events();
+    timer_arm(&g_xhci.poll_timer, XHCI_POLL_MS, xhci_poll_timer, nullptr);
+}
+
+static bool xhci_wait(volatile bool* done) {
+    Deadline deadline = Deadline::after_ms(XHCI_TIMEOUT_MS);
+    while (!*done) {
+        xhci_poll_events();
+        if (deadline.expired()) return false;
+    }
+    return true;
+}
+
+static bool xhci_command(uint32_t d0, uint32_t d3, uint32_t* slot_out = nullptr) {
+    g_xhci.cmd_done = false;
+    g_xhci.cmd.push(d0, 0, 0, d3);
+    g_xhci.db[0] = 0;
+    if (!xhci_wait(&g_xhci.cmd_done)) return false;
+    if (slot_out) *slot_out = g_xhci.cmd_slot;
+    return g_xhci.cmd_code == XHCI_CC_SUCCESS;
+}
+
+static bool xhci_control(XhciRing& ep0, uint32_t slot, uint8_t request_type, uint8_t request,
+                         uint16_t value, uint16_t index, uint16_t length, void* data) {
+    bool in = (request_type & 0x80) != 0;
+    uint32_t transfer = length ? (in ? 3 : 2) : 0;
+    ep0.push(request_type | (request << 8) | ((uint32_t)value << 16), index | ((uint32_t)length << 16), 8,
+             trb_type(TRB_SETUP) | TRB_IDT | (transfer << 16));
+    if (length) ep0.push((uint32_t)data, 0, length, trb_type(TRB_DATA) | (in ? TRB_DIR_IN : 0));
+    g_xhci.xfer_done = false;
+    ep0.push(0, 0, 0, trb_type(TRB_STATUS) | TRB_IOC | ((length && in) ? 0 : TRB_DIR_IN));
+    g_xhci.db[slot] = 1;
+    if (!xhci_wait(&g_xhci.xfer_done)) return false;
+    return g_xhci.xfer_code == XHCI_CC_SUCCESS || g_xhci.xfer_code == XHCI_CC_SHORT_PACKET;
+}
+
+static uint32_t* xhci_alloc_context(uint32_t entries) {
+    uint32_t* ctx = (uint32_t*)alloc_aligned(entries * g_xhci.ctx_size, 4096);
+    if (ctx) memset(ctx, 0, entries * g_xhci.ctx_size);
+    return ctx;
+}
+
+// Context `i` of an input context (0 is the input control context).
+static inline uint32_t* xhci_ctx(uint32_t* base, int i) { return base + i * (g_xhci.ctx_size / 4); }
+
+static bool xhci_port_reset(volatile uint32_t* portsc) {
+    uint32_t sc = *portsc;
+    if (sc & PORTSC_PED) return true;
+    *portsc = (sc & PORTSC_PRESERVE) | PORTSC_PR;
+    Deadline deadline = Deadline::after_ms(XHCI_TIMEOUT_MS);
+    while (!(*portsc & PORTSC_PRC)) {
+        if (deadline.expired()) return false;
+    }
+    *portsc = (*portsc & PORTSC_PRESERVE) | PORTSC_PRC;
+    return (*portsc & PORTSC_PED) != 0;
+}
+
+// Enumerates the device on a root port and, if it has a boot keyboard or
+// mouse interface, starts polling it.
+static void xhci_probe_port(uint32_t port) {
+    if (g_xhci.hid_count >= XHCI_MAX_HID) return;
+    volatile uint32_t* portsc = g_xhci.op + (0x400 + 0x10 * (port - 1)) / 4;
+    if (!(*portsc & PORTSC_CCS) || !xhci_port_reset(portsc)) return;
+    uint32_t speed = (*portsc >> 10) & 0xF;
+
+    uint32_t slot = 0;
+    if (!xhci_command(0, trb_type(TRB_ENABLE_SLOT), &slot) || slot == 0 || slot > g_xhci.max_slots) return;
+    uint32_t* out = xhci_alloc_context(32);
+    uint32_t* in = xhci_alloc_context(33);
+    XhciRing ep0;
+    if (!out || !in || !ep0.init()) return;
+    g_xhci.dcbaa[slot] = (uint32_t)out;
+
+    uint32_t mps0 = speed == USB_SPEED_SUPER ? 512 : (speed == USB_SPEED_HIGH ? 64 : 8);
+    xhci_ctx(in, 0)[1] = 0x3;                                   // add slot and EP0
+    xhci_ctx(in, 1)[0] = (speed << 20) | (1u << 27);            // one context entry
+    xhci_ctx(in, 1)[1] = port << 16;
+    xhci_ctx(in, 2)[1] = (3u << 1) | (4u << 3) | (mps0 << 16);  // CErr 3, control endpoint
+    xhci_ctx(in, 2)[2] = (uint32_t)ep0.trbs | 1;
+    xhci_ctx(in, 2)[4] = 8;
+    if (!xhci_command((uint32_t)in, trb_type(TRB_ADDRESS_DEVICE) | (slot << 24))) return;
+
+    uint8_t* desc = (uint8_t*)alloc_aligned(256, 4096);
+    if (!desc) return;
+    memset(desc, 0, 256);
+    if (!xhci_control(ep0, slot, 0x80, 6, 0x0100, 0, 8, desc)) return;
+    if (desc[7] && desc[7] != mps0 && speed == USB_SPEED_FULL) {
+        // Full-speed EP0 may be 8 to 64 bytes; the guess above was the minimum.
+        mps0 = desc[7];
+        xhci_ctx(in, 0)[1] = 0x2;
+        xhci_ctx(in, 2)[1] = (3u << 1) | (4u << 3) | (mps0 << 16);
+        if (!xhci_command((uint32_t)in, trb_type(TRB_EVALUATE_CONTEXT) | (slot << 24))) return;
+    }
+
+    if (!xhci_control(ep0, slot, 0x80, 6, 0x0200, 0, 9, desc)) return;
+    uint16_t total = desc[2] | (desc[3] << 8);
+    if (total > 256) total = 256;
+    if (!xhci_control(ep0, slot, 0x80, 6, 0x0200, 0, total, desc)) return;
+
+    // Find the first boot-protocol HID interface and its interrupt IN endpoint.
+    int iface = -1, protocol = 0, ep_addr = 0, ep_mps = 0, ep_interval = 0;
+    bool in_boot_iface = false;
+    for (int off = 0; off + 2 <= total && desc[off] >= 2; off += desc[off]) {
+        const uint8_t* d = desc + off;
+        if (d[1] == 4 && off + 9 <= total) {
+            in_boot_iface = iface < 0 && d[5] == 3 && d[6] == 1 && (d[7] == HID_PROTOCOL_KEYBOARD || d[7] == HID_PROTOCOL_MOUSE);
+            if (in_boot_iface) { iface = d[2]; protocol = d[7]; }
+        } else if (d[1] == 5 && off + 7 <= total && in_boot_iface && !ep_addr && (d[2] & 0x80) && (d[3] & 3) == 3) {
+            ep_addr = d[2] & 0x0F;
+            ep_mps = (d[4] | (d[5] << 8)) & 0x7FF;
+            ep_interval = d[6];
+        }
+    }
+    uint8_t config = desc[5];
+    free_aligned(desc);
+    if (!ep_addr) return;
+
+    if (!xhci_control(ep0, slot, 0x00, 9, config, 0, 0, nullptr)) return;          // SET_CONFIGURATION
+    if (!xhci_control(ep0, slot, 0x21, 0x0B, 0, iface, 0, nullptr)) return;        // SET_PROTOCOL(boot)
+    xhci_control(ep0, slot, 0x21, 0x0A, 0, iface, 0, nullptr);                     // SET_IDLE; optional
+
+    XhciHid& h = g_xhci.hid[g_xhci.hid_count];
+    h.slot = slot;
+    h.dci = ep_addr * 2 + 1;
+    h.protocol = protocol;
+    h.port = port;
+    h.mps = ep_mps > 64 ? 64 : ep_mps;
+    memset(h.prev, 0, sizeof(h.prev));
+    h.report = (uint8_t*)alloc_aligned(64, 64);
+    if (!h.report || !h.ring.init()) return;
+    memset(h.report, 0, 64);
+
+    // Interval is 2^n * 125 us; n = 3 is 1 ms, the fastest full/low speed
+    // allows. High speed devices keep a shorter bInterval if they ask for one.
+    uint32_t interval = 3;
+    if ((speed == USB_SPEED_HIGH || speed == USB_SPEED_SUPER) && ep_interval >= 1 && ep_interval < 4) interval = ep_interval - 1;
+    memset(in, 0, 33 * g_xhci.ctx_size);
+    xhci_ctx(in, 0)[1] = 1u | (1u << h.dci);
+    xhci_ctx(in, 1)[0] = (speed << 20) | ((uint32_t)h.dci << 27);
+    xhci_ctx(in, 1)[1] = port << 16;
+    uint32_t* ep = xhci_ctx(in, h.dci + 1);
+    ep[0] = interval << 16;
+    ep[1] = (3u << 1) | (7u << 3) | ((uint32_t)ep_mps << 16);   // interrupt IN
+    ep[2] = (uint32_t)h.ring.trbs | 1;
+    ep[4] = ep_mps | ((uint32_t)ep_mps << 16);
+    if (!xhci_command((uint32_t)in, trb_type(TRB_CONFIGURE_EP) | (slot << 24))) return;
+
+    g_xhci.hid_count++;
+    xhci_queue_report(h);
+}
+
+// Takes the controller from the BIOS through the USB legacy support
+// capability, which also stops its SMI-based PS/2 emulation.
+static void xhci_bios_handoff(volatile uint8_t* cap) {
+    uint32_t xecp = (*(volatile uint32_t*)(cap + 0x10) >> 16) << 2;
+    while (xecp) {
+        volatile uint32_t* c = (volatile uint32_t*)(cap + xecp);
+        uint32_t v = c[0];
+        if ((v & 0xFF) == 1) {
+            c[0] = v | (1u << 24);
+            Deadline deadline = Deadline::after_ms(XHCI_TIMEOUT_MS);
+            while ((c[0] & (1u << 16)) && !deadline.expired()) {}
+            c[0] = (c[0] & ~(1u << 16)) | (1u << 24);   // force it if the BIOS never let go
+            // USBLEGCTLSTS: keep the RsvdP bits, clear every SMI enable and
+            // write 1 to clear the latched OS-ownership/PCI/BAR SMI events.
+            c[1] = (c[1] & ((7u << 1) | (0xFFu << 5) | (7u << 17))) | (7u << 29);
+            return;
+        }
+        uint32_t next = (v >> 8) & 0xFF;
+        xecp = next ? xecp + (next << 2) : 0;
+    }
+}
+
+static bool xhci_find(uint32_t* mmio, int* irq) {
+    for (uint16_t bus = 0; bus < 256; bus++) {
+        for (uint8_t device = 0; device < 32; device++) {
+            for (uint8_t function = 0; function < 8; function++) {
+                if ((pci_read_config_dword(bus, device, function, 0x00) & 0xFFFF) == 0xFFFF) {
+                    if (function == 0) break;
+                    continue;
+                }
+                if ((pci_read_config_dword(bus, device, function, 0x08) >> 8) != 0x0C0330) continue;
+                uint32_t bar0 = pci_read_config_dword(bus, device, function, 0x10);
+                if ((bar0 & 0x6) == 0x4 && pci_read_config_dword(bus, device, function, 0x14) != 0) continue;
+                uint32_t command = pci_read_config_dword(bus, device, function, 0x04);
+                command = (command | (1u << 1) | (1u << 2)) & ~(1u << 10);   // memory, bus master, INTx on
+                pci_write_config_dword(bus, device, function, 0x04, command);
+                *mmio = bar0 & ~0xFu;
+                uint8_t line = pci_read_config_dword(bus, device, function, 0x3C) & 0xFF;
+                *irq = (line > 2 && line < 16) ? line : -1;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool xhci_init() {
+    uint32_t mmio;
+    int irq;
+    if (!xhci_find(&mmio, &irq)) return false;
+    volatile uint8_t* cap = (volatile uint8_t*)mmio;
+    uint32_t hcs1 = *(volatile uint32_t*)(cap + 0x04);
+    uint32_t hcs2 = *(volatile uint32_t*)(cap + 0x08);
+    uint32_t hcc1 = *(volatile uint32_t*)(cap + 0x10);
+    g_xhci.mmio = mmio;
+    g_xhci.op = (volatile uint32_t*)(cap + cap[0]);
+    g_xhci.db = (volatile uint32_t*)(cap + (*(volatile uint32_t*)(cap + 0x14) & ~0x3u));
+    g_xhci.ir0 = (volatile uint32_t*)(cap + (*(volatile uint32_t*)(cap + 0x18) & ~0x1Fu) + 0x20);
+    g_xhci.max_slots = hcs1 & 0xFF;
+    if (g_xhci.max_slots > XHCI_MAX_SLOTS) g_xhci.max_slots = XHCI_MAX_SLOTS;
+    g_xhci.max_ports = hcs1 >> 24;
+    g_xhci.ctx_size = (hcc1 & (1u << 2)) ? 64 : 32;
+    g_xhci.irq = -1;
+
+    xhci_bios_handoff(cap);
+
+    volatile uint32_t* op = g_xhci.op;
+    op[XHCI_USBCMD] = op[XHCI_USBCMD] & ~USBCMD_RS;
+    Deadline deadline = Deadline::after_ms(XHCI_TIMEOUT_MS);
+    while (!(op[XHCI_USBSTS] & USBSTS_HCH)) if (deadline.expired()) return false;
+    op[XHCI_USBCMD] = op[XHCI_USBCMD] | USBCMD_HCRST;
+    deadline = Deadline::after_ms(XHCI_TIMEOUT_MS);
+    while ((op[XHCI_USBCMD] & USBCMD_HCRST) || (op[XHCI_USBSTS] & USBSTS_CNR)) if (deadline.expired()) return false;
+
+    op[XHCI_CONFIG] = g_xhci.max_slots;
+    g_xhci.dcbaa = (uint64_t*)alloc_aligned((XHCI_MAX_SLOTS + 1) * sizeof(uint64_t), 4096);
+    if (!g_xhci.dcbaa) return false;
+    memset(g_xhci.dcbaa, 0, (XHCI_MAX_SLOTS + 1) * sizeof(uint64_t));
+    uint32_t scratchpads = ((hcs2 >> 27) & 0x1F) | (((hcs2 >> 21) & 0x1F) << 5);
+    if (scratchpads) {
+        uint64_t* array = (uint64_t*)alloc_aligned(scratchpads * sizeof(uint64_t), 4096);
+        if (!array) return false;
+        for (uint32_t i = 0; i < scratchpads; i++) {
+            void* page = alloc_aligned(4096, 4096);
+            if (!page) return false;
+            memset(page, 0, 4096);
+            array[i] = (uint32_t)page;
+        }
+        g_xhci.dcbaa[0] = (uint32_t)array;
+    }
+    op[XHCI_DCBAAP] = (uint32_t)g_xhci.dcbaa;
+    op[XHCI_DCBAAP + 1] = 0;
+
+    if (!g_xhci.cmd.init()) return false;
+    op[XHCI_CRCR] = (uint32_t)g_xhci.cmd.trbs | 1;   // RCS matches the ring's initial cycle
+    op[XHCI_CRCR + 1] = 0;
+
+    g_xhci.events = (XhciTrb*)alloc_aligned(XHCI_RING_TRBS * sizeof(XhciTrb), 4096);
+    uint32_t* erst = (uint32_t*)alloc_aligned(16, 64);
+    if (!g_xhci.events || !erst) return false;
+    memset(g_xhci.events, 0, XHCI_RING_TRBS * sizeof(XhciTrb));
+    erst[0] = (uint32_t)g_xhci.events; erst[1] = 0;
+    erst[2] = XHCI_RING_TRBS; erst[3] = 0;
+    g_xhci.ev_dequeue = 0;
+    g_xhci.ev_cycle = 1;
+    volatile uint32_t* ir = g_xhci.ir0;
+    ir[1] = 0;                                   // no interrupt moderation
+    ir[2] = 1;                                   // ERSTSZ
+    ir[6] = (uint32_t)g_xhci.events; ir[7] = 0;  // ERDP
+    ir[4] = (uint32_t)erst; ir[5] = 0;           // ERSTBA last: it starts the ring
+
+    op[XHCI_USBCMD] = op[XHCI_USBCMD] | USBCMD_RS;
+    deadline = Deadline::after_ms(XHCI_TIMEOUT_MS);
+    while (op[XHCI_USBSTS] & USBSTS_HCH) if (deadline.expired()) return false;
+    g_xhci.present = true;
+
+    for (uint32_t port = 1; port <= g_xhci.max_ports; port++) xhci_probe_port(port);
+
+    if (irq >= 0 && irq_install(irq, xhci_irq)) {
+        g_xhci.irq = irq;
+        ir[0] = IMAN_IE | IMAN_IP;
+        op[XHCI_USBCMD] = op[XHCI_USBCMD] | USBCMD_INTE;
+    } else {
+        timer_arm(&g_xhci.poll_timer, XHCI_POLL_MS, xhci_poll_timer, nullptr);
+    }
+    xhci_poll_events();   // anything that completed before the interrupt was on
+    return true;
+}
+
+
+
+
 // =============================================================================
 // SECTION 5: DISK DRIVER & FAT32 FILESYSTEM
 // =============================================================================
@@ -1521,6 +4216,12 @@ void draw_cursor(int x, int y, uint32_t color) {
 #define PORT_CMD_FRE 0x00000010
 #define ATA_CMD_READ_DMA_EXT 0x25
 #define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+#define ATA_CMD_READ_LOG_EXT 0x2F
+#define ATA_CMD_IDENTIFY 0xEC
+#define ATA_LOG_NCQ_ERROR 0x10
+#define HBA_CAP_SNCQ (1u << 30)
 #define HBA_PORT_CMD_CR 0x00008000
 #define TFD_STS_BSY 0x80
 #define TFD_STS_DRQ 0x08
@@ -1532,6 +4233,7 @@ void draw_cursor(int x, int y, uint32_t color) {
 #define ATTR_ARCHIVE 0x20
 #define FAT_FREE_CLUSTER 0x00000000
 #define FAT_END_OF_CHAIN 0x0FFFFFFF
+#define AHCI_CMD_TIMEOUT_MS 5000
 
 // =============================================================================
 // FILE EXPLORER WINDOW IMPLEMENTATION (New)
@@ -1599,107 +4301,771 @@ uint8_t lfn_checksum(const unsigned char *p_fname) {
     return sum;
 }
 
-static int g_ahci_port = -1; // Will store the first active port number
-typedef struct { uint8_t cfl:5, a:1, w:1, p:1, r:1, b:1, c:1, res0:1; uint16_t prdtl; volatile uint32_t prdbc; uint64_t ctba; uint32_t res1[4]; } __attribute__((packed)) HBA_CMD_HEADER;
-typedef struct { uint64_t dba; uint32_t res0; uint32_t dbc:22, res1:9, i:1; } __attribute__((packed)) HBA_PRDT_ENTRY;
-typedef struct { uint8_t fis_type, pmport:4, res0:3, c:1, command, featurel; uint8_t lba0, lba1, lba2, device; uint8_t lba3, lba4, lba5, featureh; uint8_t countl, counth, icc, control; uint8_t res1[4]; } __attribute__((packed)) FIS_REG_H2D;
-typedef struct { uint8_t jmp[3]; char oem[8]; uint16_t bytes_per_sec; uint8_t sec_per_clus; uint16_t rsvd_sec_cnt; uint8_t num_fats; uint16_t root_ent_cnt; uint16_t tot_sec16; uint8_t media; uint16_t fat_sz16; uint16_t sec_per_trk; uint16_t num_heads; uint32_t hidd_sec; uint32_t tot_sec32; uint32_t fat_sz32; uint16_t ext_flags; uint16_t fs_ver; uint32_t root_clus; uint16_t fs_info; uint16_t bk_boot_sec; uint8_t res[12]; uint8_t drv_num; uint8_t res1; uint8_t boot_sig; uint32_t vol_id; char vol_lab[11]; char fil_sys_type[8]; } __attribute__((packed)) fat32_bpb_t;
-
+typedef struct { uint8_t cfl:5, a:1, w:1, p:1, r:1, b:1, c:1, res0:1; uint16_t prdtl; volatile uint32_t prdbc; uint64_t ctba; uint32_t res1[4]; } __attribute__((packed)) HBA_CMD_HEADER;
+typedef struct { uint64_t dba; uint32_t res0; uint32_t dbc:22, res1:9, i:1; } __attribute__((packed)) HBA_PRDT_ENTRY;
+typedef struct { uint8_t fis_type, pmport:4, res0:3, c:1, command, featurel; uint8_t lba0, lba1, lba2, device; uint8_t lba3, lba4, lba5, featureh; uint8_t countl, counth, icc, control; uint8_t res1[4]; } __attribute__((packed)) FIS_REG_H2D;
+typedef struct { uint8_t jmp[3]; char oem[8]; uint16_t bytes_per_sec; uint8_t sec_per_clus; uint16_t rsvd_sec_cnt; uint8_t num_fats; uint16_t root_ent_cnt; uint16_t tot_sec16; uint8_t media; uint16_t fat_sz16; uint16_t sec_per_trk; uint16_t num_heads; uint32_t hidd_sec; uint32_t tot_sec32; uint32_t fat_sz32; uint16_t ext_flags; uint16_t fs_ver; uint32_t root_clus; uint16_t fs_info; uint16_t bk_boot_sec; uint8_t res[12]; uint8_t drv_num; uint8_t res1; uint8_t boot_sig; uint32_t vol_id; char vol_lab[11]; char fil_sys_type[8]; } __attribute__((packed)) fat32_bpb_t;
+
+
+static uint64_t ahci_base = 0;
+static fat32_bpb_t bpb;
+static uint32_t fat_start_sector, data_start_sector;
+static uint32_t current_directory_cluster = 0;
+
+// --- Aligned Memory Allocator ---
+void* alloc_aligned(size_t size, size_t alignment) {
+    size_t offset = alignment - 1 + sizeof(void*);
+    void* p1 = operator new(size + offset);
+    if (p1 == nullptr) return nullptr;
+    void** p2 = (void**)(((uintptr_t)p1 + offset) & ~(alignment - 1));
+    p2[-1] = p1;
+    return p2;
+}
+
+void free_aligned(void* ptr) {
+    if (ptr == nullptr) return;
+    operator delete(((void**)ptr)[-1]);
+}
+
+
+// Disk requests queue per AHCI port, and each port keeps up to g_disk_depth
+// of them in flight, one per command slot. disk_pump() never blocks: it
+// retires the commands whose issue bits the HBA has cleared, recovers a port
+// after a task file error or a stall, then issues what fits. Commands in
+// flight together may complete in any order, so a request that overlaps a
+// write in flight (or writes over one) waits for it.
+// When the drive and HBA support it, requests go out as NCQ (FPDMA QUEUED)
+// commands: the tag is the slot, PxSACT tracks them and the drive reports
+// completions in Set Device Bits FISes, reordering as it sees fit.
+// With the controller's interrupt routed, ahci_irq() pumps and waiters sleep
+// (disk_sleep); without one, the main loop and the waiters keep pumping.
+
+// Command tables hold a 128-byte header and the PRDT; 56 entries fill 1 KiB.
+static const int AHCI_PRDT_MAX = 56;
+static const uint32_t AHCI_CMD_TABLE_SIZE = 128 + AHCI_PRDT_MAX * sizeof(HBA_PRDT_ENTRY);
+static const uint32_t AHCI_PRD_BYTES_MAX = 4u << 20;   // 22-bit byte count per entry
+
+// One piece of a scattered transfer; byte counts are even.
+struct DiskSegment {
+    void* buffer;
+    uint32_t bytes;
+};
+
+struct DiskRequest {
+    int device;                 // block device (see blk_submit)
+    uint64_t lba;
+    uint16_t count;
+    bool write;
+    void* buffer;               // contiguous transfer, or
+    DiskSegment* segments;      // count * SECTOR_SIZE bytes across these
+    int segment_count;
+    int status;                 // 0, or -1 on error or timeout
+    volatile bool done;
+    int port;                   // AHCI port it was queued on
+    int slot;                   // -1 until issued
+    bool ncq;                   // issued as a queued command
+    DiskRequest* next;
+    CoWaiter* waiter;           // woken on completion, if a coroutine waits
+    void (*callback)(DiskRequest*);  // or called on completion, interrupts off
+    void* context;              // for the callback
+};
+
+// A port with a drive behind it: its own command list, command tables and
+// received-FIS area, and its own queue.
+struct AhciPort {
+    HBA_CMD_HEADER* cmd_list;
+    DiskRequest* head;              // waiting for a slot
+    DiskRequest* tail;
+    DiskRequest* flight;            // issued, oldest first
+    uint32_t issued;                // their command slots
+    int ncq_max;                    // the drive's NCQ depth; 0 without NCQ
+    int ncq_depth;                  // tags in use ('ncq'); 0 = off
+    Deadline deadline;              // no progress by then: the port is stuck
+    uint64_t sectors;               // capacity, from IDENTIFY
+};
+
+static AhciPort g_ahci_ports[32];
+static uint32_t g_ahci_live = 0;               // ports set up by disk_init
+static int g_disk_depth = 1;                   // slots the HBA implements
+static bool g_disk_pumping = false;
+static bool g_disk_repump = false;             // submitted during a pump: go round again
+
+static int g_ahci_irq = -1;                  // legacy INTx line, or -1 while polled
+static volatile uint32_t g_ahci_tfe = 0;    // ports whose task file error the IRQ consumed
+
+static const uint32_t AHCI_GHC_IE = 1u << 1;
+static const uint32_t AHCI_PxIS_TFES = 1u << 30;
+// D2H register, PIO setup, DMA setup and set device bits FISes, descriptor
+// processed, and the error causes.
+static const uint32_t AHCI_PxIE_MASK = 0x0000002F | (1u << 27) | (1u << 28) | (1u << 29) | AHCI_PxIS_TFES;
+static const uint32_t AHCI_WATCHDOG_MS = 10;  // sleepers re-check timeouts this often
+
+void stop_cmd(HBA_PORT *port);
+void start_cmd(HBA_PORT *port);
+
+static inline HBA_PORT* ahci_port_regs(int port_num) {
+    return (HBA_PORT*)(ahci_base + 0x100 + (port_num * 0x80));
+}
+
+// Runs one command in slot 0 of an otherwise idle port and polls for it;
+// for setup and error recovery only. 0, or -1 on error or timeout.
+static int ahci_exec_polled(int port_num, uint8_t command, uint64_t lba, uint16_t count, void* buffer, uint32_t bytes) {
+    HBA_PORT* port = ahci_port_regs(port_num);
+    Deadline deadline = Deadline::after_ms(AHCI_CMD_TIMEOUT_MS);
+    while (port->tfd & (TFD_STS_BSY | TFD_STS_DRQ)) if (deadline.expired()) return -1;
+
+    HBA_CMD_HEADER* cmd_header = &g_ahci_ports[port_num].cmd_list[0];
+    cmd_header->cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t);
+    cmd_header->w = 0;
+    cmd_header->prdtl = 1;
+    FIS_REG_H2D* cmd_fis = (FIS_REG_H2D*)(uintptr_t)cmd_header->ctba;
+    HBA_PRDT_ENTRY* prdt = (HBA_PRDT_ENTRY*)((uintptr_t)cmd_header->ctba + 128);
+    prdt->dba = (uint64_t)(uintptr_t)buffer;
+    prdt->dbc = bytes - 1;
+    prdt->i = 0;
+
+    memset(cmd_fis, 0, sizeof(FIS_REG_H2D));
+    cmd_fis->fis_type = FIS_TYPE_REG_H2D;
+    cmd_fis->c = 1;
+    cmd_fis->command = command;
+    cmd_fis->lba0 = (uint8_t)lba; cmd_fis->lba1 = (uint8_t)(lba >> 8); cmd_fis->lba2 = (uint8_t)(lba >> 16);
+    cmd_fis->device = 1 << 6;
+    cmd_fis->lba3 = (uint8_t)(lba >> 24); cmd_fis->lba4 = (uint8_t)(lba >> 32); cmd_fis->lba5 = (uint8_t)(lba >> 40);
+    cmd_fis->countl = count & 0xFF; cmd_fis->counth = (count >> 8) & 0xFF;
+
+    port->is = 0xFFFFFFFF;
+    port->ci = 1;
+    int status = 0;
+    while (port->ci & 1) {
+        if ((port->is & AHCI_PxIS_TFES) || deadline.expired()) { status = -1; break; }
+        asm volatile ("pause");
+    }
+    if (port->is & AHCI_PxIS_TFES) status = -1;
+    port->is = 0xFFFFFFFF;
+    return status;
+}
+
+// After an NCQ error the drive aborts every queued command and names the
+// one that failed in the NCQ Command Error log; reading the log also
+// clears the error. The tag, or -1 if the log doesn't say.
+static int ahci_ncq_error_tag(int port_num) {
+    static uint8_t log[SECTOR_SIZE] __attribute__((aligned(2)));
+    if (ahci_exec_polled(port_num, ATA_CMD_READ_LOG_EXT, ATA_LOG_NCQ_ERROR, 1, log, SECTOR_SIZE) != 0) return -1;
+    return (log[0] & 0x80) ? -1 : (log[0] & 0x1F);   // NQ: not a queued command
+}
+
+static void disk_finish(DiskRequest* r, int status) {
+    CoWaiter* waiter = r->waiter;
+    void (*callback)(DiskRequest*) = r->callback;
+    r->status = status;
+    r->done = true;
+    if (waiter) waiter->wake();
+    else if (callback) callback(r);
+    else thread_wake(r);
+}
+
+// Fills the PRDT from the request's buffer or segments, splitting pieces
+// at the per-entry limit; the number of entries, or 0 if they don't fit.
+static int disk_build_prdt(const DiskRequest* r, HBA_PRDT_ENTRY* prdt) {
+    DiskSegment whole = { r->buffer, (uint32_t)r->count * SECTOR_SIZE };
+    const DiskSegment* segments = r->segments ? r->segments : &whole;
+    int segment_count = r->segments ? r->segment_count : 1;
+    int entries = 0;
+    for (int i = 0; i < segment_count; i++) {
+        uint8_t* buffer = (uint8_t*)segments[i].buffer;
+        uint32_t bytes = segments[i].bytes;
+        while (bytes > 0) {
+            if (entries == AHCI_PRDT_MAX) return 0;
+            uint32_t piece = bytes > AHCI_PRD_BYTES_MAX ? AHCI_PRD_BYTES_MAX : bytes;
+            if (prdt) {
+                prdt[entries].dba = (uint64_t)(uintptr_t)buffer;
+                prdt[entries].dbc = piece - 1;
+                prdt[entries].i = 0;
+            }
+            entries++;
+            buffer += piece;
+            bytes -= piece;
+        }
+    }
+    return entries;
+}
+
+
+static bool disk_conflicts(const AhciPort* p, const DiskRequest* r) {
+    for (DiskRequest* f = p->flight; f; f = f->next) {
+        if ((r->write || f->write) && r->lba < f->lba + f->count && f->lba < r->lba + r->count) return true;
+    }
+    return false;
+}
+
+// Builds and issues `r`; false while the device is busy, no slot is free or
+// `r` must wait for a conflicting command.
+static bool disk_issue(AhciPort* p, DiskRequest* r) {
+    HBA_PORT* port = ahci_port_regs(r->port);
+    if (!p->flight && (port->tfd & (TFD_STS_BSY | TFD_STS_DRQ))) return false;
+    if (disk_conflicts(p, r)) return false;
+    bool ncq = p->ncq_depth > 0;
+    if (p->flight && p->flight->ncq != ncq) return false;   // queued and legacy commands don't mix
+
+    // Find a free command slot
+    uint32_t slots = (port->sact | port->ci | p->issued);
+    int slot = -1;
+    int limit = ncq ? p->ncq_depth : g_disk_depth;
+    for (int i=0; i<limit; i++) {
+        if ((slots & (1u << i)) == 0) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot == -1) return false;
+
+    HBA_CMD_HEADER* cmd_header = &p->cmd_list[slot];
+    cmd_header->cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t);
+    cmd_header->w = r->write;
+
+    uintptr_t cmd_table_addr = (uintptr_t)cmd_header->ctba;
+    FIS_REG_H2D* cmd_fis = (FIS_REG_H2D*)(cmd_table_addr);
+    HBA_PRDT_ENTRY* prdt = (HBA_PRDT_ENTRY*)(cmd_table_addr + 128);
+    cmd_header->prdtl = disk_build_prdt(r, prdt);
+
+    // Configure the command FIS
+    uint64_t lba = r->lba;
+    memset(cmd_fis, 0, sizeof(FIS_REG_H2D));
+    cmd_fis->fis_type = FIS_TYPE_REG_H2D;
+    cmd_fis->c = 1;
+
+    cmd_fis->lba0 = (uint8_t)lba; cmd_fis->lba1 = (uint8_t)(lba >> 8); cmd_fis->lba2 = (uint8_t)(lba >> 16);
+    cmd_fis->device = 1 << 6;
+    cmd_fis->lba3 = (uint8_t)(lba >> 24); cmd_fis->lba4 = (uint8_t)(lba >> 32); cmd_fis->lba5 = (uint8_t)(lba >> 40);
+    if (ncq) {
+        // FPDMA QUEUED: the sector count moves to the features register and
+        // the count register carries the tag.
+        cmd_fis->command = r->write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+        cmd_fis->featurel = r->count & 0xFF; cmd_fis->featureh = (r->count >> 8) & 0xFF;
+        cmd_fis->countl = slot << 3;
+    } else {
+        cmd_fis->command = r->write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+        cmd_fis->countl = r->count & 0xFF; cmd_fis->counth = (r->count >> 8) & 0xFF;
+    }
+
+    if (!p->flight) p->deadline = Deadline::after_ms(AHCI_CMD_TIMEOUT_MS);
+    r->slot = slot;
+    r->ncq = ncq;
+    r->next = nullptr;
+    DiskRequest** link = &p->flight;
+    while (*link) link = &(*link)->next;
+    *link = r;
+    p->issued |= 1u << slot;
+    if (ncq) port->sact = (1u << slot);
+    port->ci = (1u << slot);
+    return true;
+}
+
+// Clears an error or a hang: the engine stops (dropping every issued
+// command), status is cleared and it starts again.
+static void ahci_port_restart(int port_num) {
+    HBA_PORT* port = ahci_port_regs(port_num);
+    stop_cmd(port);
+    port->serr = 0xFFFFFFFF;
+    port->is = 0xFFFFFFFF;
+    g_ahci_tfe = g_ahci_tfe & ~(1u << port_num);
+    start_cmd(port);
+}
+
+// Finishes the commands the HBA and drive are done with: queued ones leave
+// PxSACT, the rest PxCI. A task file error halts the port on the command at
+// PxCMD.CCS (for NCQ, the tag in the drive's error log), and a stall is
+// blamed on it as well, or on the oldest: that one fails, the port restarts
+// and the rest of the flight goes back to the front of the queue, oldest
+// first.
+static void disk_retire(AhciPort* p, int port_num) {
+    HBA_PORT* port = ahci_port_regs(port_num);
+    bool tfe = (port->is & AHCI_PxIS_TFES) || (g_ahci_tfe & (1u << port_num));
+    uint32_t ci = port->ci | port->sact;
+
+    bool progress = false;
+    DiskRequest** link = &p->flight;
+    while (DiskRequest* r = *link) {
+        if (ci & (1u << r->slot)) { link = &r->next; continue; }
+        *link = r->next;
+        p->issued &= ~(1u << r->slot);
+        disk_finish(r, 0);
+        progress = true;
+    }
+    if (progress) p->deadline = Deadline::after_ms(AHCI_CMD_TIMEOUT_MS);
+    if (!p->flight || (!tfe && !p->deadline.expired())) return;
+
+    bool ncq = p->flight->ncq;
+    int current = ncq ? -1 : (port->cmd >> 8) & 0x1F;
+    ahci_port_restart(port_num);
+    if (ncq && tfe) current = ahci_ncq_error_tag(port_num);
+    DiskRequest** failed_link = &p->flight;
+    for (link = &p->flight; *link; link = &(*link)->next) {
+        if ((*link)->slot == current) { failed_link = link; break; }
+    }
+    DiskRequest* failed = *failed_link;
+    *failed_link = failed->next;
+    DiskRequest* last = nullptr;
+    for (DiskRequest* r = p->flight; r; r = r->next) { r->slot = -1; last = r; }
+    if (last) {
+        last->next = p->head;
+        if (!p->head) p->tail = last;
+        p->head = p->flight;
+    }
+    p->flight = nullptr;
+    p->issued = 0;
+    p->deadline = Deadline::after_ms(AHCI_CMD_TIMEOUT_MS);
+    disk_finish(failed, -1);
+}
+
+static void disk_pump_port(AhciPort* p, int port_num) {
+    if (p->flight) disk_retire(p, port_num);
+    while (DiskRequest* r = p->head) {
+        bool issued = disk_issue(p, r);
+        // The drive stays busy with nothing of ours in flight: give up on r.
+        if (!issued && (p->flight || !p->deadline.expired())) break;
+        p->head = r->next;
+        if (!p->head) p->tail = nullptr;
+        if (!issued) {
+            disk_finish(r, -1);
+            p->deadline = Deadline::after_ms(AHCI_CMD_TIMEOUT_MS);
+        }
+    }
+}
+
+void disk_pump() {
+    uint32_t flags = irq_save();
+    if (g_disk_pumping) { g_disk_repump = true; irq_restore(flags); return; }   // a completion callback submitted
+    g_disk_pumping = true;
+    do {
+        g_disk_repump = false;
+        for (int i = 0; i < 32; i++) {
+            if (g_ahci_live & (1u << i)) disk_pump_port(&g_ahci_ports[i], i);
+        }
+    } while (g_disk_repump);
+    g_disk_pumping = false;
+    irq_restore(flags);
+}
+
+// ncq [off|<depth>]: shows or limits how many queued commands each drive gets.
+void ncq_command(const char* args) {
+    int depth = -1;
+    if (strcmp(args, "off") == 0) depth = 0;
+    else if (*args) {
+        depth = simple_atoi(args);
+        if (depth < 1 || depth > g_disk_depth) {
+            char msg[64];
+            snprintf(msg, 64, "Usage: ncq [off|1-%d]\n", g_disk_depth);
+            wm.print_to_focused(msg);
+            return;
+        }
+    }
+    char msg[96];
+    for (int i = 0; i < 32; i++) {
+        if (!(g_ahci_live & (1u << i))) continue;
+        AhciPort* p = &g_ahci_ports[i];
+        if (!p->ncq_max) {
+            snprintf(msg, 96, "Port %d: NCQ not supported by the drive or controller\n", i);
+        } else {
+            if (depth >= 0) p->ncq_depth = depth < p->ncq_max ? depth : p->ncq_max;
+            snprintf(msg, 96, "Port %d: NCQ %s, depth %d of %d\n", i, p->ncq_depth ? "on" : "off", p->ncq_depth, p->ncq_max);
+        }
+        wm.print_to_focused(msg);
+    }
+    snprintf(msg, 96, "%d command slots per port\n", g_disk_depth);
+    wm.print_to_focused(msg);
+}
+
+// Queues `r` on AHCI port r->port and returns; it completes through its
+// waiter, its callback or thread_wake(r), in that order of preference. `r`
+// must stay put until done.
+static void disk_submit(DiskRequest* r) {
+    r->status = 0;
+    r->done = false;
+    r->slot = -1;
+    r->next = nullptr;
+    if (r->port < 0 || r->port >= 32 || !(g_ahci_live & (1u << r->port)) ||
+        disk_build_prdt(r, nullptr) == 0) { disk_finish(r, -1); return; }
+    AhciPort* p = &g_ahci_ports[r->port];
+    uint32_t flags = irq_save();
+    if (!p->flight && !p->head) p->deadline = Deadline::after_ms(AHCI_CMD_TIMEOUT_MS);
+    if (p->tail) p->tail->next = r; else p->head = r;
+    p->tail = r;
+    irq_restore(flags);
+    disk_pump();
+}
+
+// Block devices: every live port is a disk, and a stripe set (RAID-0) is a
+// device over two or more disks. The filesystem lives on g_fs_device.
+static const int MAX_BLOCK_DEVICES = 8;
+static const int MAX_STRIPE_MEMBERS = 4;
+static const uint32_t STRIPE_SECTORS = 128;    // 64 KiB on one member before the next
+
+struct BlockDevice {
+    int port;                           // AHCI port, or -1 for a stripe set
+    int members[MAX_STRIPE_MEMBERS];    // the disks striped over, in order
+    int member_count;
+    uint64_t sectors;
+};
+
+static BlockDevice g_block_devices[MAX_BLOCK_DEVICES];
+static int g_block_device_count = 0;
+static int g_fs_device = -1;
+
+// A request on a stripe set becomes one child per member it touches. A
+// member's stripes within the range are adjacent on that disk, so each
+// child is a single command that scatters into every n-th piece of the
+// caller's buffer, and the members work in parallel.
+static const int STRIPE_IO_POOL = 8;
+
+struct StripeIo {
+    DiskRequest* parent;            // null while free
+    int pending;
+    int status;
+    DiskRequest children[MAX_STRIPE_MEMBERS];
+    DiskSegment segments[MAX_STRIPE_MEMBERS][AHCI_PRDT_MAX];
+};
+
+static StripeIo g_stripe_io[STRIPE_IO_POOL];
+static DiskRequest* g_stripe_head = nullptr;   // waiting for a free StripeIo
+static DiskRequest* g_stripe_tail = nullptr;
+
+// Appends bytes [offset, offset + bytes) of r's transfer to a segment list,
+// merging pieces that touch; false if the list would overflow.
+static bool stripe_slice(const DiskRequest* r, uint32_t offset, uint32_t bytes, DiskSegment* out, int* count) {
+    DiskSegment whole = { r->buffer, (uint32_t)r->count * SECTOR_SIZE };
+    const DiskSegment* segments = r->segments ? r->segments : &whole;
+    int segment_count = r->segments ? r->segment_count : 1;
+    for (int i = 0; i < segment_count && bytes > 0; i++) {
+        if (offset >= segments[i].bytes) { offset -= segments[i].bytes; continue; }
+        uint32_t piece = segments[i].bytes - offset;
+        if (piece > bytes) piece = bytes;
+        uint8_t* buffer = (uint8_t*)segments[i].buffer + offset;
+        if (*count && (uint8_t*)out[*count - 1].buffer + out[*count - 1].bytes == buffer) {
+            out[*count - 1].bytes += piece;
+        } else {
+            if (*count == AHCI_PRDT_MAX) return false;
+            out[(*count)++] = { buffer, piece };
+        }
+        bytes -= piece;
+        offset = 0;
+    }
+    return bytes == 0;
+}
+
+static void stripe_start(DiskRequest* r);
+
+// Frees `io` and starts the oldest request waiting for one.
+static void stripe_release(StripeIo* io) {
+    uint32_t flags = irq_save();
+    io->parent = nullptr;
+    DiskRequest* next = g_stripe_head;
+    if (next) {
+        g_stripe_head = next->next;
+        if (!g_stripe_head) g_stripe_tail = nullptr;
+    }
+    irq_restore(flags);
+    if (next) stripe_start(next);
+}
+
+static void stripe_child_done(DiskRequest* child) {
+    StripeIo* io = (StripeIo*)child->context;
+    if (child->status != 0) io->status = -1;
+    if (--io->pending) return;
+    DiskRequest* parent = io->parent;
+    int status = io->status;
+    disk_finish(parent, status);
+    stripe_release(io);
+}
+
+static void stripe_start(DiskRequest* r) {
+    uint32_t flags = irq_save();
+    StripeIo* io = nullptr;
+    for (int i = 0; i < STRIPE_IO_POOL && !io; i++) if (!g_stripe_io[i].parent) io = &g_stripe_io[i];
+    if (!io) {
+        r->next = nullptr;
+        if (g_stripe_tail) g_stripe_tail->next = r; else g_stripe_head = r;
+        g_stripe_tail = r;
+        irq_restore(flags);
+        return;
+    }
+    io->parent = r;
+    irq_restore(flags);
+
+    const BlockDevice* dev = &g_block_devices[r->device];
+    int n = dev->member_count;
+    for (int m = 0; m < n; m++) io->children[m] = {};
+    bool ok = true;
+    uint64_t lba = r->lba;
+    uint32_t left = r->count, offset = 0;
+    while (left > 0 && ok) {
+        uint32_t within, member;
+        uint64_t stripe = u64_divmod32(lba, STRIPE_SECTORS, &within);
+        uint64_t row = u64_divmod32(stripe, n, &member);
+        uint32_t chunk = STRIPE_SECTORS - within;
+        if (chunk > left) chunk = left;
+        DiskRequest* child = &io->children[member];
+        if (child->count == 0) {
+            child->device = dev->members[member];
+            child->lba = row * STRIPE_SECTORS + within;
+            child->write = r->write;
+            child->segments = io->segments[member];
+        }
+        ok = stripe_slice(r, offset, chunk * SECTOR_SIZE, io->segments[member], &child->segment_count);
+        child->count += chunk;
+        lba += chunk;
+        left -= chunk;
+        offset += chunk * SECTOR_SIZE;
+    }
+    if (!ok) {
+        disk_finish(r, -1);
+        stripe_release(io);
+        return;
+    }
+
+    io->status = 0;
+    io->pending = 0;
+    for (int m = 0; m < n; m++) if (io->children[m].count) io->pending++;
+    for (int m = 0; m < n; m++) {
+        DiskRequest* child = &io->children[m];
+        if (!child->count) continue;
+        child->port = g_block_devices[child->device].port;
+        child->callback = stripe_child_done;
+        child->context = io;
+        disk_submit(child);
+    }
+}
+
+// Queues `r` on block device r->device; it completes as disk_submit() says.
+static void blk_submit(DiskRequest* r) {
+    if (r->device < 0 || r->device >= g_block_device_count) {
+        r->port = -1;
+        disk_submit(r);
+        return;
+    }
+    const BlockDevice* dev = &g_block_devices[r->device];
+    if (dev->port >= 0) {
+        r->port = dev->port;
+        disk_submit(r);
+        return;
+    }
+    r->status = 0;
+    r->done = false;
+    if (r->count == 0 || r->lba + r->count > dev->sectors) { disk_finish(r, -1); return; }
+    stripe_start(r);
+}
+
+static bool disk_busy() {
+    for (int i = 0; i < 32; i++) {
+        if ((g_ahci_live & (1u << i)) && (g_ahci_ports[i].flight || g_ahci_ports[i].head)) return true;
+    }
+    return g_stripe_head != nullptr;
+}
+
+// "1" or "disk1": the block device number, or -1.
+static int parse_block_device(const char* s) {
+    if (!s) return -1;
+    if (strncmp(s, "disk", 4) == 0) s += 4;
+    if (*s < '0' || *s > '9') return -1;
+    int device = simple_atoi(s);
+    return device < g_block_device_count ? device : -1;
+}
+
+// disks: lists the block devices.
+void disks_command() {
+    if (!g_block_device_count) { wm.print_to_focused("No disks.\n"); return; }
+    char msg[128];
+    for (int i = 0; i < g_block_device_count; i++) {
+        const BlockDevice* dev = &g_block_devices[i];
+        const char* mounted = (i == g_fs_device) ? " (mounted)" : "";
+        if (dev->port >= 0) {
+            const AhciPort* p = &g_ahci_ports[dev->port];
+            snprintf(msg, 128, "disk%d: AHCI port %d, %d MiB, NCQ depth %d%s\n",
+                     i, dev->port, (int)(dev->sectors >> 11), p->ncq_depth, mounted);
+        } else {
+            char members[48] = "";
+            for (int m = 0; m < dev->member_count; m++) {
+                char name[12];
+                snprintf(name, 12, m ? "+disk%d" : "disk%d", dev->members[m]);
+                strcat(members, name);
+            }
+            snprintf(msg, 128, "disk%d: stripe set over %s, %d MiB, %d KiB stripes%s\n",
+                     i, members, (int)(dev->sectors >> 11), (int)(STRIPE_SECTORS / 2), mounted);
+        }
+        wm.print_to_focused(msg);
+    }
+}
+
+// stripe <disk> <disk> [...]: adds a RAID-0 set over the given disks. Its
+// capacity is the smallest member's, whole stripes only, times the members.
+void stripe_command(const char* args) {
+    char buffer[64];
+    strncpy(buffer, args, 63);
+    buffer[63] = '\0';
+    BlockDevice set = {};
+    set.port = -1;
+    uint64_t smallest = 0;
+    for (char* token = buffer; *token; ) {
+        while (*token == ' ') token++;
+        if (!*token) break;
+        char* end = token;
+        while (*end && *end != ' ') end++;
+        if (*end) *end++ = '\0';
+        int device = parse_block_device(token);
+        bool repeated = false;
+        for (int m = 0; m < set.member_count; m++) repeated |= set.members[m] == device;
+        if (device < 0 || g_block_devices[device].port < 0 || repeated || set.member_count == MAX_STRIPE_MEMBERS) {
+            set.member_count = 0;
+            break;
+        }
+        set.members[set.member_count++] = device;
+        if (!smallest || g_block_devices[device].sectors < smallest) smallest = g_block_devices[device].sectors;
+        token = end;
+    }
+    if (set.member_count < 2) {
+        wm.print_to_focused("Usage: stripe <disk> <disk> [...] (2-4 different disks, see 'disks')\n");
+        return;
+    }
+    if (g_block_device_count == MAX_BLOCK_DEVICES) {
+        wm.print_to_focused("No room for another block device.\n");
+        return;
+    }
+    set.sectors = u64_div32(smallest, STRIPE_SECTORS) * STRIPE_SECTORS * set.member_count;
+    g_block_devices[g_block_device_count] = set;
+    char msg[80];
+    snprintf(msg, 80, "disk%d: stripe set, %d MiB. 'mount %d' then 'formatfs' to use it.\n",
+             g_block_device_count, (int)(set.sectors >> 11), g_block_device_count);
+    g_block_device_count++;
+    wm.print_to_focused(msg);
+}
 
-static uint64_t ahci_base = 0;
-static HBA_CMD_HEADER* cmd_list;
-static char* cmd_table_buffer;
-static fat32_bpb_t bpb;
-static uint32_t fat_start_sector, data_start_sector;
-static uint32_t current_directory_cluster = 0;
+// mount <disk>: moves the filesystem to another block device.
+void mount_command(const char* args) {
+    int device = parse_block_device(args);
+    if (device < 0) {
+        wm.print_to_focused("Usage: mount <disk> (see 'disks')\n");
+        return;
+    }
+    g_fs_device = device;
+    char msg[80];
+    snprintf(msg, 80, fat32_init() ? "Mounted disk%d.\n" : "disk%d has no FAT32 volume; 'formatfs' creates one.\n", device);
+    wm.print_to_focused(msg);
+}
 
-// --- Aligned Memory Allocator ---
-void* alloc_aligned(size_t size, size_t alignment) {
-    size_t offset = alignment - 1 + sizeof(void*);
-    void* p1 = operator new(size + offset);
-    if (p1 == nullptr) return nullptr;
-    void** p2 = (void**)(((uintptr_t)p1 + offset) & ~(alignment - 1));
-    p2[-1] = p1;
-    return p2;
+// Shared line: the HBA's summary register says whether it was us. Port
+// status is cleared before the summary bit, as the spec requires, and a
+// task file error is latched for disk_pump().
+static void ahci_irq(InterruptFrame*) {
+    volatile uint32_t* hba_is = &((HBA_MEM*)(uintptr_t)ahci_base)->is;
+    uint32_t pending = *hba_is;
+    if (!pending) return;
+    for (int i = 0; i < 32; i++) {
+        if (!(pending & (1u << i))) continue;
+        HBA_PORT* port = ahci_port_regs(i);
+        uint32_t is = port->is;
+        port->is = is;
+        if (is & AHCI_PxIS_TFES) g_ahci_tfe = g_ahci_tfe | (1u << i);
+    }
+    *hba_is = pending;
+    disk_pump();
+    thread_notify_ui();
+}
+
+// With interrupts off and nothing to do until a completion: sleeps until
+// thread_wake(on), or for AHCI_WATCHDOG_MS so that timeouts are still
+// noticed if an interrupt goes missing. Returns false straight away while
+// completions are polled; the caller then keeps pumping.
+static bool disk_sleep(const void* on) {
+    if (g_ahci_irq < 0 || !g_current || smp_on_ap()) return false;
+    thread_wait(on, rdtsc() + (uint64_t)AHCI_WATCHDOG_MS * g_tsc_khz);
+    return true;
 }
 
-void free_aligned(void* ptr) {
-    if (ptr == nullptr) return;
-    operator delete(((void**)ptr)[-1]);
+// Waits for a request submitted without a waiter or callback.
+static int disk_wait(DiskRequest* r) {
+    while (!r->done) {
+        uint32_t flags = irq_save();
+        if (!r->done) disk_sleep(r);
+        irq_restore(flags);
+        disk_pump();
+    }
+    return r->status;
 }
 
+// Submits `count` requests at once so the drives have them all in hand, and
+// waits for every one; -1 if any failed (each keeps its own status).
+static int disk_io_all(DiskRequest* requests, int count) {
+    for (int i = 0; i < count; i++) blk_submit(&requests[i]);
+    int status = 0;
+    for (int i = 0; i < count; i++) if (disk_wait(&requests[i]) != 0) status = -1;
+    return status;
+}
 
-int read_write_sectors(int port_num, uint64_t lba, uint16_t count, bool write, void* buffer) {
-    if (port_num == -1 || !ahci_base) return -1;
+int read_write_sectors(int device, uint64_t lba, uint16_t count, bool write, void* buffer) {
+    DiskRequest r = {};
+    r.device = device; r.lba = lba; r.count = count; r.write = write; r.buffer = buffer;
+    blk_submit(&r);
+    return disk_wait(&r);
+}
 
-    HBA_PORT* port = (HBA_PORT*)(ahci_base + 0x100 + (port_num * 0x80));
-    
-    port->is = 0xFFFFFFFF; // Clear any pending interrupt flags
+// co_await co_disk_io(...): read_write_sectors() that suspends the task
+// instead of spinning; yields the same status.
+struct DiskIo {
+    DiskRequest request;
+    CoWaiter waiter;
 
-    // Find a free command slot
-    uint32_t slots = (port->sact | port->ci);
-    int slot = -1;
-    for (int i=0; i<32; i++) {
-        if ((slots & (1 << i)) == 0) {
-            slot = i;
-            break;
-        }
+    bool await_ready() const { return false; }
+    template<typename P> void await_suspend(std::coroutine_handle<P> h) {
+        waiter.park(h);
+        request.waiter = &waiter;
+        blk_submit(&request);
     }
-    if (slot == -1) return -1;
-
-    HBA_CMD_HEADER* cmd_header = &cmd_list[slot];
-    cmd_header->cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t);
-    cmd_header->w = write;
-    cmd_header->prdtl = 1;
-
-    uintptr_t cmd_table_addr = (uintptr_t)cmd_header->ctba;
-    FIS_REG_H2D* cmd_fis = (FIS_REG_H2D*)(cmd_table_addr);
-    HBA_PRDT_ENTRY* prdt = (HBA_PRDT_ENTRY*)(cmd_table_addr + 128);
-    
-    prdt->dba = (uint64_t)(uintptr_t)buffer;
-    prdt->dbc = (count * SECTOR_SIZE) - 1;
-    
-    prdt->i = 0;
+    int await_resume() const { return request.status; }
+};
 
-    // Configure the command FIS
-    memset(cmd_fis, 0, sizeof(FIS_REG_H2D));
-    cmd_fis->fis_type = FIS_TYPE_REG_H2D;
-    cmd_fis->c = 1;
-    cmd_fis->command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
-    
-    cmd_fis->lba0 = (uint8_t)lba; cmd_fis->lba1 = (uint8_t)(lba >> 8); cmd_fis->lba2 = (uint8_t)(lba >> 16);
-    cmd_fis->device = 1 << 6;
-    cmd_fis->lba3 = (uint8_t)(lba >> 24); cmd_fis->lba4 = (uint8_t)(lba >> 32); cmd_fis->lba5 = (uint8_t)(lba >> 40);
-    cmd_fis->countl = count & 0xFF; cmd_fis->counth = (count >> 8) & 0xFF;
+static inline DiskIo co_disk_io(int device, uint64_t lba, uint16_t count, bool write, void* buffer) {
+    DiskIo io = {};
+    io.request.device = device; io.request.lba = lba; io.request.count = count;
+    io.request.write = write; io.request.buffer = buffer;
+    return io;
+}
 
-    // Wait for the port to not be busy
-    while((port->tfd & (TFD_STS_BSY | TFD_STS_DRQ)));
+// co_await co_disk_all(requests, n): disk_io_all() for tasks. Completion
+// callbacks count the batch down and the last one wakes the task.
+struct DiskBatch {
+    DiskRequest* requests;
+    int count;
+    int pending;
+    int status;
+    CoWaiter waiter;
 
-    // Issue the command
-    port->ci = (1 << slot);
+    static void done(DiskRequest* r) {
+        DiskBatch* batch = (DiskBatch*)r->context;
+        if (r->status != 0) batch->status = -1;
+        if (--batch->pending == 0) batch->waiter.wake();
+    }
 
-    int spin = 0;
-    while (spin < 1000000) {
-        if ((port->ci & (1 << slot)) == 0) {
-             break; // Command completed successfully
+    bool await_ready() const { return count == 0; }
+    template<typename P> void await_suspend(std::coroutine_handle<P> h) {
+        waiter.park(h);
+        pending = count;
+        for (int i = 0; i < count; i++) {
+            requests[i].callback = done;
+            requests[i].context = this;
+            blk_submit(&requests[i]);
         }
-        spin++;
-    }
-    
-    // Check if the loop timed out
-    if (spin == 1000000) {
-        return -1; // Timeout error
     }
+    int await_resume() const { return status; }
+};
 
-    if (port->is & (1 << 30)) {
-        return -1; // The drive reported a task file error
-    }
-    
-    return 0; // Success
+static inline DiskBatch co_disk_all(DiskRequest* requests, int count) {
+    DiskBatch batch = {};
+    batch.requests = requests; batch.count = count;
+    return batch;
 }
 void stop_cmd(HBA_PORT *port) {
-    port->cmd &= ~0x0001; // Clear ST (Start)
-    port->cmd &= ~0x0010; // Clear FRE (FIS Receive Enable)
+    port->cmd = port->cmd & ~0x0001; // Clear ST (Start)
+    port->cmd = port->cmd & ~0x0010; // Clear FRE (FIS Receive Enable)
 
     // Wait until Command List Running (CR) and FIS Receive Running (FR) are cleared
     while(port->cmd & 0x8000 || port->cmd & 0x4000);
@@ -1710,55 +5076,113 @@ void start_cmd(HBA_PORT *port) {
     // Wait until Command List Running (CR) is cleared
     while(port->cmd & 0x8000);
 
-    port->cmd |= 0x0010; // Set FRE (FIS Receive Enable)
-    port->cmd |= 0x0001; // Set ST (Start)
+    port->cmd = port->cmd | 0x0010; // Set FRE (FIS Receive Enable)
+    port->cmd = port->cmd | 0x0001; // Set ST (Start)
+}
+// Finds the first AHCI controller: ABAR (BAR5) and its INTx line, or -1.
+static bool ahci_find(uint64_t* abar, int* irq) {
+    for (uint16_t bus = 0; bus < 256; bus++) {
+        for (uint8_t device = 0; device < 32; device++) {
+            if ((pci_read_config_dword(bus, device, 0, 0x00) & 0xFFFF) == 0xFFFF) continue;
+            if ((pci_read_config_dword(bus, device, 0, 0x08) >> 16) != 0x0106) continue;
+            uint32_t command = pci_read_config_dword(bus, device, 0, 0x04);
+            command = (command | (1u << 1) | (1u << 2)) & ~(1u << 10);   // memory, bus master, INTx on
+            pci_write_config_dword(bus, device, 0, 0x04, command);
+            *abar = pci_read_config_dword(bus, device, 0, 0x24) & 0xFFFFFFF0;
+            uint8_t line = pci_read_config_dword(bus, device, 0, 0x3C) & 0xFF;
+            *irq = (line > 2 && line < 16) ? line : -1;
+            return true;
+        }
+    }
+    return false;
 }
-void disk_init() {
-    // Find the AHCI controller's base address
-    for (uint16_t bus = 0; bus < 256; bus++) for (uint8_t dev = 0; dev < 32; dev++) if ((pci_read_config_dword(bus, dev, 0, 0) & 0xFFFF) != 0xFFFF && (pci_read_config_dword(bus, dev, 0, 0x08) >> 16) == 0x0106) { ahci_base = pci_read_config_dword(bus, dev, 0, 0x24) & 0xFFFFFFF0; goto found; }
-found:
-    if (!ahci_base) return;
 
-    cmd_list = (HBA_CMD_HEADER*)alloc_aligned(32 * sizeof(HBA_CMD_HEADER), 1024);
-    cmd_table_buffer = (char*)alloc_aligned(32 * 256, 128);
+// Gives port `i` its own command list, command tables and received-FIS
+// area, starts it and asks the drive what it is. False if memory ran out.
+static bool ahci_port_init(int i) {
+    HBA_PORT* port = ahci_port_regs(i);
+    AhciPort* p = &g_ahci_ports[i];
+    p->cmd_list = (HBA_CMD_HEADER*)alloc_aligned(32 * sizeof(HBA_CMD_HEADER), 1024);
+    char* cmd_tables = (char*)alloc_aligned(g_disk_depth * AHCI_CMD_TABLE_SIZE, 128);
     char* fis_buffer = (char*)alloc_aligned(256, 256);
-    
-    if (!cmd_list || !cmd_table_buffer || !fis_buffer) return;
+    if (!p->cmd_list || !cmd_tables || !fis_buffer) return false;
 
-    for(int k=0; k<32; ++k) {
-        cmd_list[k].ctba = (uint64_t)(uintptr_t)(cmd_table_buffer + (k * 256));
+    memset(p->cmd_list, 0, 32 * sizeof(HBA_CMD_HEADER));
+    for (int k = 0; k < g_disk_depth; ++k) {
+        p->cmd_list[k].ctba = (uint64_t)(uintptr_t)(cmd_tables + (k * AHCI_CMD_TABLE_SIZE));
     }
 
-    uint32_t ports_implemented = *(volatile uint32_t*)(ahci_base + 0x0C);
+    stop_cmd(port);
 
-    for (int i = 0; i < 32; i++) {
-        if (ports_implemented & (1 << i)) {
-            HBA_PORT* port = (HBA_PORT*)(ahci_base + 0x100 + (i * 0x80));
+    port->clb = (uint32_t)(uintptr_t)p->cmd_list;
+    port->clbu = (uint32_t)(((uint64_t)(uintptr_t)p->cmd_list) >> 32);
+    port->fb = (uint32_t)(uintptr_t)fis_buffer;
+    port->fbu = (uint32_t)(((uint64_t)(uintptr_t)fis_buffer) >> 32);
+
+    port->serr = 0xFFFFFFFF;
 
-            uint8_t ipm = (port->ssts >> 8) & 0x0F;
-            uint8_t det = port->ssts & 0x0F;
-            if (det != 3 || ipm != 1) continue;
+    start_cmd(port);
+    port->is = 0xFFFFFFFF;
+
+    // Capacity from IDENTIFY words 100-103 (LBA48) or 60-61. NCQ needs both
+    // sides: HBA CAP.SNCQ and word 76 bit 8, with the drive's depth in
+    // word 75.
+    HBA_MEM* hba = (HBA_MEM*)(uintptr_t)ahci_base;
+    uint16_t* identify = new uint16_t[256];
+    if (ahci_exec_polled(i, ATA_CMD_IDENTIFY, 0, 0, identify, SECTOR_SIZE) == 0) {
+        p->sectors = identify[100] | ((uint64_t)identify[101] << 16) |
+                     ((uint64_t)identify[102] << 32) | ((uint64_t)identify[103] << 48);
+        if (!p->sectors) p->sectors = identify[60] | ((uint32_t)identify[61] << 16);
+        if ((hba->cap & HBA_CAP_SNCQ) && (identify[76] & (1u << 8))) {
+            p->ncq_max = (identify[75] & 0x1F) + 1;
+            if (p->ncq_max > g_disk_depth) p->ncq_max = g_disk_depth;
+            p->ncq_depth = p->ncq_max;
+        }
+    }
+    delete[] identify;
+    return true;
+}
 
-            stop_cmd(port);
+void disk_init() {
+    int irq;
+    if (!ahci_find(&ahci_base, &irq) || !ahci_base) return;
 
-            port->clb = (uint32_t)(uintptr_t)cmd_list;
-            port->clbu = (uint32_t)(((uint64_t)(uintptr_t)cmd_list) >> 32);
-            port->fb = (uint32_t)(uintptr_t)fis_buffer;
-            port->fbu = (uint32_t)(((uint64_t)(uintptr_t)fis_buffer) >> 32);
+    HBA_MEM* hba = (HBA_MEM*)(uintptr_t)ahci_base;
+    uint32_t ports_implemented = hba->pi;
+    g_disk_depth = ((hba->cap >> 8) & 0x1F) + 1;   // CAP.NCS
 
-            port->serr = 0xFFFFFFFF;
+    // Every port with a drive behind it becomes a disk, in port order.
+    for (int i = 0; i < 32; i++) {
+        if (!(ports_implemented & (1u << i))) continue;
+        HBA_PORT* port = ahci_port_regs(i);
+        uint8_t ipm = (port->ssts >> 8) & 0x0F;
+        uint8_t det = port->ssts & 0x0F;
+        if (det != 3 || ipm != 1) continue;
+        if (port->sig != SATA_SIG_ATA) continue;   // ATAPI, port multipliers
+        if (g_block_device_count == MAX_BLOCK_DEVICES || !ahci_port_init(i)) break;
 
-            start_cmd(port);
+        g_ahci_live |= 1u << i;
+        BlockDevice* dev = &g_block_devices[g_block_device_count++];
+        dev->port = i;
+        dev->sectors = g_ahci_ports[i].sectors;
+    }
+    if (!g_ahci_live) return;
+    g_fs_device = 0;
 
-            g_ahci_port = i;
-            return;
+    // Completion by interrupt from here on, if the line can be had.
+    if (irq >= 0 && irq_install(irq, ahci_irq)) {
+        for (int i = 0; i < 32; i++) {
+            if (g_ahci_live & (1u << i)) ahci_port_regs(i)->ie = AHCI_PxIE_MASK;
         }
+        hba->is = 0xFFFFFFFF;
+        hba->ghc = hba->ghc | AHCI_GHC_IE;
+        g_ahci_irq = irq;
     }
 }
 bool fat32_init() {
     if(!ahci_base) return false;
     char* buffer = new char[SECTOR_SIZE];
-    if (read_write_sectors(g_ahci_port, 0, 1, false, buffer) != 0) { delete[] buffer; return false; }
+    if (read_write_sectors(g_fs_device, 0, 1, false, buffer) != 0) { delete[] buffer; return false; }
     memcpy(&bpb, buffer, sizeof(bpb));
     delete[] buffer;
     if (strncmp(bpb.fil_sys_type, "FAT32", 5) != 0) { current_directory_cluster = 0; return false; }
@@ -1793,105 +5217,158 @@ void fat32_get_fne_from_entry(fat_dir_entry_t* entry, char* out) {
     from_83_format(entry->name, out);
 }
 
-uint32_t read_fat_entry(uint32_t cluster) {
+// FAT access is written once, as coroutines; each blocking function is
+// sync_wait() over its co_ twin. Coroutine callers (the VM's file built-ins)
+// suspend while a transfer is in flight instead of spinning on it.
+static Task<uint32_t> co_read_fat_entry(uint32_t cluster) {
     uint8_t* fat_sector = new uint8_t[SECTOR_SIZE];
     uint32_t fat_offset = cluster * 4;
-    read_write_sectors(g_ahci_port, fat_start_sector + (fat_offset / SECTOR_SIZE), 1, false, fat_sector);
+    co_await co_disk_io(g_fs_device, fat_start_sector + (fat_offset / SECTOR_SIZE), 1, false, fat_sector);
     uint32_t value = *(uint32_t*)(fat_sector + (fat_offset % SECTOR_SIZE)) & 0x0FFFFFFF;
     delete[] fat_sector;
-    return value;
+    co_return value;
 }
 
-bool write_fat_entry(uint32_t cluster, uint32_t value) {
+uint32_t read_fat_entry(uint32_t cluster) { return sync_wait(co_read_fat_entry(cluster)); }
+
+static Task<bool> co_write_fat_entry(uint32_t cluster, uint32_t value) {
     uint8_t* fat_sector = new uint8_t[SECTOR_SIZE];
     uint32_t fat_offset = cluster * 4;
     uint32_t sector_num = fat_start_sector + (fat_offset / SECTOR_SIZE);
-    read_write_sectors(g_ahci_port, sector_num, 1, false, fat_sector);
+    co_await co_disk_io(g_fs_device, sector_num, 1, false, fat_sector);
     *(uint32_t*)(fat_sector + (fat_offset % SECTOR_SIZE)) = (*(uint32_t*)(fat_sector + (fat_offset % SECTOR_SIZE)) & 0xF0000000) | (value & 0x0FFFFFFF);
-    bool success = read_write_sectors(g_ahci_port, sector_num, 1, true, fat_sector) == 0;
+    bool success = co_await co_disk_io(g_fs_device, sector_num, 1, true, fat_sector) == 0;
     delete[] fat_sector;
-    return success;
+    co_return success;
 }
 
-uint32_t find_free_cluster() {
+bool write_fat_entry(uint32_t cluster, uint32_t value) { return sync_wait(co_write_fat_entry(cluster, value)); }
+
+static Task<uint32_t> co_find_free_cluster() {
     uint32_t max_clusters = (bpb.tot_sec32 - data_start_sector) / bpb.sec_per_clus + 2;
-    for (uint32_t i = 2; i < max_clusters; i++) if (read_fat_entry(i) == FAT_FREE_CLUSTER) return i;
-    return 0;
+    for (uint32_t i = 2; i < max_clusters; i++) if (co_await co_read_fat_entry(i) == FAT_FREE_CLUSTER) co_return i;
+    co_return 0;
 }
 
-uint32_t allocate_cluster() {
-    uint32_t free_cluster = find_free_cluster();
-    if (free_cluster != 0) write_fat_entry(free_cluster, FAT_END_OF_CHAIN);
-    return free_cluster;
+uint32_t find_free_cluster() { return sync_wait(co_find_free_cluster()); }
+
+static Task<uint32_t> co_allocate_cluster() {
+    uint32_t free_cluster = co_await co_find_free_cluster();
+    if (free_cluster != 0) co_await co_write_fat_entry(free_cluster, FAT_END_OF_CHAIN);
+    co_return free_cluster;
 }
 
-void free_cluster_chain(uint32_t start_cluster) {
+uint32_t allocate_cluster() { return sync_wait(co_allocate_cluster()); }
+
+static Task<void> co_free_cluster_chain(uint32_t start_cluster) {
     uint32_t current = start_cluster;
-    while(current < FAT_END_OF_CHAIN) { uint32_t next = read_fat_entry(current); write_fat_entry(current, FAT_FREE_CLUSTER); current = next; }
+    while(current < FAT_END_OF_CHAIN) { uint32_t next = co_await co_read_fat_entry(current); co_await co_write_fat_entry(current, FAT_FREE_CLUSTER); current = next; }
 }
 
-uint32_t allocate_cluster_chain(uint32_t num_clusters) {
-    if(num_clusters == 0) return 0;
-    uint32_t first = allocate_cluster();
-    if(first == 0) return 0;
+void free_cluster_chain(uint32_t start_cluster) { sync_wait(co_free_cluster_chain(start_cluster)); }
+
+static Task<uint32_t> co_allocate_cluster_chain(uint32_t num_clusters) {
+    if(num_clusters == 0) co_return 0;
+    uint32_t first = co_await co_allocate_cluster();
+    if(first == 0) co_return 0;
     uint32_t current = first;
     for(uint32_t i = 1; i < num_clusters; i++) {
-        uint32_t next = allocate_cluster();
-        if(next == 0) { free_cluster_chain(first); return 0; }
-        write_fat_entry(current, next);
+        uint32_t next = co_await co_allocate_cluster();
+        if(next == 0) { co_await co_free_cluster_chain(first); co_return 0; }
+        co_await co_write_fat_entry(current, next);
         current = next;
     }
-    return first;
+    co_return first;
 }
 
-bool read_data_from_clusters(uint32_t start_cluster, void* data, uint32_t size) {
-    if (size == 0) return true;
-    uint8_t* data_ptr = (uint8_t*)data;
+uint32_t allocate_cluster_chain(uint32_t num_clusters) { return sync_wait(co_allocate_cluster_chain(num_clusters)); }
+
+// Commands a chain transfer keeps in flight at once, and the most one
+// command moves.
+static const int DISK_BATCH_RUNS = 8;
+static const uint32_t DISK_RUN_MAX_BYTES = 1u << 20;
+
+// Moves `size` bytes between `data` and the chain at `start_cluster`. Each
+// run of consecutive clusters becomes one command that DMAs straight to or
+// from `data`; only the slack past `size` in the last cluster goes through
+// a scratch buffer, as a second PRDT segment. The chain is walked a batch
+// of runs ahead and the batch goes to the drive together.
+static Task<bool> co_transfer_clusters(uint32_t start_cluster, uint8_t* data, uint32_t size, bool write) {
+    if (size == 0) co_return true;
     uint32_t remaining = size;
     uint32_t current_cluster = start_cluster;
     uint32_t cluster_size = bpb.sec_per_clus * SECTOR_SIZE;
+    uint32_t max_run = DISK_RUN_MAX_BYTES / cluster_size;
+    if (max_run == 0) max_run = 1;
+    DiskRequest requests[DISK_BATCH_RUNS];
+    DiskSegment segments[DISK_BATCH_RUNS][2];
+    uint8_t* tail = nullptr;        // the last cluster's slack
+    uint8_t* odd_byte = nullptr;    // an odd size's last byte, which lands in `tail`
 
     while (current_cluster >= 2 && current_cluster < FAT_END_OF_CHAIN && remaining > 0) {
-        uint32_t to_read = (remaining > cluster_size) ? cluster_size : remaining;
-        uint8_t* cluster_buf = new uint8_t[cluster_size];
-        memset(cluster_buf, 0, cluster_size); // Clear buffer
-        if(read_write_sectors(g_ahci_port, cluster_to_lba(current_cluster), bpb.sec_per_clus, false, cluster_buf) != 0) { 
-            delete[] cluster_buf; 
-            return false; 
-        }
-        memcpy(data_ptr, cluster_buf, to_read);
-        delete[] cluster_buf;
-        data_ptr += to_read;
-        remaining -= to_read;
-        if (remaining > 0) current_cluster = read_fat_entry(current_cluster);
-        else break;
+        int n = 0;
+        uint32_t batched = 0;
+        while (n < DISK_BATCH_RUNS && batched < remaining &&
+               current_cluster >= 2 && current_cluster < FAT_END_OF_CHAIN) {
+            uint32_t first = current_cluster;
+            uint32_t clusters = 0, run = 0;
+            for (;;) {
+                uint32_t left = remaining - batched - run;
+                run += (left > cluster_size) ? cluster_size : left;
+                clusters++;
+                if (batched + run == remaining) break;
+                current_cluster = co_await co_read_fat_entry(current_cluster);
+                if (current_cluster != first + clusters || clusters == max_run) break;
+            }
+
+            DiskSegment* seg = segments[n];
+            int segment_count = 0;
+            uint32_t direct = run & ~1u;
+            uint32_t span = clusters * cluster_size;
+            if (direct) seg[segment_count++] = { data + batched, direct };
+            if (direct < span) {
+                if (!tail) tail = new uint8_t[cluster_size];
+                if (write) {
+                    memset(tail, 0, span - direct);
+                    if (run & 1) tail[0] = data[batched + direct];
+                } else if (run & 1) {
+                    odd_byte = data + batched + direct;
+                }
+                seg[segment_count++] = { tail, span - direct };
+            }
+            requests[n] = {};
+            requests[n].device = g_fs_device; requests[n].lba = cluster_to_lba(first);
+            requests[n].count = clusters * bpb.sec_per_clus; requests[n].write = write;
+            requests[n].segments = seg; requests[n].segment_count = segment_count;
+            n++;
+            batched += run;
+        }
+        if (co_await co_disk_all(requests, n) != 0) {
+            delete[] tail;
+            co_return false;
+        }
+        if (odd_byte) { *odd_byte = tail[0]; odd_byte = nullptr; }
+        data += batched;
+        remaining -= batched;
     }
-    return true;
+    delete[] tail;
+    co_return true;
 }
 
-bool write_data_to_clusters(uint32_t start_cluster, const void* data, uint32_t size) {
-    if (size == 0) return true;
-    const uint8_t* data_ptr = (const uint8_t*)data;
-    uint32_t remaining = size;
-    uint32_t current_cluster = start_cluster;
-    uint32_t cluster_size = bpb.sec_per_clus * SECTOR_SIZE;
-    uint8_t* cluster_buf = new uint8_t[cluster_size];
+static Task<bool> co_read_data_from_clusters(uint32_t start_cluster, void* data, uint32_t size) {
+    return co_transfer_clusters(start_cluster, (uint8_t*)data, size, false);
+}
 
-    while (current_cluster >= 2 && current_cluster < FAT_END_OF_CHAIN && remaining > 0) {
-        uint32_t to_write = (remaining > cluster_size) ? cluster_size : remaining;
-        memset(cluster_buf, 0, cluster_size);
-        memcpy(cluster_buf, data_ptr, to_write);
-        if (read_write_sectors(g_ahci_port, cluster_to_lba(current_cluster), bpb.sec_per_clus, true, cluster_buf) != 0) { 
-            delete[] cluster_buf; 
-            return false; 
-        }
-        data_ptr += to_write;
-        remaining -= to_write;
-        if (remaining > 0) current_cluster = read_fat_entry(current_cluster);
-        else break;
-    }
-    delete[] cluster_buf;
-    return true;
+bool read_data_from_clusters(uint32_t start_cluster, void* data, uint32_t size) {
+    return sync_wait(co_read_data_from_clusters(start_cluster, data, size));
+}
+
+static Task<bool> co_write_data_to_clusters(uint32_t start_cluster, const void* data, uint32_t size) {
+    return co_transfer_clusters(start_cluster, (uint8_t*)data, size, true);
+}
+
+bool write_data_to_clusters(uint32_t start_cluster, const void* data, uint32_t size) {
+    return sync_wait(co_write_data_to_clusters(start_cluster, data, size));
 }
 
 uint32_t clusters_needed(uint32_t size) {
@@ -1906,7 +5383,7 @@ void fat32_list_files() {
         return;
     }
     uint8_t* buffer = new uint8_t[bpb.sec_per_clus * SECTOR_SIZE];
-    if (read_write_sectors(g_ahci_port, cluster_to_lba(current_directory_cluster), bpb.sec_per_clus, false, buffer) != 0) {
+    if (read_write_sectors(g_fs_device, cluster_to_lba(current_directory_cluster), bpb.sec_per_clus, false, buffer) != 0) {
         wm.print_to_focused("Read error\n");
         delete[] buffer;
         return;
@@ -1971,9 +5448,11 @@ void fat32_list_files() {
     }
     delete[] buffer;
 }
-int fat32_write_file(const char* filename, const void* data, uint32_t size) {
+static Task<int> co_fat32_remove_file(const char* filename);
+
+static Task<int> co_fat32_write_file(const char* filename, const void* data, uint32_t size) {
     // First, safely remove the file if it already exists to handle overwrites correctly.
-    fat32_remove_file(filename);
+    co_await co_fat32_remove_file(filename);
 
     char target_83[11];
     to_83_format(filename, target_83);
@@ -1981,20 +5460,20 @@ int fat32_write_file(const char* filename, const void* data, uint32_t size) {
 
     if (size > 0) {
         uint32_t num_clusters = clusters_needed(size);
-        if (num_clusters == 0) return -1;
+        if (num_clusters == 0) co_return -1;
         
-        first_cluster = allocate_cluster_chain(num_clusters);
-        if (first_cluster == 0) return -1; // Out of space
-        if (!write_data_to_clusters(first_cluster, data, size)) {
-            free_cluster_chain(first_cluster);
-            return -1; // Write error
+        first_cluster = co_await co_allocate_cluster_chain(num_clusters);
+        if (first_cluster == 0) co_return -1; // Out of space
+        if (!co_await co_write_data_to_clusters(first_cluster, data, size)) {
+            co_await co_free_cluster_chain(first_cluster);
+            co_return -1; // Write error
         }
     }
 
     uint8_t* dir_buf = new uint8_t[SECTOR_SIZE];
     for (uint8_t s = 0; s < bpb.sec_per_clus; s++) {
         uint64_t sector_lba = cluster_to_lba(current_directory_cluster) + s;
-        if (read_write_sectors(g_ahci_port, sector_lba, 1, false, dir_buf) != 0) continue;
+        if (co_await co_disk_io(g_fs_device, sector_lba, 1, false, dir_buf) != 0) continue;
 
         for (uint16_t e = 0; e < SECTOR_SIZE / sizeof(fat_dir_entry_t); e++) {
             fat_dir_entry_t* entry = (fat_dir_entry_t*)(dir_buf + e * sizeof(fat_dir_entry_t));
@@ -2007,45 +5486,53 @@ int fat32_write_file(const char* filename, const void* data, uint32_t size) {
                 entry->fst_clus_lo = first_cluster & 0xFFFF;
                 entry->fst_clus_hi = (first_cluster >> 16) & 0xFFFF;
                 
-                if (read_write_sectors(g_ahci_port, sector_lba, 1, true, dir_buf) == 0) {
+                if (co_await co_disk_io(g_fs_device, sector_lba, 1, true, dir_buf) == 0) {
                     delete[] dir_buf;
-                    return 0; // Success
+                    co_return 0; // Success
                 } else {
                     delete[] dir_buf;
-                    if(first_cluster > 0) free_cluster_chain(first_cluster);
-                    return -1; // Directory write error
+                    if(first_cluster > 0) co_await co_free_cluster_chain(first_cluster);
+                    co_return -1; // Directory write error
                 }
             }
         }
     }
 
     delete[] dir_buf;
-    if (first_cluster > 0) free_cluster_chain(first_cluster);
-    return -1; // Directory is full
+    if (first_cluster > 0) co_await co_free_cluster_chain(first_cluster);
+    co_return -1; // Directory is full
 }
 
-char* fat32_read_file_as_string(const char* filename) {
+int fat32_write_file(const char* filename, const void* data, uint32_t size) {
+    return sync_wait(co_fat32_write_file(filename, data, size));
+}
+
+static Task<char*> co_fat32_read_file_as_string(const char* filename) {
     char target[11]; to_83_format(filename, target);
     uint8_t* dir_buf = new uint8_t[SECTOR_SIZE];
     for (uint8_t s = 0; s < bpb.sec_per_clus; s++) {
-        if (read_write_sectors(g_ahci_port, cluster_to_lba(current_directory_cluster) + s, 1, false, dir_buf) != 0) { delete[] dir_buf; return nullptr; }
+        if (co_await co_disk_io(g_fs_device, cluster_to_lba(current_directory_cluster) + s, 1, false, dir_buf) != 0) { delete[] dir_buf; co_return nullptr; }
         for (uint16_t e = 0; e < SECTOR_SIZE / sizeof(fat_dir_entry_t); e++) {
             fat_dir_entry_t* entry = (fat_dir_entry_t*)(dir_buf + e * sizeof(fat_dir_entry_t));
-            if (entry->name[0] == 0x00) { delete[] dir_buf; return nullptr; }
+            if (entry->name[0] == 0x00) { delete[] dir_buf; co_return nullptr; }
             if (memcmp(entry->name, target, 11) == 0) {
                 uint32_t size = entry->file_size;
-                if(size == 0) { delete[] dir_buf; char* empty = new char[1]; empty[0] = '\0'; return empty; }
+                if(size == 0) { delete[] dir_buf; char* empty = new char[1]; empty[0] = '\0'; co_return empty; }
                 char* data = new char[size + 1];
-                if (read_data_from_clusters((entry->fst_clus_hi << 16) | entry->fst_clus_lo, data, size)) {
+                if (co_await co_read_data_from_clusters((entry->fst_clus_hi << 16) | entry->fst_clus_lo, data, size)) {
                     data[size] = '\0';
                     delete[] dir_buf;
-                    return data;
+                    co_return data;
                 }
-                delete[] data; delete[] dir_buf; return nullptr;
+                delete[] data; delete[] dir_buf; co_return nullptr;
             }
         }
     }
-    delete[] dir_buf; return nullptr;
+    delete[] dir_buf; co_return nullptr;
+}
+
+char* fat32_read_file_as_string(const char* filename) {
+    return sync_wait(co_fat32_read_file_as_string(filename));
 }
 
 int fat32_find_entry(const char* filename, fat_dir_entry_t* entry_out, uint32_t* sector_out, uint32_t* offset_out) {
@@ -2055,7 +5542,7 @@ int fat32_find_entry(const char* filename, fat_dir_entry_t* entry_out, uint32_t*
     uint8_t* dir_buf = new uint8_t[SECTOR_SIZE];
     for(uint8_t s=0; s<bpb.sec_per_clus; ++s) {
         uint32_t current_sector = cluster_to_lba(current_directory_cluster) + s;
-        if(read_write_sectors(g_ahci_port, current_sector, 1, false, dir_buf) != 0) { 
+        if(read_write_sectors(g_fs_device, current_sector, 1, false, dir_buf) != 0) { 
             delete[] dir_buf; 
             return -1; 
         }
@@ -2116,7 +5603,7 @@ int fat32_list_directory(const char* path, fat_dir_entry_t* buffer, int max_entr
     }
 
     uint8_t* dir_sector_buf = new uint8_t[bpb.sec_per_clus * SECTOR_SIZE];
-    if (read_write_sectors(g_ahci_port, cluster_to_lba(current_directory_cluster), bpb.sec_per_clus, false, dir_sector_buf) != 0) {
+    if (read_write_sectors(g_fs_device, cluster_to_lba(current_directory_cluster), bpb.sec_per_clus, false, dir_sector_buf) != 0) {
         delete[] dir_sector_buf;
         return 0; // Read error
     }
@@ -2139,19 +5626,25 @@ int fat32_list_directory(const char* path, fat_dir_entry_t* buffer, int max_entr
     delete[] dir_sector_buf;
     return count;
 }
-int fat32_remove_file(const char* filename) {
+// The directory lookup itself still blocks; the chain walk and the entry
+// update suspend.
+static Task<int> co_fat32_remove_file(const char* filename) {
     fat_dir_entry_t entry;
     uint32_t sector, offset;
-    if(fat32_find_entry(filename, &entry, &sector, &offset) != 0) return -1;
+    if(fat32_find_entry(filename, &entry, &sector, &offset) != 0) co_return -1;
     uint32_t start_cluster = (entry.fst_clus_hi << 16) | entry.fst_clus_lo;
-    if(start_cluster != 0) free_cluster_chain(start_cluster);
+    if(start_cluster != 0) co_await co_free_cluster_chain(start_cluster);
     
     uint8_t* dir_buf = new uint8_t[SECTOR_SIZE];
-    read_write_sectors(g_ahci_port, sector, 1, false, dir_buf);
+    co_await co_disk_io(g_fs_device, sector, 1, false, dir_buf);
     ((fat_dir_entry_t*)(dir_buf + offset))->name[0] = DELETED_ENTRY;
-    read_write_sectors(g_ahci_port, sector, 1, true, dir_buf);
+    co_await co_disk_io(g_fs_device, sector, 1, true, dir_buf);
     delete[] dir_buf;
-    return 0;
+    co_return 0;
+}
+
+int fat32_remove_file(const char* filename) {
+    return sync_wait(co_fat32_remove_file(filename));
 }
 // ADD THIS NEW FUNCTION after fat32_rename_file
 int fat32_copy_file(const char* src_path, const char* dest_path) {
@@ -2204,7 +5697,7 @@ int fat32_rename_file(const char* old_name, const char* new_name) {
     
     // 3. Read, modify, and write back the directory sector.
     uint8_t* dir_buf = new uint8_t[SECTOR_SIZE];
-    if (read_write_sectors(g_ahci_port, sector, 1, false, dir_buf) != 0) {
+    if (read_write_sectors(g_fs_device, sector, 1, false, dir_buf) != 0) {
         delete[] dir_buf;
         return -1;
     }
@@ -2212,7 +5705,7 @@ int fat32_rename_file(const char* old_name, const char* new_name) {
     fat_dir_entry_t* target_entry = (fat_dir_entry_t*)(dir_buf + offset);
     to_83_format(new_name, target_entry->name);
     
-    if (read_write_sectors(g_ahci_port, sector, 1, true, dir_buf) != 0) {
+    if (read_write_sectors(g_fs_device, sector, 1, true, dir_buf) != 0) {
         delete[] dir_buf;
         return -1;
     }
@@ -2220,27 +5713,44 @@ int fat32_rename_file(const char* old_name, const char* new_name) {
     delete[] dir_buf;
     return 0; // Success
 }
+// Lays a fresh FAT32 volume over the whole of g_fs_device. Cluster size
+// follows Microsoft's FAT32 table; tot_sec32 caps the volume at 2 TiB.
 void fat32_format() {
-    if(!ahci_base) {
+    if(!ahci_base || g_fs_device < 0) {
         wm.print_to_focused("AHCI disk not found. Cannot format.\n");
         return;
     }
-    wm.print_to_focused("WARNING: This is a destructive operation!\nFormatting disk...\n");
+    // Below this even one-sector clusters fall short of FAT32's 65525.
+    const uint32_t FAT32_MIN_SECTORS = 66600;
+    uint64_t device_sectors = g_block_devices[g_fs_device].sectors;
+    if (device_sectors < FAT32_MIN_SECTORS) {
+        wm.print_to_focused("Disk too small for FAT32 (needs at least 33 MiB).\n");
+        return;
+    }
+    uint32_t total_sectors = device_sectors > 0xFFFFFFFFull ? 0xFFFFFFFFu : (uint32_t)device_sectors;
+    uint8_t sec_per_clus = total_sectors <= 532480 ? 1 : total_sectors <= 16777216 ? 8 :
+                           total_sectors <= 33554432 ? 16 : total_sectors <= 67108864 ? 32 : 64;
+
+    char msg[96];
+    snprintf(msg, 96, "WARNING: This is a destructive operation!\nFormatting disk%d: %d MiB, %d sectors per cluster...\n",
+             g_fs_device, (int)(total_sectors >> 11), (int)sec_per_clus);
+    wm.print_to_focused(msg);
 
     fat32_bpb_t new_bpb;
     memset(&new_bpb, 0, sizeof(fat32_bpb_t));
     new_bpb.jmp[0] = 0xEB; new_bpb.jmp[1] = 0x58; new_bpb.jmp[2] = 0x90;
     memcpy(new_bpb.oem, "MYOS    ", 8);
     new_bpb.bytes_per_sec = 512;
-    new_bpb.sec_per_clus = 8;
+    new_bpb.sec_per_clus = sec_per_clus;
     new_bpb.rsvd_sec_cnt = 32;
     new_bpb.num_fats = 2;
     new_bpb.media = 0xF8;
     new_bpb.sec_per_trk = 32;
     new_bpb.num_heads = 64;
-    uint32_t total_sectors = (128 * 1024 * 1024) / 512;
     new_bpb.tot_sec32 = total_sectors;
-    new_bpb.fat_sz32 = (total_sectors * 2) / (new_bpb.sec_per_clus + 512) + 1;
+    // fatgen103's sizing: four bytes per cluster, rounded up, never short.
+    uint32_t fat_div = (256u * sec_per_clus + new_bpb.num_fats) / 2;
+    new_bpb.fat_sz32 = (uint32_t)u64_div32((uint64_t)(total_sectors - new_bpb.rsvd_sec_cnt) + fat_div - 1, fat_div);
     new_bpb.root_clus = 2;
     new_bpb.fs_info = 1;
     new_bpb.bk_boot_sec = 6;
@@ -2259,7 +5769,7 @@ void fat32_format() {
 	
 	boot_sector_buffer[510] = 0x00; //dummy boot for testing
     boot_sector_buffer[511] = 0x00; //dummy boot for testing
-    if (read_write_sectors(g_ahci_port, 0, 1, true, boot_sector_buffer) != 0) {
+    if (read_write_sectors(g_fs_device, 0, 1, true, boot_sector_buffer) != 0) {
         wm.print_to_focused("Error: Failed to write new boot sector.\n");
         delete[] boot_sector_buffer;
         return;
@@ -2270,24 +5780,35 @@ void fat32_format() {
     fat_start_sector = bpb.rsvd_sec_cnt;
     data_start_sector = fat_start_sector + (bpb.num_fats * bpb.fat_sz32);
 
-    uint8_t* zero_sector = new uint8_t[SECTOR_SIZE];
-    memset(zero_sector, 0, SECTOR_SIZE);
+    // The FATs grow with the disk, so they are zeroed a chunk at a time; the
+    // largest cluster fits in one chunk.
+    const uint16_t ZERO_CHUNK = 64;
+    uint8_t* zero_chunk = new uint8_t[ZERO_CHUNK * SECTOR_SIZE];
+    memset(zero_chunk, 0, ZERO_CHUNK * SECTOR_SIZE);
     wm.print_to_focused("Clearing FATs...\n");
-    for (uint32_t i = 0; i < bpb.fat_sz32; ++i) {
-        read_write_sectors(g_ahci_port, fat_start_sector + i, 1, true, zero_sector); // FAT1
-        read_write_sectors(g_ahci_port, fat_start_sector + bpb.fat_sz32 + i, 1, true, zero_sector); // FAT2
-    }
-
-    wm.print_to_focused("Clearing root directory...\n");
-    for (uint8_t i = 0; i < bpb.sec_per_clus; ++i) {
-        read_write_sectors(g_ahci_port, cluster_to_lba(bpb.root_clus) + i, 1, true, zero_sector);
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < bpb.fat_sz32; i += ZERO_CHUNK) {
+        uint16_t n = (bpb.fat_sz32 - i < ZERO_CHUNK) ? (uint16_t)(bpb.fat_sz32 - i) : ZERO_CHUNK;
+        ok = read_write_sectors(g_fs_device, fat_start_sector + i, n, true, zero_chunk) == 0 &&                  // FAT1
+             read_write_sectors(g_fs_device, fat_start_sector + bpb.fat_sz32 + i, n, true, zero_chunk) == 0;    // FAT2
+    }
+    if (ok) {
+        wm.print_to_focused("Clearing root directory...\n");
+        ok = read_write_sectors(g_fs_device, cluster_to_lba(bpb.root_clus), bpb.sec_per_clus, true, zero_chunk) == 0;
+    }
+    delete[] zero_chunk;
+
+    if (ok) {
+        wm.print_to_focused("Writing initial FAT entries...\n");
+        ok = write_fat_entry(0, 0x0FFFFFF8) &&              // Media descriptor
+             write_fat_entry(1, 0x0FFFFFFF) &&              // Reserved, EOC
+             write_fat_entry(bpb.root_clus, 0x0FFFFFFF);    // Root directory cluster EOC
+    }
+    if (!ok) {
+        wm.print_to_focused("Error: Format failed writing the disk; the volume is unusable until formatted again.\n");
+        current_directory_cluster = 0;
+        return;
     }
-    delete[] zero_sector;
-
-    wm.print_to_focused("Writing initial FAT entries...\n");
-    write_fat_entry(0, 0x0FFFFFF8); // Media descriptor
-    write_fat_entry(1, 0x0FFFFFFF); // Reserved, EOC
-    write_fat_entry(bpb.root_clus, 0x0FFFFFFF); // Root directory cluster EOC
 
     wm.print_to_focused("Format complete. Re-initializing filesystem...\n");
     if (fat32_init()) {
@@ -2312,8 +5833,13 @@ public:
         refresh_contents();
     }
 
+    // While a job holds the filesystem the listing is retried from the timer.
     void refresh_contents() {
+        if (!fs_try_begin()) { if (!timer_period) set_timer(100); return; }
         num_files = fat32_list_directory(current_path, file_list, 128);
+        fs_end();
+        if (timer_period) set_timer(0);
+        invalidate();
     }
 
     void draw() override {
@@ -2337,6 +5863,8 @@ public:
         for (int i = 0; i < h; i++) put_pixel_back(x, y + i, WINDOW_BORDER);
         for (int i = 0; i < h; i++) put_pixel_back(x + w - 1, y + i, WINDOW_BORDER);
 
+        if (timer_period) draw_string("Waiting for filesystem...", x + 5, y + h - 12, TEXT_BLACK);
+
         // Draw file list
         int max_visible_items = (h - 35) / 10;
         for (int i = 0; i < max_visible_items; ++i) {
@@ -2388,8 +5916,8 @@ void on_mouse_right_click(int mx, int my) {
             selected_index = clicked_idx;
             // Basic double-click simulation
             static int last_click_idx = -1;
-            static uint32_t last_click_tick = 0;
-            if(clicked_idx == last_click_idx && (g_timer_ticks - last_click_tick) < 20) {
+            static uint64_t last_click_ms = 0;
+            if(clicked_idx == last_click_idx && (now_ms() - last_click_ms) < DOUBLE_CLICK_MS) {
                 // Double click!
                 char filename[13];
                 fat32_get_fne_from_entry(&file_list[clicked_idx], filename);
@@ -2406,11 +5934,11 @@ void on_mouse_right_click(int mx, int my) {
                 // Handle opening file/dir (can be expanded for directories later)
             }
             last_click_idx = clicked_idx;
-            last_click_tick = g_timer_ticks;
+            last_click_ms = now_ms();
         }
     }
 
-    void update() override {}
+    void update() override { if (timer_period) refresh_contents(); }
 };
 // ==================== CHKDSK IMPLEMENTATION ====================
 
@@ -2552,7 +6080,7 @@ bool scan_directory(uint32_t cluster, ChkdskStats& stats, bool fix, int depth =
     stats.directories_checked++;
     
     uint8_t* buffer = new uint8_t[bpb.sec_per_clus * SECTOR_SIZE];
-    if (read_write_sectors(g_ahci_port, cluster_to_lba(cluster), bpb.sec_per_clus, false, buffer) != 0) {
+    if (read_write_sectors(g_fs_device, cluster_to_lba(cluster), bpb.sec_per_clus, false, buffer) != 0) {
         wm.print_to_focused("ERROR: Cannot read directory cluster");
         delete[] buffer;
         return false;
@@ -2607,7 +6135,7 @@ bool scan_directory(uint32_t cluster, ChkdskStats& stats, bool fix, int depth =
     
     // ONLY write back if in fix mode AND something was modified
     if (fix && modified && working_buffer) {
-        read_write_sectors(g_ahci_port, cluster_to_lba(cluster), bpb.sec_per_clus, true, working_buffer);
+        read_write_sectors(g_fs_device, cluster_to_lba(cluster), bpb.sec_per_clus, true, working_buffer);
     }
     
     delete[] buffer;
@@ -2660,8 +6188,8 @@ bool check_fat_consistency(ChkdskStats& stats, bool fix) {
     uint8_t* fat1 = new uint8_t[fat_size];
     uint8_t* fat2 = new uint8_t[fat_size];
     
-    read_write_sectors(g_ahci_port, fat_start_sector, bpb.fat_sz32, false, fat1);
-    read_write_sectors(g_ahci_port, fat_start_sector + bpb.fat_sz32, bpb.fat_sz32, false, fat2);
+    read_write_sectors(g_fs_device, fat_start_sector, bpb.fat_sz32, false, fat1);
+    read_write_sectors(g_fs_device, fat_start_sector + bpb.fat_sz32, bpb.fat_sz32, false, fat2);
     
     bool mismatch = false;
     for (uint32_t i = 0; i < fat_size; i++) {
@@ -2677,7 +6205,7 @@ bool check_fat_consistency(ChkdskStats& stats, bool fix) {
         
         if (fix) {
             wm.print_to_focused("FIXING: Copying FAT1 to FAT2...");
-            read_write_sectors(g_ahci_port, fat_start_sector + bpb.fat_sz32, bpb.fat_sz32, true, fat1);
+            read_write_sectors(g_fs_device, fat_start_sector + bpb.fat_sz32, bpb.fat_sz32, true, fat1);
             stats.errors_fixed++;
             wm.print_to_focused("FIXED: FAT tables synchronized");
         }
@@ -2844,12 +6372,26 @@ void chkdsk_full_scan(bool fix = false) {
     wm.print_to_focused("\n=== Phase 5: Scanning for bad sectors ===");
     wm.print_to_focused("This may take several minutes...");
     
-    uint8_t* test_buffer = new uint8_t[SECTOR_SIZE];
+    // One request per sector, so a failure names its sector, and a window
+    // of them in flight at a time.
+    const int window = 32;
+    uint8_t* test_buffer = new uint8_t[window * SECTOR_SIZE];
+    DiskRequest requests[window];
     uint32_t bad_sectors = 0;
     uint32_t total_sectors = bpb.tot_sec32;
     
     for (uint32_t sector = 0; sector < total_sectors; sector += 1) {
-        if (read_write_sectors(g_ahci_port, sector, 1, false, test_buffer) != 0) {
+        int i = sector % window;
+        if (i == 0) {
+            int n = (total_sectors - sector < (uint32_t)window) ? total_sectors - sector : window;
+            for (int k = 0; k < n; k++) {
+                requests[k] = {};
+                requests[k].device = g_fs_device; requests[k].lba = sector + k; requests[k].count = 1;
+                requests[k].buffer = test_buffer + k * SECTOR_SIZE;
+            }
+            disk_io_all(requests, n);
+        }
+        if (requests[i].status != 0) {
             bad_sectors++;
             
             char msg[80];
@@ -2988,8 +6530,152 @@ void vga_print(const char* str) {
     }
 }
 
+// =============================================================================
+// BACKGROUND JOBS
+// =============================================================================
+// Slow terminal commands (chkdsk, formatfs, cp, compile) run on background
+// threads so the desktop keeps rendering. Jobs never touch window state:
+// console output from any thread but the UI thread is queued here as
+// NUL-terminated messages, and the main loop prints them. A job holds
+// g_fs_lock from start to finish; the terminal refuses its other filesystem
+// commands while it is held rather than blocking the desktop behind it, but
+// further jobs queue on the lock. Copies and compiles, which the user
+// usually waits on before going on, run at PRIO_INTERACTIVE and so take the
+// lock ahead of queued scans and formats.
+char* get_arg(char* args, int n);
+void console_print(const char* str);
+
+static SpscRing<char, 8192> g_job_output;   // producers serialize on the lock
+static Spinlock g_job_output_lock;
+
+struct Job {
+    char command[16];
+    char args[120];
+};
+
+// True if the text was queued for the UI thread instead of printed.
+// APs (running VMs) queue here too; they spin while the ring is full.
+static bool job_output_redirect(const char* s) {
+    bool ap = smp_on_ap();
+    if (!ap && (!g_current || g_current == g_ui_thread)) return false;
+    uint32_t flags = g_job_output_lock.lock();
+    for (const char* p = s; ; p++) {
+        while (!g_job_output.push(*p)) {
+            g_job_output_lock.unlock(flags);
+            if (ap) {
+                smp_wake(0);
+                udelay(100);
+            } else {
+                thread_notify_ui();
+                thread_sleep_ms(1);
+            }
+            flags = g_job_output_lock.lock();
+        }
+        if (!*p) break;
+    }
+    g_job_output_lock.unlock(flags);
+    if (ap) {
+        smp_wake(0);
+        return true;
+    }
+    thread_notify_ui();
+    thread_preempt_check();
+    return true;
+}
+
+// UI thread: prints whatever the jobs have queued, one message at a time.
+static void job_output_drain() {
+    static char msg[256];
+    static int len = 0;
+    char c;
+    while (g_job_output.pop(&c)) {
+        if (c && len < (int)sizeof(msg) - 1) {
+            msg[len++] = c;
+            continue;
+        }
+        msg[len] = '\0';
+        console_print(msg);
+        len = 0;
+        if (c) msg[len++] = c;
+    }
+}
+
+static void job_copy(char* args) {
+    char args_for_src[120];
+    strncpy(args_for_src, args, 119);
+    args_for_src[119] = '\0';
+    char* src = get_arg(args_for_src, 0);
+
+    char args_for_dest[120];
+    strncpy(args_for_dest, args, 119);
+    args_for_dest[119] = '\0';
+    char* dest = get_arg(args_for_dest, 1);
+
+    if (!src || !dest) {
+        console_print("Usage: cp \"<source>\" \"<dest>\"\n");
+        return;
+    }
+    fat_dir_entry_t entry;
+    uint32_t sector, offset;
+    if (fat32_find_entry(src, &entry, &sector, &offset) != 0) {
+        console_print("Source not found.\n");
+        return;
+    }
+    char* content = new char[entry.file_size];
+    if (content && read_data_from_clusters((entry.fst_clus_hi << 16) | entry.fst_clus_lo, content, entry.file_size)) {
+        console_print(fat32_write_file(dest, content, entry.file_size) == 0 ? "Copied.\n" : "Write failed.\n");
+    } else {
+        console_print("Read failed.\n");
+    }
+    if (content) delete[] content;
+}
+
+static void job_chkdsk(const char* args) {
+    bool fix = strstr(args, "/f") || strstr(args, "/F");
+    bool fullscan = strstr(args, "/r") || strstr(args, "/R");
+    chkdsk(fix || fullscan, true);
+    if (fullscan) chkdsk_full_scan(true);
+}
+
+static void job_main(void* arg) {
+    Job* job = (Job*)arg;
+    g_fs_lock.lock();
+    if (strcmp(job->command, "chkdsk") == 0) job_chkdsk(job->args);
+    else if (strcmp(job->command, "formatfs") == 0) fat32_format();
+    else if (strcmp(job->command, "cp") == 0) job_copy(job->args);
+    else if (strcmp(job->command, "compile") == 0) cmd_compile(ahci_base, 0, get_arg(job->args, 0));
+    g_fs_lock.unlock();
+    char msg[48];
+    snprintf(msg, 48, "[%s finished]\n", job->command);
+    console_print(msg);
+    delete job;
+}
+
+static uint8_t job_priority(const char* command) {
+    return (strcmp(command, "cp") == 0 || strcmp(command, "compile") == 0) ? PRIO_INTERACTIVE : PRIO_BACKGROUND;
+}
+
+static bool is_job_command(const char* command) {
+    return strcmp(command, "chkdsk") == 0 || strcmp(command, "formatfs") == 0 ||
+           strcmp(command, "cp") == 0 || strcmp(command, "compile") == 0;
+}
+
+static bool job_start(const char* command, const char* args) {
+    Job* job = new Job;
+    if (!job) return false;
+    strncpy(job->command, command, sizeof(job->command) - 1);
+    job->command[sizeof(job->command) - 1] = '\0';
+    strncpy(job->args, args, sizeof(job->args) - 1);
+    job->args[sizeof(job->args) - 1] = '\0';
+    if (thread_create(job->command, job_main, job, job_priority(job->command))) return true;
+    delete job;
+    return false;
+}
+
 // Route to window if available, otherwise VGA
 void console_print_char(char c) {
+    char text[2] = {c, 0};
+    if (job_output_redirect(text)) return;
     int num_wins = wm.get_num_windows();
     int focused = wm.get_focused_idx();
     if (num_wins > 0 && focused >= 0 && focused < num_wins) {
@@ -3004,7 +6690,7 @@ void console_print_char(char c) {
 }
 
 void console_print(const char* str) {
-    if (!str) return;
+    if (!str || job_output_redirect(str)) return;
     int num_wins = wm.get_num_windows();
     int focused = wm.get_focused_idx();
     if (num_wins > 0 && focused >= 0 && focused < num_wins) {
@@ -3030,9 +6716,10 @@ char get_char() {
 
     // Non-blocking read from keyboard
     while (1) {
-        uint8_t status = inb(0x64);
-        if (status & 0x01) { // Data available
-            uint8_t scancode = inb(0x60);
+        InputEvent ev;
+        if (g_input_queue.pop(&ev)) { // Data available
+            if (ev.type != INPUT_KEY || !ev.down) continue;
+            uint8_t scancode = ev.scancode;
 
             // Simple scancode to ASCII conversion (US keyboard layout)
             static const char scancode_map[] = {
@@ -3458,7 +7145,10 @@ enum TOp : unsigned char {
     T_MMIO_WRITE32,       // (address, value) -> success
     T_MMIO_WRITE64,       // (address, low32, high32) -> success
     T_GET_HARDWARE_ARRAY, // () -> hardware_device_array_handle
-    T_DISPLAY_MEMORY_MAP // () -> displays formatted memory map
+    T_DISPLAY_MEMORY_MAP, // () -> displays formatted memory map
+
+    // Scheduling
+    T_SLEEP               // (ms) -> 0; parks the VM on a kernel timer
 };
 
 // ============================================================
@@ -3560,7 +7250,7 @@ struct TLex {
                           "array_size","array_resize","str_length","str_substr","int_to_str","str_compare",
                           "str_find_char","str_find_str","str_find_last_char","str_contains",
                           "str_starts_with","str_ends_with","str_count_char","str_replace_char",
-                          "scan_hardware","get_device_info","get_hardware_array","display_memory_map",
+                          "scan_hardware","get_device_info","get_hardware_array","display_memory_map","sleep",
                           "mmio_read8","mmio_read16","mmio_read32","mmio_read64",
                           "mmio_write8","mmio_write16","mmio_write32","mmio_write64",0};
         for(int k=0; kw[k]; ++k){ if(simple_strcmp(t.v,kw[k])==0){ t.t=TT_KW; break; } }
@@ -3692,6 +7382,9 @@ struct TCompiler {
         if(tk.t==TT_KW && simple_strcmp(tk.v,"display_memory_map")==0){
             adv(); expect("("); expect(")"); pr.emit1(T_DISPLAY_MEMORY_MAP); return;
         }
+        if(tk.t==TT_KW && simple_strcmp(tk.v,"sleep")==0){
+            adv(); expect("("); parse_expression(); expect(")"); pr.emit1(T_SLEEP); return;
+        }
 
         // NEW: Memory-Mapped I/O Functions
         if(tk.t==TT_KW && simple_strcmp(tk.v,"mmio_read8")==0){
@@ -4023,6 +7716,17 @@ struct TCompiler {
 // ============================================================
 // MODIFIED TinyVM FOR PARTIAL COMPUTING
 // ============================================================
+struct TinyVM;
+enum VmFileOp { VM_FILE_READ, VM_FILE_WRITE, VM_FILE_APPEND };
+static Task<void> vm_file_io(TinyVM* vm, uint32_t generation, VmFileOp op, char* path, char* data);
+
+static char* heap_strdup(const char* s) {
+    size_t n = strlen(s);
+    char* copy = new char[n + 1];
+    memcpy(copy, s, n + 1);
+    return copy;
+}
+
 struct TinyVM {
     static const int STK_MAX = 1024;
     int   stk[STK_MAX]; int sp=0;
@@ -4042,6 +7746,12 @@ struct TinyVM {
 	// --- NEW: ASYNC INPUT STATE ---
 	Window* bound_window = nullptr;   // instead of int bound_window_idx
     bool waiting_for_input = false;
+    volatile bool sleeping = false;   // parked by sleep(); see T_SLEEP
+    KTimer sleep_timer;
+    volatile bool io_pending = false; // parked on a file built-in; see vm_file_io
+    uint32_t io_generation = 0;       // bumped when the program is replaced or killed
+    volatile bool smp_owned = false;  // queued on or running on an AP
+    volatile bool needs_bsp = false;  // an AP stopped at an op only the BSP may run
     int  input_mode = 0;
     char input_buffer[256];
     int  input_pos = 0;
@@ -4132,6 +7842,8 @@ struct TinyVM {
         P=&prog; argc=ac; argv=av; ahci_base=base; port=p;
         sp=0; ip=0; is_running=true; exit_code=0;
         waiting_for_input = false; input_mode = 0; input_pos = 0;
+        cancel_sleep();
+        cancel_io();
         array_count = 0; hardware_array_handle = 0; string_pool_top = 0;
         for (int i=0;i<TProgram::LOC_MAX;i++) locals[i]=0;
 
@@ -4178,6 +7890,7 @@ struct TinyVM {
 				locals[pending_store_idx] = (int)str_in;
 			}
 			
+			asm volatile ("" ::: "memory");   // the result before the wakeup
 			waiting_for_input = false;
 			input_pos = 0;
 			input_mode = 0;
@@ -4197,11 +7910,16 @@ struct TinyVM {
 
 
 
+    static void sleep_expired(void* arg) { ((TinyVM*)arg)->sleeping = false; }
+    void cancel_sleep() { timer_cancel(&sleep_timer); sleeping = false; }
+    // Orphans any file built-in in flight; its result is dropped.
+    void cancel_io() { io_generation++; io_pending = false; }
+
     // --- NEW: TICK FUNCTION (Runs 'steps' instructions) ---
     // Returns: 1 if still running, 0 if finished
     int tick(int steps) {
         if (!is_running) return 0;
-        if (waiting_for_input) return 1; // Still running, just paused
+        if (waiting_for_input || sleeping || io_pending) return 1; // Still running, just paused
 
         int steps_done = 0;
         while(steps_done < steps && ip < P->pc && is_running){
@@ -4298,6 +8016,31 @@ struct TinyVM {
 					pending_store_idx = idx;
 					return 1;
 				} break;
+                case T_SLEEP: {
+                    if (smp_on_ap()) { ip--; needs_bsp = true; return 1; }   // timers are BSP-only
+                    int ms = pop();
+                    push(0);
+                    if (ms > 0) {
+                        sleeping = true;
+                        timer_arm(&sleep_timer, (uint32_t)ms, sleep_expired, this);
+                        return 1;
+                    }
+                } break;
+                case T_READ_FILE:
+                case T_WRITE_FILE:
+                case T_APPEND_FILE: {
+                    // Parks the program while vm_file_io() runs; it pushes
+                    // the result (the contents, or 0/-1) when it is done.
+                    if (smp_on_ap()) { ip--; needs_bsp = true; return 1; }
+                    const char* data = op == T_READ_FILE ? nullptr : (const char*)pop();
+                    const char* path = (const char*)pop();
+                    if (!path || !*path) { push(op == T_READ_FILE ? 0 : -1); break; }
+                    VmFileOp fop = op == T_READ_FILE ? VM_FILE_READ : op == T_WRITE_FILE ? VM_FILE_WRITE : VM_FILE_APPEND;
+                    io_pending = true;
+                    co_spawn(vm_file_io(this, io_generation, fop, heap_strdup(path), heap_strdup(data ? data : "")));
+                    return 1;
+                } break;
+
                 // CRITICAL CHANGE: RETURN HANDLING
                 case T_RET: { 
                     int rv=pop(); 
@@ -4319,6 +8062,54 @@ struct TinyVM {
         return 1; // Still running
     }
 };
+
+// Body of the file built-ins, run on g_coro_queue so the desktop keeps
+// drawing while the sectors move. Built-ins from different programs take
+// turns, and wait out background jobs. Results for a program that was
+// killed or restarted meanwhile are dropped.
+static Task<void> vm_file_io(TinyVM* vm, uint32_t generation, VmFileOp op, char* path, char* data) {
+    while (g_vm_file_io || !g_fs_lock.try_lock()) co_await co_sleep_ms(10);
+    g_vm_file_io = true;
+
+    int result = -1;
+    if (op == VM_FILE_READ) {
+        char* content = co_await co_fat32_read_file_as_string(path);
+        result = 0;
+        if (content && vm->io_generation == generation) {
+            int len = (int)strlen(content);
+            if (len > TinyVM::STRING_POOL_SIZE / 2) len = TinyVM::STRING_POOL_SIZE / 2;
+            char* dst = (char*)vm->alloc_string(len);
+            if (dst) { memcpy(dst, content, len); dst[len] = '\0'; result = (int)dst; }
+        }
+        delete[] content;
+    } else {
+        const char* out = data;
+        char* joined = nullptr;
+        if (op == VM_FILE_APPEND) {
+            char* old = co_await co_fat32_read_file_as_string(path);
+            if (old) {
+                size_t a = strlen(old), b = strlen(data);
+                joined = new char[a + b + 1];
+                memcpy(joined, old, a);
+                memcpy(joined + a, data, b + 1);
+                out = joined;
+                delete[] old;
+            }
+        }
+        result = co_await co_fat32_write_file(path, out, strlen(out));
+        delete[] joined;
+    }
+
+    g_vm_file_io = false;
+    g_fs_lock.unlock();
+    if (vm->io_generation == generation) {
+        vm->push(result);
+        asm volatile ("" ::: "memory");
+        vm->io_pending = false;
+    }
+    delete[] path;
+    delete[] data;
+}
 // --- GLOBAL VM STATE ---
 
 // --- GLOBAL PROCESS TABLE ---
@@ -4567,6 +8358,8 @@ void kill_run_process(int slot) {
     if (slot >= 0 && slot < MAX_RUN_PROCESSES && run_contexts[slot].active) {
         run_contexts[slot].active = false;
         run_contexts[slot].vm.is_running = false;
+        run_contexts[slot].vm.cancel_sleep();
+        run_contexts[slot].vm.cancel_io();
         wm.print_to_focused("RUN process killed.\n");
     } else {
         wm.print_to_focused("Invalid RUN slot.\n");
@@ -4578,6 +8371,8 @@ void kill_exec_process(int slot) {
     if (slot >= 0 && slot < MAX_EXEC_PROCESSES && exec_contexts[slot].active) {
         exec_contexts[slot].active = false;
         exec_contexts[slot].vm.is_running = false;
+        exec_contexts[slot].vm.cancel_sleep();
+        exec_contexts[slot].vm.cancel_io();
         wm.print_to_focused("EXEC process killed.\n");
     } else {
         wm.print_to_focused("Invalid EXEC slot.\n");
@@ -4597,6 +8392,74 @@ bool run_process_waiting_for_input() {
 }
 		
 	
+// =============================================================================
+// GRAPHICS BENCHMARK
+// =============================================================================
+// `gfxbench`: runs every pixel kernel over an off-screen 256x256 surface with
+// both the scalar and SSE2 tables and reports megapixels per second.
+static const int GFXBENCH_DIM = 256;
+static const int GFXBENCH_PASSES = 32;
+static const uint32_t GFXBENCH_KEY = 0xFF000000;
+
+static uint32_t gfxbench_run(const PixelKernels* k, int op, uint32_t* dst, const uint32_t* src) {
+    const int n = GFXBENCH_DIM * GFXBENCH_DIM;
+    CycleTimer timer;
+    timer.reset();
+    for (int pass = 0; pass < GFXBENCH_PASSES; pass++) {
+        switch (op) {
+            case 0: k->fill(dst, 0x00336699 + pass, n); break;
+            case 1: k->copy(dst, src, n); break;
+            case 2: k->copy_key(dst, src, n, GFXBENCH_KEY); break;
+            case 3: k->blend_const(dst, src, n, 160); break;
+            case 4: k->blend_alpha(dst, src, n); break;
+            case 5: k->fill_blend(dst, 0x00336699, n, 96); break;
+        }
+    }
+    uint32_t us = timer.us();
+    if (us == 0) us = 1;
+    // pixels per microsecond == MP/s; keep one decimal.
+    return (uint32_t)u64_div32((uint64_t)n * GFXBENCH_PASSES * 10, us);
+}
+
+void gfx_benchmark() {
+    static const char* op_names[] = { "fill", "copy", "copy_key", "blend_const", "blend_alpha", "fill_blend" };
+    const int n = GFXBENCH_DIM * GFXBENCH_DIM;
+    uint32_t* src = new uint32_t[n];
+    uint32_t* dst = new uint32_t[n];
+    if (!src || !dst) { delete[] src; delete[] dst; wm.print_to_focused("gfxbench: out of memory\n"); return; }
+
+    uint32_t seed = 0x12345678;
+    for (int i = 0; i < n; i++) {
+        seed = seed * 1103515245 + 12345;
+        src[i] = (i % 5 == 0) ? GFXBENCH_KEY : seed;
+        dst[i] = ~seed;
+    }
+
+    char line[96];
+    snprintf(line, sizeof(line), "gfxbench: %dx%d x%d, TSC %d MHz\n",
+             GFXBENCH_DIM, GFXBENCH_DIM, GFXBENCH_PASSES, (int)(tsc_calibrate_khz() / 1000));
+    wm.print_to_focused(line);
+    if (!g_cpu_has_sse2) wm.print_to_focused("SSE2 not available; scalar only.\n");
+
+    for (int op = 0; op < 6; op++) {
+        uint32_t scalar = gfxbench_run(&g_pix_scalar, op, dst, src);
+        if (g_cpu_has_sse2) {
+            uint32_t sse2 = gfxbench_run(&g_pix_sse2, op, dst, src);
+            uint32_t ratio = scalar ? (sse2 * 10) / scalar : 0;
+            snprintf(line, sizeof(line), "  %s: scalar %d.%d  sse2 %d.%d MP/s (x%d.%d)\n", op_names[op],
+                     (int)(scalar / 10), (int)(scalar % 10), (int)(sse2 / 10), (int)(sse2 % 10),
+                     (int)(ratio / 10), (int)(ratio % 10));
+        } else {
+            snprintf(line, sizeof(line), "  %s: scalar %d.%d MP/s\n", op_names[op],
+                     (int)(scalar / 10), (int)(scalar % 10));
+        }
+        wm.print_to_focused(line);
+    }
+
+    delete[] src;
+    delete[] dst;
+}
+
 // =============================================================================
 // TERMINAL WINDOW IMPLEMENTATION
 // =============================================================================
@@ -4620,6 +8483,7 @@ private:
     int edit_current_line;
     int edit_cursor_col;
     int edit_scroll_offset;
+    bool edit_save_refused;         // last save found the filesystem busy
 
     // Prompt visual state for multi-line input
     int prompt_visual_lines;
@@ -4627,8 +8491,10 @@ private:
 static constexpr int EDIT_ROWS = 35;       // rows visible in the editor area
 static constexpr int EDIT_COL_PIX = 8;     // font width
 static constexpr int EDIT_LINE_PIX = 10;   // line height
+static constexpr uint32_t EDITOR_BLINK_MS = 500; // cursor phase length, see draw()
 void put_char(char c) {
         if (in_editor) return; // Don't mess with editor
+        invalidate();
 
         // Ensure we have at least one line
         if (line_count == 0) {
@@ -5105,7 +8971,24 @@ void handle_command() {
         }
     }
 
-    if (strcmp(command, "help") == 0) { console_print("Commands: help, clear, killexec, killrun, ps, ls, edit, aesdec, aesenc, run, rm, cp, mv, formatfs, chkdsk ( /r /f), time, version\n"); }
+    if (is_job_command(command)) {
+        bool queued = g_vm_file_io || g_fs_lock.busy();
+        console_print(!job_start(command, args) ? "No free thread for the job.\n" :
+                      queued ? "Queued until the filesystem is free (see 'jobs').\n" : "Running in the background.\n");
+        if (!in_editor) print_prompt();
+        return;
+    }
+
+    bool uses_fs = strcmp(command, "ls") == 0 || strcmp(command, "edit") == 0 ||
+                   strcmp(command, "rm") == 0 || strcmp(command, "mv") == 0 || strcmp(command, "run") == 0 ||
+                   strcmp(command, "exec") == 0 || strcmp(command, "aesenc") == 0 || strcmp(command, "aesdec") == 0 ||
+                   strcmp(command, "mount") == 0;
+    if (uses_fs && !fs_try_begin()) {
+        console_print(g_vm_file_io ? "Filesystem busy with a program's file I/O.\n" : "Filesystem busy with a background job (see 'jobs').\n");
+        if (!in_editor) print_prompt();
+        return;
+    }
+    if (strcmp(command, "help") == 0) { console_print("Commands: help, clear, killexec, killrun, ps, jobs, ls, edit, aesdec, aesenc, compile, run, rm, cp, mv, formatfs, chkdsk ( /r /f), time, gfxbench, gfxmode, governor, irqs, uptime, bootprof, latency [reset], usb, ncq [off|depth], disks, stripe <disks>, mount <disk>, cpus, version\n"); }
         else if (strcmp(command, "aesenc") == 0 || strcmp(command, "aesdec") == 0) {
             bool encrypt = strcmp(command, "aesenc") == 0;
             char* key_hex = get_arg(args, 0);
@@ -5113,15 +8996,13 @@ void handle_command() {
             char* outfile = get_arg(args, 2);
             if (!key_hex || !infile || !outfile || strlen(key_hex) != 32) {
                 console_print(encrypt ? "Usage: aesenc <32hexkey> <in> <out>\n" : "Usage: aesdec <32hexkey> <in> <out>\n");
-                return;
+            } else {
+                bool ok = encrypt ? aes_encrypt_file(key_hex, infile, outfile) : aes_decrypt_file(key_hex, infile, outfile);
+                console_print(ok ? "AES operation successful.\n" : "AES failed.\n");
             }
-            bool ok = encrypt ? aes_encrypt_file(key_hex, infile, outfile) : aes_decrypt_file(key_hex, infile, outfile);
-            console_print(ok ? "AES operation successful.\n" : "AES failed.\n");
         }
 	
-	if (strcmp(command, "compile") == 0) {
-        cmd_compile(ahci_base, selected_port, get_arg(args, 0));
-    }  else if (strcmp(command, "run") == 0) {
+	if (strcmp(command, "run") == 0) {
         cmd_run(ahci_base, selected_port, get_arg(args, 0));
     }
     else if (strcmp(command, "exec") == 0) {
@@ -5145,6 +9026,8 @@ void handle_command() {
             strncpy(edit_filename, filename, 31);
             edit_filename[31] = '\0';
             in_editor = true;
+            edit_save_refused = false;
+            set_timer(EDITOR_BLINK_MS);
             edit_current_line = 0;
             edit_cursor_col = 0;
             edit_scroll_offset = 0;
@@ -5196,37 +9079,6 @@ void handle_command() {
             console_print("Usage: rm \"<filename>\"\n");
         }
     }
-    else if (strcmp(command, "cp") == 0) {
-        char args_for_src[120];
-        strncpy(args_for_src, args, 119);
-        char* src = get_arg(args_for_src, 0);
-
-        char args_for_dest[120];
-        strncpy(args_for_dest, args, 119);
-        char* dest = get_arg(args_for_dest, 1);
-        
-        if(!src || !dest) { 
-            console_print("Usage: cp \"<source>\" \"<dest>\"\n"); 
-        } else {
-            fat_dir_entry_t entry;
-            uint32_t sector, offset;
-            if (fat32_find_entry(src, &entry, &sector, &offset) == 0) {
-                char* content = new char[entry.file_size];
-                if (content && read_data_from_clusters((entry.fst_clus_hi << 16) | entry.fst_clus_lo, content, entry.file_size)) {
-                    if(fat32_write_file(dest, content, entry.file_size) == 0) {
-                        console_print("Copied.\n");
-                    } else {
-                        console_print("Write failed.\n");
-                    }
-                } else {
-                    console_print("Read failed.\n");
-                }
-                if (content) delete[] content;
-            } else {
-                console_print("Source not found.\n");
-            }
-        }
-    }
     else if (strcmp(command, "mv") == 0) {
         char args_for_src[120];
         strncpy(args_for_src, args, 119);
@@ -5239,37 +9091,12 @@ void handle_command() {
         if(!src || !dest) { 
             console_print("Usage: mv \"<source>\" \"<dest>\"\n"); 
         } else {
-            if(fat32_rename_file(src, dest) == 0) {
-                console_print("Moved.\n");
-            } else {
-                console_print("Failed. (Source not found or destination exists).\n");
-            }
-        }
-    }
-    else if (strcmp(command, "formatfs") == 0) { fat32_format(); }
-    else if (strcmp(command, "chkdsk") == 0) {
-        char* args_copy = new char[120];
-        strncpy(args_copy, args, 119);
-        args_copy[119] = '\0';
-        
-        bool fix = false;
-        bool fullscan = false;
-        
-        if (strstr(args_copy, "/f") || strstr(args_copy, "/F")) {
-            fix = true;
-        }
-        if (strstr(args_copy, "/r") || strstr(args_copy, "/R")) {
-            fix = true;
-            fullscan = true;
-        }
-        
-        chkdsk(fix, true);
-        
-        if (fullscan) {
-            chkdsk_full_scan(fix);
+            if(fat32_rename_file(src, dest) == 0) {
+                console_print("Moved.\n");
+            } else {
+                console_print("Failed. (Source not found or destination exists).\n");
+            }
         }
-        
-        delete[] args_copy;
     }
     else if (strcmp(command, "time") == 0) { 
         RTC_Time t = read_rtc(); 
@@ -5277,10 +9104,47 @@ void handle_command() {
         snprintf(buf, 64, "%d:%d:%d %d/%d/%d\n", t.hour, t.minute, t.second, t.day, t.month, t.year); 
         console_print(buf); 
     }
+    else if (strcmp(command, "gfxbench") == 0) { gfx_benchmark(); }
+    else if (strcmp(command, "governor") == 0) { governor_print_stats(); }
+    else if (strcmp(command, "irqs") == 0) { irq_print_stats(); }
+    else if (strcmp(command, "bootprof") == 0) { boot_print_profile(); }
+    else if (strcmp(command, "latency") == 0) { latency_command(args); }
+    else if (strcmp(command, "usb") == 0) { usb_print_devices(); }
+    else if (strcmp(command, "ncq") == 0) { ncq_command(args); }
+    else if (strcmp(command, "disks") == 0) { disks_command(); }
+    else if (strcmp(command, "stripe") == 0) { stripe_command(args); }
+    else if (strcmp(command, "mount") == 0) { mount_command(args); }
+    else if (strcmp(command, "jobs") == 0) { thread_print_stats(); }
+    else if (strcmp(command, "cpus") == 0) { smp_print_stats(); }
+    else if (strcmp(command, "uptime") == 0) {
+        uint32_t ms_rem;
+        uint64_t secs = u64_divmod32(now_ms(), 1000, &ms_rem);
+        char buf[128];
+        snprintf(buf, 128, "Up %d.%d%d%d s; TSC %d kHz (%s)\n", (int)secs,
+                 (int)(ms_rem / 100), (int)(ms_rem / 10 % 10), (int)(ms_rem % 10),
+                 (int)g_tsc_khz, g_tsc_invariant ? "invariant" : "not invariant");
+        console_print(buf);
+        snprintf(buf, 128, "Timers: %d pending, %d fired\n", (int)g_timers.pending, (int)g_timers.fired);
+        console_print(buf);
+    }
+    else if (strcmp(command, "gfxmode") == 0) {
+        int bpp = simple_atoi(args);
+        if (*args == '\0') {
+            char msg[96];
+            uint32_t copied, total;
+            present_get_stats(&copied, &total);
+            snprintf(msg, 96, "Render depth: %d bpp (framebuffer %d bpp), last present %d/%d tiles\n",
+                     (int)g_gfx.render_format().bpp, (int)g_gfx.pixel_format().bpp, (int)copied, (int)total);
+            console_print(msg);
+        } else if (!gfx_set_render_mode(bpp)) {
+            console_print("Usage: gfxmode [16|32]\n");
+        }
+    }
     else if (strcmp(command, "version") == 0) { console_print("RTOS++ v1.0 - Robust Parsing\n"); }
     else if (strlen(command) > 0) { 
         console_print("Unknown command.\n"); 
     }
+    if (uses_fs) fs_end();
     
     if(!in_editor) print_prompt();
 }
@@ -5290,7 +9154,7 @@ void handle_command() {
 public:
     TerminalWindow(int x, int y, const char* startup_command = nullptr) : Window(x, y, 640, 400, "Terminal"), line_count(0), line_pos(0), in_editor(false), 
         edit_lines(nullptr), edit_line_count(0), edit_current_line(0), edit_cursor_col(0), edit_scroll_offset(0),
-        prompt_visual_lines(0) {
+        edit_save_refused(false), prompt_visual_lines(0) {
         memset(buffer, 0, sizeof(buffer));
         current_line[0] = '\0';
         startup_command_buffer[0] = '\0'; // Ensure buffer is empty by default
@@ -5298,6 +9162,7 @@ public:
         if (startup_command) {
             // Save the command to be run on the first update cycle
             strncpy(startup_command_buffer, startup_command, 127);
+            request_update();
         }
         
         update_prompt_display(); // Show the initial prompt
@@ -5346,7 +9211,10 @@ public:
         }
     }
 
-    if ((g_timer_ticks / 15) % 2 == 0 && edit_current_line >= edit_scroll_offset &&
+    if (edit_save_refused)
+        draw_string("Filesystem busy; ESC saves once it is free.", x + 5, y + h - 12, ColorPalette::TEXT_WHITE);
+
+    if ((u64_div32(now_ms(), EDITOR_BLINK_MS) & 1) == 0 && edit_current_line >= edit_scroll_offset &&
         edit_current_line < edit_scroll_offset + EDIT_ROWS) {
         int visible_row = edit_current_line - edit_scroll_offset;
         int cursor_x = x + 5 + edit_cursor_col * EDIT_COL_PIX;
@@ -5364,12 +9232,15 @@ public:
         size_t current_len = strlen(current_line_ptr);
 
         if (c == 17 || c == 27) { // Ctrl+Q or ESC to save and exit
+            // A job or a program's file I/O owns the filesystem: stay in the
+            // editor, the user saves again once it is done.
+            if (!fs_try_begin()) { edit_save_refused = true; invalidate(); return; }
             int total_len = 0;
             for (int i = 0; i < edit_line_count; i++) {
                 total_len += strlen(edit_lines[i]) + 1;
             }
             char* file_content = new char[total_len + 1];
-            if (!file_content) return;
+            if (!file_content) { fs_end(); return; }
             file_content[0] = '\0';
             for (int i = 0; i < edit_line_count; i++) {
                 strcat(file_content, edit_lines[i]);
@@ -5378,8 +9249,10 @@ public:
                 }
             }
             fat32_write_file(edit_filename, file_content, strlen(file_content));
+            fs_end();
             delete[] file_content;
             in_editor = false;
+            set_timer(0);
             console_print("File saved.\n");
             return;
         } 
@@ -5534,6 +9407,9 @@ public:
 
      // --- THIS IS THE CORRECTED UPDATE METHOD ---
     void update() override {
+        // Editor cursor blink (EVT_TIMER)
+        if (in_editor) invalidate();
+
         // Check if there is a startup command waiting to be executed
         if (startup_command_buffer[0] != '\0') {
             // Copy the command to the current line to be processed
@@ -5555,6 +9431,7 @@ public:
 
     void console_print(const char* s) override {
         if (!s || in_editor) return;
+        invalidate();
 
         int saved_prompt_lines = prompt_visual_lines;
         if (saved_prompt_lines > 0) {
@@ -5569,6 +9446,7 @@ public:
 void WindowManager::execute_context_menu_action(int item_index) {
     if (item_index < 0 || item_index >= num_context_menu_items) return;
     const char* action = context_menu_items[item_index];
+    const char* fs_busy = g_vm_file_io ? "Filesystem busy with a program's file I/O.\n" : "Filesystem busy with a background job (see 'jobs').\n";
 
     if (current_context == CTX_DESKTOP) {
         if (strcmp(action, "File Explorer") == 0) {
@@ -5582,8 +9460,13 @@ void WindowManager::execute_context_menu_action(int item_index) {
                 char new_name[32] = "copy_of_";
                 strncat(new_name, filename, 22);
 
-                fat32_copy_file(src_path, new_name);
-                load_desktop_items();
+                if (!fs_try_begin()) {
+                    print_to_focused(fs_busy);
+                } else {
+                    fat32_copy_file(src_path, new_name);
+                    fs_end();
+                    load_desktop_items();
+                }
             }
         }
     }
@@ -5601,8 +9484,13 @@ void WindowManager::execute_context_menu_action(int item_index) {
         } else if (strcmp(action, "Copy") == 0) {
             strncpy(g_clipboard_buffer, item.path, 1023);
         } else if (strcmp(action, "Delete") == 0) {
-            fat32_remove_file(item.path);
-            load_desktop_items();
+            if (!fs_try_begin()) {
+                print_to_focused(fs_busy);
+            } else {
+                fat32_remove_file(item.path);
+                fs_end();
+                load_desktop_items();
+            }
         }
     }
     else if (current_context == CTX_EXPLORER_ITEM) {
@@ -5627,8 +9515,13 @@ void WindowManager::execute_context_menu_action(int item_index) {
 
             snprintf(shortcut_content, 128, "run %s", filename);
 
-            fat32_write_file(shortcut_name, shortcut_content, strlen(shortcut_content));
-            load_desktop_items();
+            if (!fs_try_begin()) {
+                print_to_focused(fs_busy);
+            } else {
+                fat32_write_file(shortcut_name, shortcut_content, strlen(shortcut_content));
+                fs_end();
+                load_desktop_items();
+            }
         } 
     }
 
@@ -5637,9 +9530,8 @@ void WindowManager::execute_context_menu_action(int item_index) {
 
 void WindowManager::handle_input(char key, int mx, int my, bool left_down, bool left_clicked, bool right_clicked) {
     // --- Static variables to track double-clicks ---
-    static uint32_t last_click_tick = 0;
+    static uint64_t last_click_ms = 0;
     static int last_click_icon_idx = -1;
-    const uint32_t DOUBLE_CLICK_SPEED = 20; // Ticks to wait for a double click
 
     // --- 1. Handle Context Menu Clicks ---
     if (context_menu_active && left_clicked) {
@@ -5672,8 +9564,12 @@ void WindowManager::handle_input(char key, int mx, int my, bool left_down, bool
     }
     if (dragging_icon_idx != -1) { // Dragging an icon
         if (left_down) {
-            desktop_items[dragging_icon_idx].x = mx - drag_offset_x;
-            desktop_items[dragging_icon_idx].y = my - drag_offset_y;
+            DesktopItem& item = desktop_items[dragging_icon_idx];
+            if (item.x != mx - drag_offset_x || item.y != my - drag_offset_y) {
+                item.x = mx - drag_offset_x;
+                item.y = my - drag_offset_y;
+                invalidate_desktop();
+            }
         } else {
             dragging_icon_idx = -1;
         }
@@ -5686,6 +9582,7 @@ void WindowManager::handle_input(char key, int mx, int my, bool left_down, bool
             Window* win = windows[focused_idx];
             if (mx >= win->x && mx < win->x + win->w && my >= win->y && my < win->y + win->h) {
                 win->on_mouse_right_click(mx, my);
+                win->invalidate();
                 return; // The window handled the click
             }
         }
@@ -5746,6 +9643,7 @@ void WindowManager::handle_input(char key, int mx, int my, bool left_down, bool
                     drag_offset_y = my - windows[dragging_idx]->y;
                 } else {
                     windows[i]->on_mouse_click(mx, my);
+                    windows[i]->invalidate();
                 }
                 return;
             }
@@ -5757,7 +9655,7 @@ void WindowManager::handle_input(char key, int mx, int my, bool left_down, bool
                 my >= desktop_items[i].y && my < desktop_items[i].y + 45) {
 
                 // Check for a double-click
-                if (last_click_icon_idx == i && (g_timer_ticks - last_click_tick) < DOUBLE_CLICK_SPEED) {
+                if (last_click_icon_idx == i && (now_ms() - last_click_ms) < DOUBLE_CLICK_MS) {
                     // Double-click detected!
                     DesktopItem& item = desktop_items[i]; // Use a reference for cleaner code
 
@@ -5772,7 +9670,7 @@ void WindowManager::handle_input(char key, int mx, int my, bool left_down, bool
 					}
                     
                     // Reset double-click tracking
-                    last_click_tick = 0;
+                    last_click_ms = 0;
                     last_click_icon_idx = -1;
                 } else {
                     // This is a first click, start dragging and set up for double-click
@@ -5780,7 +9678,7 @@ void WindowManager::handle_input(char key, int mx, int my, bool left_down, bool
                     drag_offset_x = mx - desktop_items[i].x;
                     drag_offset_y = my - desktop_items[i].y;
                     last_click_icon_idx = i;
-                    last_click_tick = g_timer_ticks;
+                    last_click_ms = now_ms();
                 }
                 return;
             }
@@ -5797,11 +9695,14 @@ void WindowManager::handle_input(char key, int mx, int my, bool left_down, bool
     }
 
     // --- 5. Handle Keyboard Input ---
-    if (key != 0 && focused_idx != -1 && focused_idx < num_windows)
+    if (key != 0 && focused_idx != -1 && focused_idx < num_windows) {
         windows[focused_idx]->on_key_press(key);
+        windows[focused_idx]->invalidate();
+    }
 }
 
 void WindowManager::print_to_focused(const char* s) {
+    if (job_output_redirect(s)) return;
     if (focused_idx != -1 && focused_idx < num_windows) 
         windows[focused_idx]->console_print(s);
 }
@@ -5821,19 +9722,150 @@ void launch_terminal_with_command(const char* command) {
     static int win_count = 0;
     wm.add_window(new TerminalWindow(150 + (win_count++ % 10) * 30, 90 + (win_count % 10) * 30, command));
 }
+// Channel (pos, size) of `p` widened to 8 bits by replicating its top bits.
+PIX_INLINE uint32_t unpack_channel8(uint32_t p, uint8_t pos, uint8_t size) {
+    if (size == 0) return 0;
+    uint32_t v = (p >> pos) & ((1u << size) - 1);
+    if (size >= 8) return v >> (size - 8);
+    return (v << (8 - size)) | (v >> (2 * size - 8 > 0 ? 2 * size - 8 : 0));
+}
+
+PIX_INLINE uint32_t pack_channel8(uint32_t v8, uint8_t pos, uint8_t size) {
+    if (size == 0) return 0;
+    return (size < 8 ? v8 >> (8 - size) : v8) << pos;
+}
+
+// Present path when the render format differs from the scanout format
+// (RGB565 rendering on a 32bpp framebuffer, or the reverse).
+PIX_KERNEL static void present_convert_row(void* dst, const void* src, int n,
+                                           const PixelFormat& from, const PixelFormat& to) {
+    for (int i = 0; i < n; i++) {
+        uint32_t p = (from.bpp == 16) ? ((const uint16_t*)src)[i] : ((const uint32_t*)src)[i];
+        uint32_t q = pack_channel8(unpack_channel8(p, from.red_pos, from.red_size), to.red_pos, to.red_size) |
+                     pack_channel8(unpack_channel8(p, from.green_pos, from.green_size), to.green_pos, to.green_size) |
+                     pack_channel8(unpack_channel8(p, from.blue_pos, from.blue_size), to.blue_pos, to.blue_size);
+        if (to.bpp == 16) ((uint16_t*)dst)[i] = (uint16_t)q;
+        else ((uint32_t*)dst)[i] = q;
+    }
+}
+
+// Copies (and converts, if needed) a rectangle of the backbuffer to the framebuffer.
+static void present_rect(int x, int y, int w, int h) {
+    uint32_t scan_bytes = g_gfx.pixel_format().bpp / 8;
+    bool same = g_gfx.render_is_scanout();
+    for (int row = y; row < y + h; row++) {
+        uint8_t* dst = (uint8_t*)fb_info.ptr + row * fb_info.pitch + x * scan_bytes;
+        const uint8_t* src = surface_at(backbuffer, fb_info.width, x, row);
+        if (same) span_copy(dst, src, w);
+        else present_convert_row(dst, src, w, g_gfx.render_format(), g_gfx.pixel_format());
+    }
+}
+
+// =============================================================================
+// TILE-HASH PARTIAL PRESENT
+// =============================================================================
+// Not every draw path reports damage, so the present finds it instead: the
+// screen is split into 64x64 tiles, each tile of the backbuffer is hashed
+// (reading RAM is far cheaper than writing the framebuffer) and only tiles
+// whose hash changed since the last present are copied out. A full present
+// happens on the first frame and whenever the tile grid or render depth
+// changes (present_invalidate_all()).
+static const int PRESENT_TILE = 64;
+
+struct PresentState {
+    uint32_t* tile_hash;
+    int tiles_x, tiles_y;
+    uint32_t render_bytes;
+    bool force_full;
+    uint32_t last_tiles_copied;
+};
+static PresentState g_present = { nullptr, 0, 0, 0, true, 0 };
+
+void present_invalidate_all() { g_present.force_full = true; }
+
+void present_get_stats(uint32_t* tiles_copied, uint32_t* tiles_total) {
+    *tiles_copied = g_present.last_tiles_copied;
+    *tiles_total = g_present.tiles_x * g_present.tiles_y;
+}
+
+static uint32_t present_tile_hash(int x, int y, int w, int h) {
+    uint32_t row_bytes = w * g_render_bytes;
+    uint32_t h32 = 0x811C9DC5;
+    for (int row = y; row < y + h; row++) {
+        const uint8_t* p = surface_at(backbuffer, fb_info.width, x, row);
+        h32 = g_pix->hash((const uint32_t*)p, row_bytes / 4, h32);
+        if (row_bytes & 2) h32 = h32 * 31 + *(const uint16_t*)(p + row_bytes - 2);
+    }
+    return h32;
+}
+
 void swap_buffers() {
-    if (fb_info.ptr && backbuffer) {
-        uint32_t* dest = fb_info.ptr;
-        uint32_t* src = backbuffer;
-        size_t count = fb_info.width * fb_info.height;
-
-        asm volatile (
-            "rep movsl"
-            : "=S"(src), "=D"(dest), "=c"(count)
-            : "S"(src), "D"(dest), "c"(count)
-            : "memory"
-        );
+    if (!fb_info.ptr || !backbuffer) return;
+
+    int tx = (fb_info.width + PRESENT_TILE - 1) / PRESENT_TILE;
+    int ty = (fb_info.height + PRESENT_TILE - 1) / PRESENT_TILE;
+    if (!g_present.tile_hash || g_present.tiles_x != tx || g_present.tiles_y != ty ||
+        g_present.render_bytes != g_render_bytes) {
+        delete[] g_present.tile_hash;
+        g_present.tile_hash = new uint32_t[tx * ty];
+        g_present.tiles_x = tx;
+        g_present.tiles_y = ty;
+        g_present.render_bytes = g_render_bytes;
+        g_present.force_full = true;
+    }
+
+    bool full = g_present.force_full || !g_present.tile_hash;
+    if (full && g_gfx.render_is_scanout() && fb_info.pitch == fb_info.width * g_render_bytes) {
+        g_pix->copy(fb_info.ptr, backbuffer, surface_words(fb_info.width, fb_info.height));
+    } else if (full) {
+        present_rect(0, 0, fb_info.width, fb_info.height);
+    }
+
+    uint32_t copied = 0;
+    for (int j = 0; j < ty && g_present.tile_hash; j++) {
+        int y = j * PRESENT_TILE;
+        int h = (y + PRESENT_TILE <= (int)fb_info.height) ? PRESENT_TILE : fb_info.height - y;
+        for (int i = 0; i < tx; i++) {
+            int x = i * PRESENT_TILE;
+            int w = (x + PRESENT_TILE <= (int)fb_info.width) ? PRESENT_TILE : fb_info.width - x;
+            uint32_t hash = present_tile_hash(x, y, w, h);
+            uint32_t& slot = g_present.tile_hash[j * tx + i];
+            if (full || slot != hash) {
+                if (!full) present_rect(x, y, w, h);
+                slot = hash;
+                copied++;
+            }
+        }
+    }
+
+    g_present.force_full = false;
+    g_present.last_tiles_copied = copied;
+}
+
+// Switches the backbuffer between 32bpp and RGB565 at runtime: reallocates it,
+// re-bakes the palette and icon sprites, drops the cached desktop layer and
+// has every display list recorded again in the new format.
+bool gfx_set_render_mode(int bpp) {
+    if (!fb_info.ptr) return false;
+    uint32_t old_bytes = g_render_bytes;
+    if (!g_gfx.set_render_bpp(bpp)) return false;
+
+    uint32_t* fresh = new uint32_t[surface_words(fb_info.width, fb_info.height)];
+    if (!fresh) {
+        g_gfx.set_render_bpp(old_bytes * 8);
+        return false;
     }
+    delete[] backbuffer;
+    backbuffer = fresh;
+
+    bake_native_palette();
+    bake_icon_sprites();
+    wm.invalidate_desktop();
+    wm.rerecord_all();
+    present_invalidate_all();
+    g_gfx.clear_screen(ColorPalette::DESKTOP_BLUE);
+    mark_screen_dirty();
+    return true;
 }
 
 static volatile bool g_evt_timer = false;
@@ -5842,15 +9874,149 @@ static volatile bool g_evt_dirty = true;
 // This is now defined before TerminalWindow to resolve the dependency
 // static volatile uint32_t g_timer_ticks = 0;
 
-extern "C" void idle_signal_timer() { g_evt_timer = true; g_timer_ticks++; }
-extern "C" void idle_signal_input() { g_evt_input = true; }
+extern "C" void idle_signal_timer() { g_evt_timer = true; }
+extern "C" void idle_signal_input() { g_evt_input = true; thread_notify_ui(); }
 extern "C" void mark_screen_dirty() { g_evt_dirty = true; }
 
-static void init_screen_timer(uint16_t hz) {
-    uint16_t divisor = 1193182 / hz;
-    outb(0x43, 0x36);
-    outb(0x40, divisor & 0xFF);
-    outb(0x40, (divisor >> 8) & 0xFF);
+// IRQ0 is a one-shot wakeup armed by the idle loop; the interrupt itself is
+// all it has to deliver (frame ticks are derived from the TSC).
+static void pit_irq(InterruptFrame*) {}
+
+static const char* const g_exception_names[32] = {
+    "Divide error", "Debug", "NMI", "Breakpoint", "Overflow", "Bound range", "Invalid opcode",
+    "Device not available", "Double fault", "Coprocessor overrun", "Invalid TSS",
+    "Segment not present", "Stack fault", "General protection", "Page fault", "Reserved",
+    "x87 FPU error", "Alignment check", "Machine check", "SIMD FP exception", "Virtualization",
+    "Control protection", "Reserved", "Reserved", "Reserved", "Reserved", "Reserved", "Reserved",
+    "Hypervisor injection", "VMM communication", "Security", "Reserved"
+};
+
+// CPU exceptions are fatal: paint the fault over the top of the screen and halt.
+void interrupt_exception(InterruptFrame* frame) {
+    irq_disable();
+    if (backbuffer) {
+        char eip[9], err[9], msg[128];
+        uint32_to_hex_string(frame->eip, eip);
+        uint32_to_hex_string(frame->error, err);
+        snprintf(msg, 128, "KERNEL PANIC: %s (vector %d) at EIP %s, error %s",
+                 g_exception_names[frame->vector & 31], (int)frame->vector, eip, err);
+        g_dl_record = nullptr;
+        clip_reset();
+        draw_rect_filled(0, 0, fb_info.width, 32, ColorPalette::BUTTON_CLOSE);
+        draw_string(msg, 8, 12, ColorPalette::TEXT_WHITE);
+        present_invalidate_all();
+        swap_buffers();
+    }
+    for (;;) asm volatile ("cli; hlt");
+}
+
+static void latency_print_histogram(const char* label, const LatencyHistogram& h) {
+    char msg[128];
+    if (h.samples == 0) {
+        snprintf(msg, 128, "%s: no samples\n", label);
+        wm.print_to_focused(msg);
+        return;
+    }
+    snprintf(msg, 128, "%s: %d samples, p50 < %d us, p95 < %d us, p99 < %d us, max %d us\n", label,
+             (int)h.samples, (int)h.percentile(50), (int)h.percentile(95), (int)h.percentile(99), (int)h.max_us);
+    wm.print_to_focused(msg);
+    // Compact distribution: "<bound:count" for every non-empty bucket.
+    char* p = msg;
+    char* end = msg + sizeof(msg);
+    p += snprintf(p, end - p, " ");
+    for (int b = 0; b < LatencyHistogram::BUCKETS && end - p > 16; b++) {
+        if (!h.counts[b]) continue;
+        p += snprintf(p, end - p, " <%d:%d", (int)(2u << b), (int)h.counts[b]);
+    }
+    snprintf(p, end - p, "\n");
+    wm.print_to_focused(msg);
+}
+
+void latency_command(const char* args) {
+    if (strcmp(args, "reset") == 0) {
+        memset(&g_latency, 0, sizeof(g_latency));
+        wm.print_to_focused("Latency histograms cleared.\n");
+        return;
+    }
+    char msg[96];
+    snprintf(msg, 96, "Input-to-photon latency (%d via WM, %d via VM):\n", (int)g_latency.via_wm, (int)g_latency.via_vm);
+    wm.print_to_focused(msg);
+    latency_print_histogram("IRQ to dequeue", g_latency.queue);
+    latency_print_histogram("IRQ to handled", g_latency.handled);
+    latency_print_histogram("IRQ to present", g_latency.photon);
+}
+
+void usb_print_devices() {
+    if (!g_xhci.present) {
+        wm.print_to_focused("No xHCI controller.\n");
+        return;
+    }
+    char msg[96], hex[9];
+    uint32_to_hex_string(g_xhci.mmio, hex);
+    if (g_xhci.irq >= 0) snprintf(msg, 96, "xHCI at 0x%s, %d ports, IRQ %d\n", hex, (int)g_xhci.max_ports, g_xhci.irq);
+    else snprintf(msg, 96, "xHCI at 0x%s, %d ports, polled every %d ms\n", hex, (int)g_xhci.max_ports, (int)XHCI_POLL_MS);
+    wm.print_to_focused(msg);
+    for (int i = 0; i < g_xhci.hid_count; i++) {
+        const XhciHid& h = g_xhci.hid[i];
+        snprintf(msg, 96, "  port %d slot %d: boot %s, endpoint %d\n", (int)h.port, (int)h.slot,
+                 h.protocol == HID_PROTOCOL_KEYBOARD ? "keyboard" : "mouse", (int)(h.dci >> 1));
+        wm.print_to_focused(msg);
+    }
+    snprintf(msg, 96, "HID reports: %d\n", (int)g_xhci.reports);
+    wm.print_to_focused(msg);
+}
+
+void thread_print_stats() {
+    static const char* const states[] = { "free", "ready", "sleeping", "blocked", "dead" };
+    static const char* const classes[] = { "ui", "interactive", "background", "idle" };
+    char msg[96];
+    uint32_t flags = irq_save();
+    uint64_t now = rdtsc();
+    for (int i = 0; i < MAX_THREADS; i++) {
+        const Thread& t = g_threads[i];
+        if (t.state == THREAD_FREE || t.state == THREAD_DEAD) continue;
+        uint64_t cycles = t.cycles + (&t == g_current ? now - t.ran_at : 0);
+        snprintf(msg, 96, "%d %s: %s, %s, %d ms CPU, %d switches\n", i, t.name, classes[t.priority],
+                 &t == g_current ? "running" : states[t.state], (int)u64_div32(cycles, g_tsc_khz), (int)t.switches);
+        irq_restore(flags);
+        wm.print_to_focused(msg);
+        flags = irq_save();
+    }
+    irq_restore(flags);
+    snprintf(msg, 96, "Coroutine tasks: %d spawned, %d running\n", (int)g_coro_spawned,
+             (int)(g_coro_spawned - g_coro_finished));
+    wm.print_to_focused(msg);
+}
+
+void irq_print_stats() {
+    static const char* const names[16] = { "timer", "keyboard", "cascade", "com2", "com1", "lpt2",
+        "floppy", "lpt1", "rtc", "irq9", "irq10", "irq11", "ps2 aux", "fpu", "ata1", "ata2" };
+    char msg[96];
+    for (int i = 0; i < 16; i++) {
+        if (!g_irq_handlers[i][0] && !g_irq_counts[i]) continue;
+        snprintf(msg, 96, "IRQ %d (%s): %d\n", i, names[i], (int)g_irq_counts[i]);
+        wm.print_to_focused(msg);
+    }
+    snprintf(msg, 96, "Spurious: %d\n", (int)g_spurious_irqs);
+    wm.print_to_focused(msg);
+    snprintf(msg, 96, "Input events: %d, motion coalesced: %d, dropped: %d, max wait %d us\n",
+             (int)g_input_stats.events, (int)g_input_stats.coalesced, (int)g_input_stats.dropped,
+             (int)u64_div32(cycles_to_ns(g_input_stats.max_wait_cycles), 1000));
+    wm.print_to_focused(msg);
+}
+
+static const uint32_t PIT_HZ = 1193182;
+
+// Arms PIT channel 0 in mode 0 (interrupt on terminal count) so IRQ0 fires
+// once after `ns`, clamped to the 16-bit counter (about 55 ms). Reloading
+// the count restarts it, so re-arming before it fires is safe.
+static void pit_arm_oneshot(uint64_t ns) {
+    uint64_t count = u64_div32(ns * PIT_HZ, 1000000000);
+    if (count < 1) count = 1;
+    if (count > 0xFFFF) count = 0xFFFF;
+    outb(0x43, 0x30);
+    outb(0x40, count & 0xFF);
+    outb(0x40, (count >> 8) & 0xFF);
 }
 
 // =============================================================================
@@ -5899,7 +10065,7 @@ void init_exec_subsystem() {
 // Find free run slot
 static int allocate_run_slot() {
     for (int i = 0; i < MAX_RUN_PROCESSES; i++) {
-        if (!run_contexts[i].active) {
+        if (!run_contexts[i].active && !run_contexts[i].vm.smp_owned) {
             return i;
         }
     }
@@ -5985,7 +10151,7 @@ static int allocate_exec_slot() {
     static int next_exec_id = 1;
     
     for (int i = 0; i < MAX_EXEC_PROCESSES; i++) {
-        if (!exec_contexts[i].active) {
+        if (!exec_contexts[i].active && !exec_contexts[i].vm.smp_owned) {
             exec_contexts[i].exec_id = next_exec_id++;
             return i;
         }
@@ -6209,70 +10375,495 @@ MIGRATION PATH:
 */
 
 // Add to your kernel_main() loop:
-void process_all_vms() {
+void process_all_vms(int steps = 100) {
     // Process run VMs (disk-based)
-    tick_run_processes(100);  // 100 instructions per tick
+    tick_run_processes(steps);
     
     // Process exec VMs (memory-based)
-    tick_exec_processes(100); // 100 instructions per tick
+    tick_exec_processes(steps);
 }
-extern "C" void kernel_main(uint32_t magic, uint32_t multiboot_addr) {
-    // --- INITIALIZATION --- (unchanged)
-    static uint8_t kernelheap[1024 * 1024 * 8];
-    g_allocator.init(kernelheap, sizeof(kernelheap));
-    
-    multiboot_info* mbi = (multiboot_info*)multiboot_addr;
-    if (!(mbi->flags & (1 << 12))) return;
 
-    fb_info = { 
-        (uint32_t*)(uint64_t)mbi->framebuffer_addr, 
-        mbi->framebuffer_width, 
-        mbi->framebuffer_height, 
-        mbi->framebuffer_pitch 
-    };
-    
-    backbuffer = new uint32_t[fb_info.width * fb_info.height];
-    
-    g_gfx.init(false);
-    initialize_vm_subsystems();
-    launch_new_terminal();
-    
+// True if any VM is active and not blocked waiting for a key or a timer.
+bool vms_runnable() {
+    for (int i = 0; i < MAX_RUN_PROCESSES; i++)
+        if (run_contexts[i].active && !run_contexts[i].vm.waiting_for_input && !run_contexts[i].vm.sleeping && !run_contexts[i].vm.io_pending) return true;
+    for (int i = 0; i < MAX_EXEC_PROCESSES; i++)
+        if (exec_contexts[i].active && !exec_contexts[i].vm.waiting_for_input && !exec_contexts[i].vm.sleeping && !exec_contexts[i].vm.io_pending) return true;
+    return false;
+}
+
+// =============================================================================
+// SMP VM SCHEDULING
+// =============================================================================
+// Once APs are online the BSP stops running VM code. Each main-loop pass
+// hands every runnable program to the AP with the shortest run queue and
+// collects the ones the APs have handed back. An AP round-robins its own
+// queue in SMP_SLICE_MS slices. When its queue runs dry it steals the newest
+// entry from the longest one. A program goes back to the BSP when it exits
+// or parks (input, sleep, file I/O). It also goes back at an op that needs
+// the timer wheel or the filesystem, which are BSP-only, and the BSP runs
+// that op for it. `smp_owned` says which side has the VM.
+static const uint32_t SMP_SLICE_MS = 5;
+static const int SMP_TICK_STEPS = 256;
+static_assert(VM_RUNQ_MAX >= MAX_RUN_PROCESSES + MAX_EXEC_PROCESSES, "a run queue must hold every VM");
+
+static inline bool vm_runnable(const TinyVM& vm) {
+    return vm.is_running && !vm.waiting_for_input && !vm.sleeping && !vm.io_pending && !vm.needs_bsp;
+}
+
+// Queues `vm` on `cpu`; true if the CPU is halted and needs a wakeup.
+static bool runq_push(Cpu* cpu, TinyVM* vm) {
+    uint32_t flags = cpu->lock.lock();
+    cpu->runq[(cpu->head + cpu->count) % VM_RUNQ_MAX] = vm;
+    cpu->count = cpu->count + 1;
+    bool halted = cpu->idle;
+    cpu->lock.unlock(flags);
+    return halted;
+}
+
+static TinyVM* runq_pop(Cpu* cpu, bool newest) {
+    uint32_t flags = cpu->lock.lock();
+    TinyVM* vm = nullptr;
+    if (cpu->count) {
+        cpu->count = cpu->count - 1;
+        if (newest) {
+            vm = cpu->runq[(cpu->head + cpu->count) % VM_RUNQ_MAX];
+        } else {
+            vm = cpu->runq[cpu->head];
+            cpu->head = (cpu->head + 1) % VM_RUNQ_MAX;
+        }
+    }
+    cpu->lock.unlock(flags);
+    return vm;
+}
+
+static TinyVM* smp_steal(Cpu* self) {
+    Cpu* victim = nullptr;
+    for (int i = 1; i < g_cpu_count; i++) {
+        Cpu* c = &g_cpus[i];
+        if (c != self && c->count && (!victim || c->count > victim->count)) victim = c;
+    }
+    TinyVM* vm = victim ? runq_pop(victim, true) : nullptr;
+    if (vm) self->steals++;
+    return vm;
+}
+
+// Halts until the wakeup IPI, unless work arrived since the queue was last
+// looked at. The flag is set under the queue lock, so a push either sees it
+// or is seen here.
+static void smp_idle(Cpu* cpu) {
+    uint32_t flags = cpu->lock.lock();
+    bool empty = cpu->count == 0;
+    cpu->idle = empty;
+    cpu->lock.unlock(flags);
+    if (empty) asm volatile ("sti; hlt; cli" ::: "memory");
+    cpu->idle = false;
+}
+
+static void smp_kick_idle(const Cpu* self) {
+    for (int i = 1; i < g_cpu_count; i++) {
+        if (&g_cpus[i] != self && g_cpus[i].idle) { smp_wake(i); return; }
+    }
+}
+
+static void smp_ap_main(Cpu* cpu) {
+    for (;;) {
+        TinyVM* vm = runq_pop(cpu, false);
+        if (!vm) vm = smp_steal(cpu);
+        if (!vm) { smp_idle(cpu); continue; }
+
+        uint64_t start = rdtsc();
+        uint64_t end = start + (uint64_t)SMP_SLICE_MS * g_tsc_khz;
+        while (vm->tick(SMP_TICK_STEPS) && vm_runnable(*vm) && rdtsc() < end) {}
+        cpu->busy_cycles += rdtsc() - start;
+        cpu->slices++;
+
+        if (vm_runnable(*vm)) {
+            runq_push(cpu, vm);
+            if (cpu->count > 1) smp_kick_idle(cpu);   // someone can steal
+        } else {
+            asm volatile ("" ::: "memory");
+            vm->smp_owned = false;
+            smp_wake(0);
+        }
+    }
+}
+
+static void smp_enqueue(TinyVM* vm) {
+    int best = 1;
+    for (int i = 2; i < g_cpu_count; i++) if (g_cpus[i].count < g_cpus[best].count) best = i;
+    vm->smp_owned = true;
+    if (runq_push(&g_cpus[best], vm)) smp_wake(best);
+}
+
+static bool smp_schedule_vm(TinyVM& vm, bool& active, const char* kind) {
+    if (!active || vm.smp_owned) return false;
+    asm volatile ("" ::: "memory");
+    bool ran = false;
+    if (vm.needs_bsp) {
+        vm.needs_bsp = false;
+        vm.tick(1);
+        ran = true;
+    }
+    if (!vm.is_running) {
+        active = false;
+        job_output_drain();     // the program's last words first
+        char msg[128];
+        snprintf(msg, 128, "%s process exited with code: %d\n", kind, vm.exit_code);
+        wm.print_to_focused(msg);
+    } else if (vm_runnable(vm)) {
+        smp_enqueue(&vm);
+    }
+    return ran;
+}
+
+// BSP: one scheduling pass. True if it ran VM code itself.
+static bool smp_schedule_vms() {
+    bool ran = false;
+    for (int i = 0; i < MAX_RUN_PROCESSES; i++)
+        ran |= smp_schedule_vm(run_contexts[i].vm, run_contexts[i].active, "RUN");
+    for (int i = 0; i < MAX_EXEC_PROCESSES; i++)
+        ran |= smp_schedule_vm(exec_contexts[i].vm, exec_contexts[i].active, "EXEC");
+    return ran;
+}
+
+void smp_print_stats() {
+    char msg[112];
+    for (int i = 0; i < g_cpu_count; i++) {
+        const Cpu& c = g_cpus[i];
+        if (i == 0)
+            snprintf(msg, 112, "CPU 0 (APIC %d): desktop and devices\n", (int)c.apic_id);
+        else
+            snprintf(msg, 112, "CPU %d (APIC %d): %d ms busy, %d slices, %d steals, %d queued%s\n", i,
+                     (int)c.apic_id, (int)u64_div32(c.busy_cycles, g_tsc_khz), (int)c.slices,
+                     (int)c.steals, (int)c.count, c.idle ? ", idle" : "");
+        wm.print_to_focused(msg);
+    }
+}
+
+// =============================================================================
+// FRAME-BUDGET GOVERNOR
+// =============================================================================
+// Paces the main loop against the TSC instead of loop iterations. Every frame
+// period (1/hz) advances g_timer_ticks and allows one render. The measured
+// render cost (moving average) is reserved out of each period; the rest goes
+// to VM batches sized from the measured cost per VM step. A batch never runs
+// longer than VM_SLICE_MS, so polled input is still serviced promptly.
+//
+// When rendering eats more than half a period, the next render is deferred
+// by the render cost, so CPU-bound VMs keep at least half the CPU. Frames with
+// nothing dirty are not rendered at all.
+//
+// The loop is tickless: when no VM is runnable and no input is queued it
+// asks next_deadline() when work is next due (a frame, if anything is dirty,
+// or the earliest kernel timer) and sleeps the UI thread until then or until
+// input arrives. Background threads run while it sleeps; with none ready the
+// idle thread halts, and with nothing due at all the PIT is left unarmed.
+struct FrameGovernor {
+    static const uint32_t VM_SLICE_MS = 2;
+    static const int MIN_VM_STEPS = 16;
+    static const int MAX_VM_STEPS = 50000;
+
+    static const uint64_t NO_DEADLINE = ~0ull;
+
+    uint64_t frame_cycles;
+    uint64_t next_tick;
+    uint64_t render_not_before;
+    uint64_t render_cost;       // cycles, moving average
+    uint32_t step_cost;         // cycles per VM step, moving average
+    uint32_t frames_rendered, frames_idle, frames_deferred;
+    bool deferring;             // the frame now due was already counted as deferred
+    uint64_t vm_steps;
+    uint64_t started, idle_cycles;
+    uint32_t halts;
+
+    void init(uint32_t hz) {
+        frame_cycles = u64_div32((uint64_t)tsc_calibrate_khz() * 1000, hz);
+        started = rdtsc();
+        next_tick = started + frame_cycles;
+        render_not_before = 0;
+        render_cost = 0;
+        step_cost = 100;
+        frames_rendered = frames_idle = frames_deferred = 0;
+        deferring = false;
+        vm_steps = 0;
+        idle_cycles = 0;
+        halts = 0;
+    }
+
+    // Advances g_timer_ticks by every period that has elapsed (a long halt
+    // can span many); true if a frame is due.
+    bool tick(uint64_t now) {
+        if (now < next_tick) return false;
+        uint32_t periods = (uint32_t)u64_div32(now - next_tick, (uint32_t)frame_cycles) + 1;
+        next_tick += (uint64_t)periods * frame_cycles;
+        g_timer_ticks = g_timer_ticks + periods;
+        idle_signal_timer();
+        return true;
+    }
+
+    // TSC at which the main loop next has work, or NO_DEADLINE.
+    uint64_t next_deadline(bool dirty) const {
+        uint64_t deadline = NO_DEADLINE;
+        if (dirty) deadline = next_tick > render_not_before ? next_tick : render_not_before;
+        uint64_t due_ms = g_timers.next_expiry();
+        if (due_ms != ~0ull) {
+            uint64_t t = g_tsc_boot + due_ms * g_tsc_khz;
+            if (t < deadline) deadline = t;
+        }
+        return deadline;
+    }
+
+    // Sleeps until `deadline` or the next input. Interrupts are disabled
+    // across the final checks so neither an IRQ nor the deadline passing just
+    // before the sleep can be slept through; the scheduler arms the PIT for
+    // the deadline, also with interrupts off.
+    void idle_until(uint64_t deadline) {
+        uint64_t now = rdtsc();
+        if (deadline <= now) return;
+        irq_disable();
+        if (g_input_queue.empty() && !g_evt_input && rdtsc() < deadline) {
+            thread_sleep_until(deadline, true);
+            halts++;
+        }
+        irq_enable();
+        idle_cycles += rdtsc() - now;
+    }
+
+    // A dirty frame held back counts once as deferred, however many loop
+    // passes it waits.
+    bool may_render(uint64_t now, bool dirty) {
+        if (now >= render_not_before) {
+            deferring = false;
+            return true;
+        }
+        if (dirty && !deferring) {
+            frames_deferred++;
+            deferring = true;
+        }
+        return false;
+    }
+
+    void rendered(uint64_t t0, uint64_t t1) {
+        uint64_t cost = t1 - t0;
+        render_cost = (render_cost * 7 + cost) >> 3;
+        frames_rendered++;
+        g_render_state.lastFrameTick = g_timer_ticks;
+        render_not_before = (render_cost > (frame_cycles >> 1)) ? t1 + render_cost : 0;
+    }
+
+    void idle_frame() { frames_idle++; }
+
+    // Runs one VM batch sized to the time left before the next frame (minus
+    // the expected render cost). Returns true if any VM ran.
+    bool run_vms() {
+        if (g_cpu_count > 1) return smp_schedule_vms();
+        if (!vms_runnable()) return false;
+
+        uint64_t now = rdtsc();
+        uint64_t slice_end = now + (uint64_t)tsc_calibrate_khz() * VM_SLICE_MS;
+        uint64_t frame_end = next_tick > render_cost ? next_tick - render_cost : 0;
+        uint64_t end = frame_end < slice_end ? frame_end : slice_end;
+
+        int steps = MIN_VM_STEPS;
+        if (end > now) {
+            uint64_t s = u64_div32(end - now, step_cost);
+            steps = s > (uint64_t)MAX_VM_STEPS ? MAX_VM_STEPS : (s < (uint64_t)MIN_VM_STEPS ? MIN_VM_STEPS : (int)s);
+        }
+
+        process_all_vms(steps);
+        uint64_t spent = rdtsc() - now;
+        uint32_t per_step = (uint32_t)u64_div32(spent, steps);
+        if (per_step == 0) per_step = 1;
+        step_cost = (step_cost * 3 + per_step) >> 2;
+        if (step_cost == 0) step_cost = 1;
+        vm_steps += steps;
+        return true;
+    }
+};
+
+static FrameGovernor g_governor;
+
+void governor_print_stats() {
+    char msg[128];
+    uint32_t khz = tsc_calibrate_khz();
+    uint32_t total_ms = (uint32_t)u64_div32(rdtsc() - g_governor.started, khz);
+    uint32_t idle_ms = (uint32_t)u64_div32(g_governor.idle_cycles, khz);
+    snprintf(msg, 128, "UI thread: %d ms asleep of %d ms (%d%%), %d sleeps\n", (int)idle_ms, (int)total_ms,
+             total_ms ? (int)u64_div32((uint64_t)idle_ms * 100, total_ms) : 0, (int)g_governor.halts);
+    wm.print_to_focused(msg);
+    snprintf(msg, 128, "Frames: %d rendered, %d idle, %d deferred\n",
+             (int)g_governor.frames_rendered, (int)g_governor.frames_idle, (int)g_governor.frames_deferred);
+    wm.print_to_focused(msg);
+    snprintf(msg, 128, "Render: %d us avg, budget %d us; VM: %d cycles/step, %d K steps\n",
+             (int)u64_div32(g_governor.render_cost * 1000, khz),
+             (int)u64_div32(g_governor.frame_cycles * 1000, khz),
+             (int)g_governor.step_cost, (int)u64_div32(g_governor.vm_steps, 1000));
+    wm.print_to_focused(msg);
+}
+// =============================================================================
+// BOOT PROFILER AND DEFERRED INIT
+// =============================================================================
+// kernel_main brings up only what the first frame needs: clock, interrupts,
+// graphics and the terminal. Device probing runs afterwards as a chain of
+// timer-wheel callbacks started by the first frame, so the desktop is
+// already on screen during the USB handoff, the PS/2 mouse handshake, the
+// PCI scan for AHCI and the FAT mount. A step returns how long to wait
+// before the next one; the loop renders or halts in between instead of
+// spinning. Each stage is stamped with the TSC when it ends; `bootprof`
+// prints the breakdown.
+struct BootStage {
+    const char* name;
+    uint64_t tsc;
+};
+
+static const int MAX_BOOT_STAGES = 24;
+static BootStage g_boot_stages[MAX_BOOT_STAGES];
+static int g_boot_stage_count = 0;
+
+static void boot_mark(const char* name) {
+    if (g_boot_stage_count < MAX_BOOT_STAGES)
+        g_boot_stages[g_boot_stage_count++] = BootStage{ name, rdtsc() };
+}
+
+void boot_print_profile() {
+    char msg[96];
+    uint64_t prev = g_tsc_boot;
+    for (int i = 0; i < g_boot_stage_count; i++) {
+        const BootStage& st = g_boot_stages[i];
+        snprintf(msg, 96, "%s: %d us (at %d ms)\n", st.name,
+                 (int)u64_div32(cycles_to_ns(st.tsc - prev), 1000),
+                 (int)u64_div32(st.tsc - g_tsc_boot, g_tsc_khz));
+        wm.print_to_focused(msg);
+        prev = st.tsc;
+    }
+}
+
+static const uint32_t PS2_SETTLE_MS = 100;   // after the USB legacy handoff
+
+static uint32_t boot_step_usb() {
     enable_usb_legacy_support();
+    boot_mark("USB legacy handoff");
+    return 0;
+}
 
-    for (int i = 0; i < 100000; i++) io_wait_short();
+static uint32_t boot_step_xhci() {
+    if (xhci_init()) {
+        char msg[64];
+        snprintf(msg, 64, "xHCI: %d HID boot device(s).\n", g_xhci.hid_count);
+        wm.print_to_focused(msg);
+    }
+    boot_mark("xHCI HID");
+    return PS2_SETTLE_MS;
+}
 
+static uint32_t boot_step_input() {
+    // The mouse handshake polls the controller, so keep the PS/2 IRQs
+    // masked until it is done or they would eat the replies.
     outb(0x64, 0xFF);
     io_delay_long();
     ps2_flush_output_buffer();
-    
     if (initialize_universal_mouse()) {
         wm.print_to_focused("Universal mouse driver initialized.\n");
     } else {
         wm.print_to_focused("WARNING: Mouse initialization failed.\n");
     }
+    ps2_flush_output_buffer();
+    irq_install(1, ps2_irq);
+    irq_install(12, ps2_irq);
+    boot_mark("PS/2 keyboard and mouse");
+    return 0;
+}
 
+static uint32_t boot_step_storage() {
     disk_init();
-    if(ahci_base) fat32_init();
-    
+    boot_mark("AHCI probe");
+    if (ahci_base) fat32_init();
+    boot_mark("FAT32 mount");
+
     if(ahci_base) 
         wm.print_to_focused("AHCI disk found.\n"); 
     else 
         wm.print_to_focused("AHCI disk NOT found.\n");
-    
+    return 0;
+}
+
+static uint32_t boot_step_smp() {
+    if (smp_init() > 1) {
+        char msg[64];
+        snprintf(msg, 64, "SMP: %d CPUs online; programs run on the APs.\n", g_cpu_count);
+        wm.print_to_focused(msg);
+    }
+    boot_mark("SMP bring-up");
+    return 0;
+}
+
+static uint32_t boot_step_desktop() {
     if(current_directory_cluster) {
         wm.print_to_focused("FAT32 FS initialized.\n"); 
         wm.load_desktop_items();
+        mark_screen_dirty();
     }
     else 
         wm.print_to_focused("FAT32 init failed.\n");
+    boot_mark("desktop items");
+    return 0;
+}
+
+static uint32_t (*const g_boot_steps[])() = { boot_step_usb, boot_step_xhci, boot_step_input, boot_step_storage, boot_step_smp, boot_step_desktop };
+static const int BOOT_STEP_COUNT = sizeof(g_boot_steps) / sizeof(g_boot_steps[0]);
+static int g_boot_step = 0;
+static KTimer g_boot_timer;
+
+static void boot_deferred(void*) {
+    uint32_t delay_ms = g_boot_steps[g_boot_step++]();
+    if (g_boot_step < BOOT_STEP_COUNT) timer_arm(&g_boot_timer, delay_ms, boot_deferred, nullptr);
+    else boot_mark("boot complete");
+}
+
+extern "C" void kernel_main(uint32_t magic, uint32_t multiboot_addr) {
+    // --- INITIALIZATION --- (unchanged)
+    static uint8_t kernelheap[1024 * 1024 * 16];
+    g_allocator.init(kernelheap, sizeof(kernelheap));
+    clock_init();
+    g_timers.init(now_ms());
+    boot_mark("heap and clock");
+    
+    multiboot_info* mbi = (multiboot_info*)multiboot_addr;
+    if (!(mbi->flags & (1 << 12))) return;
+
+    fb_info = { 
+        (uint32_t*)(uint64_t)mbi->framebuffer_addr, 
+        mbi->framebuffer_width, 
+        mbi->framebuffer_height, 
+        mbi->framebuffer_pitch 
+    };
+    
+    interrupts_init();
+    boot_mark("GDT, IDT and PIC");
+    simd_init();
+    threads_init();
+    g_gfx.init(mbi);
+    backbuffer = new uint32_t[surface_words(fb_info.width, fb_info.height)];
+    bake_native_palette();
+    bake_icon_sprites();
+    boot_mark("graphics");
+    initialize_vm_subsystems();
+    launch_new_terminal();
+    boot_mark("VMs and terminal");
 
-    init_screen_timer(30);
+    // PS/2, disk and desktop come up in boot_deferred() after the first frame.
+    g_governor.init(30);
+    pit_arm_oneshot(0);     // out of the BIOS's periodic mode; the scheduler re-arms it
+    irq_install(0, pit_irq);
+    irq_enable();
 
     uint32_t last_paint_tick = 0;
     const uint32_t TICKS_PER_FRAME = 1;
 
     int prev_mouse_x = mouse_x;
     int prev_mouse_y = mouse_y;
+    const int INPUT_PASSES_PER_FRAME = 64;
     
     g_gfx.clear_screen(ColorPalette::DESKTOP_BLUE);
 
@@ -6280,101 +10871,141 @@ extern "C" void kernel_main(uint32_t magic, uint32_t multiboot_addr) {
     // MAIN LOOP - PERFECT: KEYBOARD + MOUSE CLICKS BOTH WORK
     // =============================================================================
     for (;;) {
-        // **CRITICAL MOUSE FIX #1**: Save mouse state BEFORE polling
-        bool prev_left = mouse_left_down;
-        bool prev_right = mouse_right_down;
-
-        // 1. Poll input (updates mouse_left_down, mouse_right_down, last_key_press)
-        poll_input_universal();
-        process_all_vms();
-
-        // **CRITICAL MOUSE FIX #2**: Detect clicks using PREVIOUS frame state
-        bool leftClickedThisFrame = (mouse_left_down && !prev_left);
-        bool rightClickedThisFrame = (mouse_right_down && !prev_right);
-
-        // 2. Set input flags
-        bool mouse_moved = (mouse_x != prev_mouse_x || mouse_y != prev_mouse_y);
-        bool key_pressed = (last_key_press != 0);
-
-        if (key_pressed || mouse_moved || leftClickedThisFrame || rightClickedThisFrame) {
-            g_evt_input = true;
-            g_input_state.hasNewInput = true;
-            prev_mouse_x = mouse_x;
-            prev_mouse_y = mouse_y;
-        }
-
-        // 3. Timer
-        static uint32_t poll_counter = 0;
-        if (++poll_counter >= 500) {
-            poll_counter = 0;
-            g_evt_timer = true;
-            g_timer_ticks++;
-        }
+        // 1. Kernel timers, then the frame period from the governor; window events
+        g_timers.run(now_ms());
+        if (g_governor.tick(rdtsc())) {
+            wm.run_scheduled();
+        }
+
+        // Input is drained in a batch before the next render. Each pass ends at
+        // a key press or a button change, so the WM sees every edge in order.
+        bool handled_input = false;
+        for (int pass = 0; pass < INPUT_PASSES_PER_FRAME; pass++) {
+            // **CRITICAL MOUSE FIX #1**: Save mouse state BEFORE polling
+            bool prev_left = mouse_left_down;
+            bool prev_right = mouse_right_down;
+
+            // 2. Poll input (updates mouse_left_down, mouse_right_down, last_key_press)
+            bool more_input = poll_input_universal();
+
+            // **CRITICAL MOUSE FIX #2**: Detect clicks using PREVIOUS frame state
+            bool leftClickedThisFrame = (mouse_left_down && !prev_left);
+            bool rightClickedThisFrame = (mouse_right_down && !prev_right);
+
+            // 3. Set input flags
+            bool mouse_moved = (mouse_x != prev_mouse_x || mouse_y != prev_mouse_y);
+            bool key_pressed = (last_key_press != 0);
+
+            if (key_pressed || mouse_moved || leftClickedThisFrame || rightClickedThisFrame) {
+                g_evt_input = true;
+                g_input_state.hasNewInput = true;
+                prev_mouse_x = mouse_x;
+                prev_mouse_y = mouse_y;
+            }
 
-        // 4. Handle input with proper isolation
-		if (g_evt_input) {
-			g_evt_input = false;
+            // 4. Handle input with proper isolation
+			if (g_evt_input) {
+				g_evt_input = false;
 			
-			// **CRITICAL FIX**: Only feed to VMs if they're ACTIVELY waiting
-			// AND the focused window is the one that started the VM
-			bool fed_to_vm = false;
+				// **CRITICAL FIX**: Only feed to VMs if they're ACTIVELY waiting
+				// AND the focused window is the one that started the VM
+				bool fed_to_vm = false;
 			
-			if (last_key_press != 0) {
-				// Check RUN processes - only feed if they're waiting AND bound to focused window
-				for (int i = 0; i < MAX_RUN_PROCESSES; i++) {
-					if (run_contexts[i].active && 
-						run_contexts[i].vm.waiting_for_input &&
-						run_contexts[i].vm.bound_window == wm.get_window(wm.get_focused_idx())) {
-						run_contexts[i].vm.feed_input(last_key_press);
-						fed_to_vm = true;
-						break; // Only feed to ONE VM
-					}
-				}
-				
-				// Check EXEC processes - only if no RUN process consumed it
-				if (!fed_to_vm) {
-					for (int i = 0; i < MAX_EXEC_PROCESSES; i++) {
-						if (exec_contexts[i].active && 
-							exec_contexts[i].vm.waiting_for_input &&
-							exec_contexts[i].vm.bound_window == wm.get_window(wm.get_focused_idx())) {
-							exec_contexts[i].vm.feed_input(last_key_press);
+				if (last_key_press != 0) {
+					// Check RUN processes - only feed if they're waiting AND bound to focused window
+					for (int i = 0; i < MAX_RUN_PROCESSES; i++) {
+						if (run_contexts[i].active && 
+							run_contexts[i].vm.waiting_for_input && !run_contexts[i].vm.smp_owned &&
+							run_contexts[i].vm.bound_window == wm.get_window(wm.get_focused_idx())) {
+							run_contexts[i].vm.feed_input(last_key_press);
 							fed_to_vm = true;
 							break; // Only feed to ONE VM
 						}
 					}
+				
+					// Check EXEC processes - only if no RUN process consumed it
+					if (!fed_to_vm) {
+						for (int i = 0; i < MAX_EXEC_PROCESSES; i++) {
+							if (exec_contexts[i].active && 
+								exec_contexts[i].vm.waiting_for_input && !exec_contexts[i].vm.smp_owned &&
+								exec_contexts[i].vm.bound_window == wm.get_window(wm.get_focused_idx())) {
+								exec_contexts[i].vm.feed_input(last_key_press);
+								fed_to_vm = true;
+								break; // Only feed to ONE VM
+							}
+						}
+					}
 				}
-			}
 			
-			// **KEY FIX**: Only send to WM if VM didn't consume it
-			// This allows terminal commands while no VM is waiting
-			if (!fed_to_vm) {
-				wm.handle_input(last_key_press, mouse_x, mouse_y, 
-							   mouse_left_down, leftClickedThisFrame, rightClickedThisFrame);
-			} else {
-				// VM consumed keyboard, but still process mouse for WM
-				wm.handle_input(0, mouse_x, mouse_y, 
-							   mouse_left_down, leftClickedThisFrame, rightClickedThisFrame);
-			}
+				// **KEY FIX**: Only send to WM if VM didn't consume it
+				// This allows terminal commands while no VM is waiting
+				if (!fed_to_vm) {
+					wm.handle_input(last_key_press, mouse_x, mouse_y, 
+								   mouse_left_down, leftClickedThisFrame, rightClickedThisFrame);
+				} else {
+					// VM consumed keyboard, but still process mouse for WM
+					wm.handle_input(0, mouse_x, mouse_y, 
+								   mouse_left_down, leftClickedThisFrame, rightClickedThisFrame);
+				}
 			
-			if (last_key_press != 0) last_key_press = 0;
-			g_evt_dirty = true;
-		}
+				if (g_input_stats.pass_first_tsc) g_latency.on_handled(g_input_stats.pass_first_tsc, fed_to_vm);
+				if (last_key_press != 0) last_key_press = 0;
+				g_evt_dirty = true;
+				handled_input = true;
+			}
+
+            if (!more_input) break;
+        }
+
+        if (handled_input) g_input_event.signal();
 
+        // Retire finished disk commands, then resume the coroutines they,
+        // the timers and the input event woke.
+        disk_pump();
+        g_coro_queue.run();
+
+        job_output_drain();
         wm.cleanup_closed_windows();
 
         // 5. Render
-        if (g_evt_timer && (g_timer_ticks - last_paint_tick) >= TICKS_PER_FRAME) {
+        if (g_evt_timer && (g_timer_ticks - last_paint_tick) >= TICKS_PER_FRAME &&
+            g_governor.may_render(rdtsc(), g_evt_dirty || g_input_state.hasNewInput)) {
             if (g_evt_dirty || g_input_state.hasNewInput) {
+                uint64_t t0 = rdtsc();
                 last_paint_tick = g_timer_ticks;
                 g_evt_dirty = false;
                 g_input_state.hasNewInput = false;
 
-                g_gfx.clear_screen(ColorPalette::DESKTOP_BLUE);
+                wm.track_cursor(mouse_x, mouse_y);
                 wm.update_all();
                 draw_cursor(mouse_x, mouse_y, ColorPalette::CURSOR_WHITE);
                 swap_buffers();
+                uint64_t t1 = rdtsc();
+                g_latency.on_present(t1);
+                g_governor.rendered(t0, t1);
+                if (g_governor.frames_rendered == 1) {
+                    boot_mark("first frame");
+                    timer_arm(&g_boot_timer, 0, boot_deferred, nullptr);
+                }
+            } else {
+                g_governor.idle_frame();
             }
             g_evt_timer = false;
         }
+
+        // 6. Spend what is left of the frame on VMs (their output invalidates
+        // the bound window, which requests a frame).
+        // 7. With nothing to run, sleep until the next deadline or interrupt.
+        // Polled disk completions keep the loop awake; interrupt-driven ones
+        // wake it, with a watchdog for timeouts.
+        if (!g_governor.run_vms() && g_input_queue.empty() && !g_evt_input &&
+            g_coro_queue.empty() && (!disk_busy() || g_ahci_irq >= 0)) {
+            uint64_t deadline = g_governor.next_deadline(g_evt_dirty || g_input_state.hasNewInput);
+            if (disk_busy()) {
+                uint64_t watchdog = rdtsc() + (uint64_t)AHCI_WATCHDOG_MS * g_tsc_khz;
+                if (watchdog < deadline) deadline = watchdog;
+            }
+            g_governor.idle_until(deadline);
+        }
     }
 }
\ No newline at end of file